@@ -0,0 +1,110 @@
+#include "FrameGovernor.hpp"
+
+// In the order in which they are given up.
+static const RenderFeatures::Flag SheddableFeatures[] = {
+    RenderFeatures::TileAnimation,
+    RenderFeatures::Particles,
+};
+static constexpr int SheddableFeatureCount = sizeof(SheddableFeatures) / sizeof(SheddableFeatures[0]);
+
+// Internal resolutions, in eighths of the largest one.
+static const int ResolutionEighths[] = {8, 7, 6, 5, 4, 3};
+static constexpr int ResolutionStepCount = sizeof(ResolutionEighths) / sizeof(ResolutionEighths[0]);
+
+static constexpr float AverageTimeWeight = 0.1f;
+
+// A change draws the whole framebuffer again, so the frames right after it are
+// not measured.
+static constexpr int SettlingFrameCount = 30;
+
+// Going down reacts quickly, going up waits for a steady headroom.
+static constexpr int SlowFrameCount = 10;
+static constexpr int FastFrameCount = 120;
+static constexpr float HeadroomFraction = 0.75f;
+static constexpr float FeatureHeadroomFraction = 0.5f;
+
+FrameGovernor::FrameGovernor(int maxWidth, int maxHeight, float budgetMilliseconds)
+    : maxWidth(maxWidth), maxHeight(maxHeight), budget(budgetMilliseconds)
+{
+    changeLevel(0, 0);
+}
+
+void FrameGovernor::startAt(int width, int height)
+{
+    for(int i = 0; i < ResolutionStepCount; ++i)
+    {
+        if(maxWidth*ResolutionEighths[i]/8 <= width && maxHeight*ResolutionEighths[i]/8 <= height)
+        {
+            changeLevel(i, 0);
+            return;
+        }
+    }
+
+    changeLevel(ResolutionStepCount - 1, 0);
+}
+
+bool FrameGovernor::addFrameTime(float milliseconds)
+{
+    if(budget <= 0.0f)
+        return false;
+
+    if(settlingFrames > 0)
+    {
+        --settlingFrames;
+        averageTime = milliseconds;
+        return false;
+    }
+
+    averageTime += (milliseconds - averageTime)*AverageTimeWeight;
+
+    slowFrames = averageTime > budget ? slowFrames + 1 : 0;
+    if(slowFrames >= SlowFrameCount)
+    {
+        if(shedFeatureCount < SheddableFeatureCount)
+            changeLevel(resolutionStep, shedFeatureCount + 1);
+        else if(resolutionStep + 1 < ResolutionStepCount)
+            changeLevel(resolutionStep + 1, shedFeatureCount);
+        else
+            return false;
+        return true;
+    }
+
+    // The cost of a resolution is estimated from its number of pixels.
+    bool hasHeadroom = false;
+    if(resolutionStep > 0)
+    {
+        auto scale = float(ResolutionEighths[resolutionStep - 1]) / ResolutionEighths[resolutionStep];
+        hasHeadroom = averageTime*scale*scale < budget*HeadroomFraction;
+    }
+    else if(shedFeatureCount > 0)
+    {
+        hasHeadroom = averageTime < budget*FeatureHeadroomFraction;
+    }
+
+    fastFrames = hasHeadroom ? fastFrames + 1 : 0;
+    if(fastFrames < FastFrameCount)
+        return false;
+
+    if(resolutionStep > 0)
+        changeLevel(resolutionStep - 1, shedFeatureCount);
+    else
+        changeLevel(resolutionStep, shedFeatureCount - 1);
+    return true;
+}
+
+void FrameGovernor::changeLevel(int newResolutionStep, int newShedFeatureCount)
+{
+    resolutionStep = newResolutionStep;
+    shedFeatureCount = newShedFeatureCount;
+
+    settings.viewWidth = maxWidth*ResolutionEighths[resolutionStep]/8;
+    settings.viewHeight = maxHeight*ResolutionEighths[resolutionStep]/8;
+    settings.features = RenderFeatures::All;
+    for(int i = 0; i < shedFeatureCount; ++i)
+        settings.features &= ~uint32_t(SheddableFeatures[i]);
+
+    averageTime = 0.0f;
+    settlingFrames = SettlingFrameCount;
+    slowFrames = 0;
+    fastFrames = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef SMALL_ECO_DESTROYED_FRAME_GOVERNOR_HPP
+#define SMALL_ECO_DESTROYED_FRAME_GOVERNOR_HPP
+
+#include "GameInterface.hpp"
+
+// Keeps the render time of a frame inside a budget by changing the render
+// settings. When the frames are too slow it first sheds the optional features,
+// and only then lowers the internal resolution. When there is headroom it
+// raises the resolution first, and gives the features back at the largest one.
+class FrameGovernor
+{
+public:
+    FrameGovernor(int maxWidth, int maxHeight, float budgetMilliseconds);
+
+    // Starts at the largest resolution step that fits in the given size.
+    void startAt(int width, int height);
+
+    // Takes the measured render time of the last frame. Returns true when the
+    // settings changed.
+    bool addFrameTime(float milliseconds);
+
+    const RenderSettings &getSettings() const
+    {
+        return settings;
+    }
+
+private:
+    void changeLevel(int newResolutionStep, int newShedFeatureCount);
+
+    int maxWidth;
+    int maxHeight;
+    float budget;
+
+    int resolutionStep;
+    int shedFeatureCount;
+    RenderSettings settings;
+
+    float averageTime;
+    int settlingFrames;
+    int slowFrames;
+    int fastFrames;
+};
+
+#endif //SMALL_ECO_DESTROYED_FRAME_GOVERNOR_HPP
@@ -2,13 +2,115 @@
 #define SMALL_ECO_DESTROYED_FRAMEBUFFER_HPP
 
 #include <stdint.h>
+#include <algorithm>
+#include "Rectangle.hpp"
 
 struct Framebuffer
 {
+    Framebuffer()
+        : width(0), height(0), pitch(0), pixels(nullptr),
+          clipMinX(0), clipMinY(0), clipMaxX(0), clipMaxY(0) {}
+
+    Framebuffer(int width, int height, int pitch, uint8_t *pixels)
+        : width(width), height(height), pitch(pitch), pixels(pixels),
+          clipMinX(0), clipMinY(0), clipMaxX(width), clipMaxY(height) {}
+
+    // The same framebuffer, with drawing restricted to the given rectangle.
+    Framebuffer clippedTo(const Rectangle &rectangle) const
+    {
+        auto result = *this;
+        result.clipMinX = std::max(clipMinX, rectangle.x);
+        result.clipMinY = std::max(clipMinY, rectangle.y);
+        result.clipMaxX = std::max(result.clipMinX, std::min(clipMaxX, rectangle.x + rectangle.width));
+        result.clipMaxY = std::max(result.clipMinY, std::min(clipMaxY, rectangle.y + rectangle.height));
+        return result;
+    }
+
+    // The same framebuffer, with drawing restricted to the rows [minY, maxY).
+    Framebuffer clippedToRows(int minY, int maxY) const
+    {
+        auto result = *this;
+        result.clipMinY = std::max(clipMinY, minY);
+        result.clipMaxY = std::max(result.clipMinY, std::min(clipMaxY, maxY));
+        return result;
+    }
+
     int width;
     int height;
     int pitch;
     uint8_t *pixels;
+
+    // Drawing is restricted to [clipMinX, clipMaxX) x [clipMinY, clipMaxY).
+    int clipMinX;
+    int clipMinY;
+    int clipMaxX;
+    int clipMaxY;
+};
+
+// Regions of a framebuffer that changed since the previous frame. Touching
+// rectangles are merged, and when the list is full a new rectangle is merged
+// with the one that grows the least.
+struct FramebufferDamage
+{
+    static constexpr int MaxRectangles = 32;
+
+    FramebufferDamage()
+        : rectangleCount(0) {}
+
+    bool isEmpty() const
+    {
+        return rectangleCount == 0;
+    }
+
+    void clear()
+    {
+        rectangleCount = 0;
+    }
+
+    void addRectangle(Rectangle rectangle)
+    {
+        if(rectangle.isEmpty())
+            return;
+
+        for(int i = 0; i < rectangleCount; )
+        {
+            if(rectangles[i].touches(rectangle))
+            {
+                rectangle = rectangle.unionWith(rectangles[i]);
+                rectangles[i] = rectangles[--rectangleCount];
+                i = 0;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        if(rectangleCount == MaxRectangles)
+        {
+            int bestIndex = 0;
+            int bestGrowth = rectangle.unionWith(rectangles[0]).area() - rectangles[0].area();
+            for(int i = 1; i < rectangleCount; ++i)
+            {
+                int growth = rectangle.unionWith(rectangles[i]).area() - rectangles[i].area();
+                if(growth < bestGrowth)
+                {
+                    bestIndex = i;
+                    bestGrowth = growth;
+                }
+            }
+
+            auto merged = rectangle.unionWith(rectangles[bestIndex]);
+            rectangles[bestIndex] = rectangles[--rectangleCount];
+            addRectangle(merged);
+            return;
+        }
+
+        rectangles[rectangleCount++] = rectangle;
+    }
+
+    int rectangleCount;
+    Rectangle rectangles[MaxRectangles];
 };
 
 #endif //SMALL_ECO_DESTROYED_FRAMEBUFFER_HPP
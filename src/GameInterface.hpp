@@ -6,15 +6,55 @@
 #include "Framebuffer.hpp"
 
 static constexpr size_t PersistentMemorySize = 8*1024*1024;
-static constexpr size_t TransientMemorySize = 16*1024;//32*1024*1024;
+static constexpr size_t TransientMemorySize = 4*1024*1024;//32*1024*1024;
+
+// The local players share the screen, and every one has a viewport of it.
+static constexpr int MaxPlayers = 4;
+
+// The camera and the world map zoom with the stick clicks, because the
+// shoulders switch the bullets.
+static constexpr int ZoomOutButton = ControllerButton::LeftStick;
+static constexpr int ZoomInButton = ControllerButton::RightStick;
+
+// Optional work that can be skipped when rendering is short of time.
+namespace RenderFeatures
+{
+enum Flag
+{
+    None = 0,
+    TileAnimation = 1<<0,
+    Particles = 1<<1,
+
+    All = TileAnimation | Particles,
+};
+};
+
+struct RenderSettings
+{
+    // Size of the framebuffer that the snapshots are drawn into.
+    int viewWidth;
+    int viewHeight;
+    uint32_t features;
+};
 
 struct GameInterface
 {
     virtual void setPersistentMemory(MemoryZone *zone) = 0;
     virtual void setTransientMemory(MemoryZone *zone) = 0;
 
-    virtual void update(float delta, const ControllerState &controllerState) = 0;
-    virtual void render(const Framebuffer &framebuffer) = 0;
+    // There is a controller state for every one of the playerCount players,
+    // from one to MaxPlayers. A player that joins starts where the first one is.
+    virtual void update(float delta, const ControllerState *controllerStates, int playerCount) = 0;
+
+    // The renderer only draws snapshots of the state, so update and render can
+    // run on different threads. A snapshot is published after the updates, with
+    // the tiles visible in the view of the settings, and render draws the last
+    // consumed one into a framebuffer of the size of its settings. Consuming
+    // returns false when nothing new was published, and gives the settings of
+    // the snapshot that render draws, unless there is none yet.
+    virtual void publishRenderSnapshot(const RenderSettings &settings) = 0;
+    virtual bool consumeRenderSnapshot(RenderSettings &settings) = 0;
+    virtual void render(const Framebuffer &framebuffer, FramebufferDamage &damage) = 0;
 };
 
 typedef GameInterface *(*GetGameInterfaceFunction)();
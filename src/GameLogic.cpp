@@ -1,8 +1,10 @@
 #include "GameInterface.hpp"
 #include "GameLogic.hpp"
 #include "Renderer.hpp"
+#include "RenderSnapshot.hpp"
 #include "SoundSamples.hpp"
 #include <algorithm>
+#include <math.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
@@ -12,7 +14,13 @@ static MemoryZone *transientMemoryZone;
 
 uint8_t *allocateTransientBytes(size_t byteCount)
 {
-    return transientMemoryZone->allocateBytes(byteCount);
+    // Keep every allocation aligned for SIMD.
+    return transientMemoryZone->allocateBytes((byteCount + 15) & ~size_t(15));
+}
+
+void clearTransientMemory()
+{
+    transientMemoryZone->clearAll();
 }
 
 static const AnimationState PlayerAnim_IdleDown = {0, 0, 2, 4, true, 1.0f};
@@ -25,6 +33,22 @@ static const AnimationState PlayerAnim_DeadIdle = {0, 14, 2, 2, true, 0.5f};
 
 static constexpr float BellyDecreaseSpeed = 1.00f;
 static constexpr float EmptyStomachHurtSpeed = 2.0f;
+static constexpr float DamageFlashDuration = 0.4f;
+
+// Particle bursts. Hits throw a few particles for every health point lost.
+static const ParticleBurst ExplosionBurst = {1.0f, 6.0f, 0.3f, 0.9f, 4, {0xFF00FFFF, 0xFF00A0FF, 0xFF0040FF, 0xFF404040}};
+static const ParticleBurst DebrisBurst = {0.5f, 3.0f, 0.2f, 0.6f, 3, {0xFF305070, 0xFF4A6A8A, 0xFF202830}};
+static const ParticleBurst BloodBurst = {0.5f, 2.5f, 0.2f, 0.5f, 2, {0xFF0000C0, 0xFF000080}};
+static constexpr int ExplosionParticleCount = 400;
+static constexpr int DebrisParticleCount = 150;
+static constexpr float BloodParticlesPerDamage = 2.0f;
+
+// The ambient light goes through a day and a night in every DayLength seconds
+// of the match, which starts at noon, and it is darker as the world decays.
+static constexpr float DayLength = 240.0f;
+static constexpr float TwoPi = 6.28318530718f;
+static const int DayAmbientLight[] = {MaxLightLevel, 11, 8};
+static const int NightAmbientLight[] = {5, 4, 3};
 
 static const TileOccupant TurretDestructionDropItems[] = {
     TileOccupant::None,
@@ -98,15 +122,19 @@ static void initializeGlobalState()
         return;
 
     global.random.seed = time(nullptr)^rand();
+    global.particles.seed(Random::hash(global.random.seed));
 
     global.map.loadFromFile("assets/earth_map.png");
-    global.mapTileSet.loadFromFile("assets/tiles.png");
-    global.characterTileSet.loadFromFile("assets/character-sprites.png");
+    global.mapTileSet.loadFromFile("assets/tiles.png", MapTileDecayStageColumns);
+    // The outlines of the characters are antialiased.
+    global.characterTileSet.loadFromFile("assets/character-sprites.png", 0, TileSetAlpha::Premultiplied);
     global.spriteSet.loadFromFile("assets/sprites.png");
-    global.minimap.loadFromFile("assets/minimap.png");
 
-    initializePlayer(global.player);
+    // A map that starts again does not continue the revisions of the old one.
+    global.tileChanges.revision = global.random.next32();
+
     placeSpecialItems();
+    global.lightMap.build(global.map);
 
     global.numberOfDeadBullets = MaxNumberOfBullets;
     for(size_t i = 0; i < MaxNumberOfBullets; ++i)
@@ -115,6 +143,30 @@ static void initializeGlobalState()
     global.isInitialized = true;
 }
 
+// A player that joins starts next to the first one, and one that leaves comes
+// back new.
+static void setPlayerCount(int playerCount)
+{
+    playerCount = std::min(std::max(playerCount, 1), MaxPlayers);
+    for(int i = global.playerCount; i < playerCount; ++i)
+    {
+        auto &player = global.players[i];
+        player = PlayerState();
+        initializePlayer(player);
+        if(i > 0)
+        {
+            player.position = global.players[0].position;
+            global.cameras[i] = global.cameras[0];
+        }
+    }
+
+    for(int i = playerCount; i < global.playerCount; ++i)
+        global.lightMap.setCarriedLight(i, -1);
+    if(global.worldMap.playerIndex >= playerCount)
+        global.worldMap.playerIndex = 0;
+    global.playerCount = playerCount;
+}
+
 void updateEntityAnimation(float delta, Entity &entity)
 {
     auto &state = entity.animationState;
@@ -175,7 +227,7 @@ void entityTouchingTilesDo(Entity &entity, const FT &f)
     boxTouchingTilesDo(entity.feetBoundingBox.translatedBy(entity.position), f);
 }
 
-void pickPlayerItem(PlayerState &player, TileType &type, TileOccupant &occupant)
+void pickPlayerItem(PlayerState &player, size_t tileIndex, TileType &type, TileOccupant &occupant)
 {
     switch(occupant)
     {
@@ -183,7 +235,7 @@ void pickPlayerItem(PlayerState &player, TileType &type, TileOccupant &occupant)
         player.increaseBelly(10);
         if(global.decayStage == DecayStage::Dead)
         {
-            player.receiveDamage(5);
+            player.receiveHit(5);
             global.somethingExploded = true;
         }
         break;
@@ -191,12 +243,12 @@ void pickPlayerItem(PlayerState &player, TileType &type, TileOccupant &occupant)
         player.increaseBelly(20);
         if(global.decayStage == DecayStage::Dying)
         {
-            player.receiveDamage(10);
+            player.receiveHit(10);
             global.somethingExploded = true;
         }
         else if(global.decayStage == DecayStage::Dead)
         {
-            player.receiveDamage(50);
+            player.receiveHit(50);
             global.somethingExploded = true;
         }
         break;
@@ -229,6 +281,7 @@ void pickPlayerItem(PlayerState &player, TileType &type, TileOccupant &occupant)
         break;
     case TileOccupant::Torch:
         player.hasIceProtection = true;
+        player.hasTorch = true;
         break;
     case TileOccupant::HolyProtection:
         player.hasHolyProtection = true;
@@ -242,13 +295,18 @@ void pickPlayerItem(PlayerState &player, TileType &type, TileOccupant &occupant)
         break;
     }
 
+    // The picked item can be a neighbour of the tile of the player, so its light
+    // is not always under the carried one.
+    if(isTileOccupantALightSource(occupant))
+        global.lightMap.invalidateAround(tileIndex);
+
     occupant = TileOccupant::None;
     global.itemWasPicked = true;
 }
 
 static void updateAlivePlayerMovement(float delta, PlayerState &player)
 {
-    auto rawDirection = Vector2(global.controllerState.leftXAxis, global.controllerState.leftYAxis);
+    auto rawDirection = Vector2(player.controllerState.leftXAxis, player.controllerState.leftYAxis);
     auto directionLength = rawDirection.length();
     Vector2 direction = rawDirection;
     if(directionLength > 1.0f)
@@ -309,7 +367,7 @@ static void updateAlivePlayerMovement(float delta, PlayerState &player)
     }
 
     auto playerSpeed = 2.0;
-    player.running = global.controllerState.getButton(ControllerButton::A);
+    player.running = player.controllerState.getButton(ControllerButton::A);
     if(player.running)
         playerSpeed *= 2.5;
     player.velocity = direction*playerSpeed;
@@ -336,7 +394,7 @@ static void updateAlivePlayerMovement(float delta, PlayerState &player)
         // Interact with the items.
         if(isTileOccupantAnItem(occupant))
         {
-            pickPlayerItem(player, type, occupant);
+            pickPlayerItem(player, tileIndex, type, occupant);
         }
         else if(type == TileType::HolyBarrier && !player.hasHolyProtection)
         {
@@ -394,14 +452,14 @@ inline Vector2 bulletOffsetForFaceOrientation(FaceOrientation orientation)
 
 static void updateAlivePlayer(float delta, PlayerState &player)
 {
-    if(global.isButtonPressed(ControllerButton::LeftShoulder) ||
-        global.isButtonPressed(ControllerButton::RightShoulder) ||
-        global.isButtonPressed(ControllerButton::B))
+    if(player.isButtonPressed(ControllerButton::LeftShoulder) ||
+        player.isButtonPressed(ControllerButton::RightShoulder) ||
+        player.isButtonPressed(ControllerButton::B))
     {
         player.withDemolitionBullets = !player.withDemolitionBullets;
     }
 
-    if(global.isButtonPressed(ControllerButton::X) || global.isButtonPressed(ControllerButton::RightTrigger))
+    if(player.isButtonPressed(ControllerButton::X) || player.isButtonPressed(ControllerButton::RightTrigger))
     {
         auto bulletPosition = player.position + bulletOffsetForFaceOrientation(player.faceOrientation);
 
@@ -444,6 +502,8 @@ void updatePlayer(float delta, PlayerState &player)
     if(global.isPaused || global.isGameCompleted)
         return;
 
+    player.damageFlash = std::max(player.damageFlash - delta/DamageFlashDuration, 0.0f);
+
     if(player.isAlive())
     {
         updateAlivePlayer(delta, player);
@@ -458,6 +518,22 @@ void updatePlayer(float delta, PlayerState &player)
     updateEntityAnimation(delta, player);
 }
 
+static void updateWorldMap(float delta)
+{
+    constexpr float PanSpeed = 320.0f;
+
+    auto &worldMap = global.worldMap;
+    const auto &player = global.players[worldMap.playerIndex];
+    if(player.isButtonPressed(ZoomOutButton))
+        worldMap.zoomLevel = std::max(worldMap.zoomLevel - 1, MinWorldMapZoomLevel);
+    if(player.isButtonPressed(ZoomInButton))
+        worldMap.zoomLevel = std::min(worldMap.zoomLevel + 1, MaxWorldMapZoomLevel);
+
+    // The panning has the same screen speed at every zoom.
+    auto axis = Vector2(player.controllerState.leftXAxis, player.controllerState.leftYAxis);
+    worldMap.center = normalizeWorldCoordinate(worldMap.center + axis*(PanSpeed*delta/worldMap.pixelsPerTile()));
+}
+
 static void updateMap(float delta)
 {
     constexpr float MapTileFPS = 1.25;
@@ -469,10 +545,29 @@ static void updateMap(float delta)
         global.decayStage = DecayStage::Dying;
     else
         global.decayStage = DecayStage::Normal;
+
+    // The dusk and the dawn take a tenth of the day each.
+    auto stage = int(global.decayStage);
+    auto daylight = std::min(std::max(0.5f + 1.5f*cosf(global.matchTime*(TwoPi/DayLength)), 0.0f), 1.0f);
+    global.ambientLight = NightAmbientLight[stage] + int((DayAmbientLight[stage] - NightAmbientLight[stage])*daylight + 0.5f);
+}
+
+static void updateLights()
+{
+    for(int i = 0; i < global.playerCount; ++i)
+    {
+        auto &player = global.players[i];
+        auto carriedLight = player.hasTorch && player.isAlive() ? int(global.map.tileIndexAtPoint(player.position)) : -1;
+        global.lightMap.setCarriedLight(i, carriedLight);
+    }
+    global.lightMap.update(global.map);
 }
 
-static void tileOccupantDestroyed(TileOccupant &occupant, TileOccupantState &occupantState)
+static void tileOccupantDestroyed(size_t tileIndex, TileOccupant &occupant, TileOccupantState &occupantState, const Vector2 &position)
 {
+    global.particles.emit(ExplosionBurst, position, ExplosionParticleCount);
+
+    auto wasLightSource = isTileOccupantALightSource(occupant);
     switch(occupant)
     {
     case TileOccupant::Turret:
@@ -483,18 +578,27 @@ static void tileOccupantDestroyed(TileOccupant &occupant, TileOccupantState &occ
         break;
     }
 
+    if(wasLightSource || isTileOccupantALightSource(occupant))
+        global.lightMap.invalidateAround(tileIndex);
     occupantState.setDefault(occupant);
 }
 
 static void checkBulletCollisions(BulletState &bullet)
 {
-    // Attempt to kill the player...
+    // Attempt to kill a player...
     //printf("bullet pos %f %f bbox: %f %f - %f %f\n", bullet.position.x, bullet.position.y, bullet.boundingBox.min.x, bullet.boundingBox.min.y, bullet.boundingBox.max.x, bullet.boundingBox.max.y);
-    if(!bullet.wasFiredByPlayer() && global.player.collisionBoundingBox.containsPoint(bullet.position - global.player.position))
+    if(!bullet.wasFiredByPlayer())
     {
-        global.player.receiveDamage(bullet.power);
-        bullet.gotTarget();
-        return;
+        for(int i = 0; i < global.playerCount; ++i)
+        {
+            auto &player = global.players[i];
+            if(player.collisionBoundingBox.containsPoint(bullet.position - player.position))
+            {
+                player.receiveHit(bullet.power);
+                bullet.gotTarget();
+                return;
+            }
+        }
     }
 
     // Check whether is there something interesting on this tile.
@@ -509,6 +613,10 @@ static void checkBulletCollisions(BulletState &bullet)
         if(bullet.isDemolition() && tileType == TileType::Rock)
         {
             tileType = TileType::Earth;
+            global.tileChanges.add(tileIndex);
+            global.map.updateTransitionsAround(tileIndex);
+            global.lightMap.invalidateAround(tileIndex);
+            global.particles.emit(DebrisBurst, bullet.position, DebrisParticleCount);
             global.somethingExploded = true;
         }
     }
@@ -520,7 +628,7 @@ static void checkBulletCollisions(BulletState &bullet)
         occupantState.generic.health = std::max(0, int(occupantState.generic.health - bullet.power));
         if(occupantState.generic.health == 0)
         {
-            tileOccupantDestroyed(occupant, occupantState);
+            tileOccupantDestroyed(tileIndex, occupant, occupantState, bullet.position);
             global.somethingExploded = true;
         }
     }
@@ -565,15 +673,15 @@ static void updateBullets(float delta)
     }
 }
 
-static bool castPlayerVisibleRay(const Vector2 &start, const Vector2 &step, TileType type = TileType::None, int maxSteps = 30)
+static bool castPlayerVisibleRay(const PlayerState &player, const Vector2 &start, const Vector2 &step, TileType type = TileType::None, int maxSteps = 30)
 {
     auto direction = step.normalized(); // Maybe the normalization is not needed.
-    auto playerPosition = start - global.player.position;
+    auto playerPosition = start - player.position;
 
-    if(!global.player.collisionBoundingBox.isIntersectedByLine(playerPosition, playerPosition + step))
+    if(!player.collisionBoundingBox.isIntersectedByLine(playerPosition, playerPosition + step))
         return false;
 
-    auto playerDirectionAmount = (global.player.position - start).dot(direction);
+    auto playerDirectionAmount = (player.position - start).dot(direction);
     if(playerDirectionAmount < 0)
         return false;
 
@@ -596,6 +704,17 @@ static bool castPlayerVisibleRay(const Vector2 &start, const Vector2 &step, Tile
     return true;
 }
 
+static bool castAnyPlayerVisibleRay(const Vector2 &start, const Vector2 &step, TileType type = TileType::None)
+{
+    for(int i = 0; i < global.playerCount; ++i)
+    {
+        if(castPlayerVisibleRay(global.players[i], start, step, type))
+            return true;
+    }
+
+    return false;
+}
+
 static bool turretAttack(float delta, int row, int column, TileType type, TileOccupantState &state)
 {
     if(global.isGameCompleted)
@@ -611,7 +730,7 @@ static bool turretAttack(float delta, int row, int column, TileType type, TileOc
         if(!result) \
         { \
             fireDirection = Vector2(dx, dy); \
-            result = castPlayerVisibleRay(position, fireDirection, type); \
+            result = castAnyPlayerVisibleRay(position, fireDirection, type); \
         }
 
     if(isDiagonal)
@@ -716,7 +835,7 @@ static void updateScreenTileOccupants(float delta)
 
 static void doCheating()
 {
-    auto &player = global.player;
+    auto &player = global.players[0];
     return;
     //global.decayStage = DecayStage::Normal;
     //global.decayStage = DecayStage::Dying;
@@ -729,27 +848,74 @@ static void doCheating()
 
     player.hasHolyProtection = true;
     player.hasIceProtection = true;
+    player.hasTorch = true;
 
     // Jesus mode
     player.tileMovementMask |= TileTypeMask::Water | TileTypeMask::ShallowWater | TileTypeMask::DeepWater;
 }
 
-void update(float delta, const ControllerState &controllerState)
+// The first player that pressed the button in this update, or -1.
+static int playerPressingButton(int button)
+{
+    for(int i = 0; i < global.playerCount; ++i)
+    {
+        if(global.players[i].isButtonPressed(button))
+            return i;
+    }
+
+    return -1;
+}
+
+void update(float delta, const ControllerState *controllerStates, int playerCount)
 {
     initializeGlobalState();
+    setPlayerCount(playerCount);
 
     //printf("MemoryRequirement: %zu\n", sizeof(GlobalState));
 
     // Pause button
-    if(global.isButtonPressed(ControllerButton::Start))
+    if(playerPressingButton(ControllerButton::Start) >= 0)
         global.isPaused = !global.isPaused;
 
-    // Store the current time and update the controller state.
+    // Store the current time and update the controller states.
     global.currentTime += delta;
-    if(!global.isPaused && !global.isGameCompleted)
+    if(!global.isPaused && !global.isGameCompleted && !global.worldMap.isOpen)
         global.matchTime += delta;
-    global.oldControllerState = global.controllerState;
-    global.controllerState = controllerState;
+    for(int i = 0; i < global.playerCount; ++i)
+    {
+        auto &player = global.players[i];
+        player.oldControllerState = player.controllerState;
+        player.controllerState = controllerStates[i];
+    }
+
+    // The world map stops the game while it is open, and takes the controls of
+    // the player that opened it.
+    auto &worldMap = global.worldMap;
+    auto worldMapPlayer = playerPressingButton(ControllerButton::Select);
+    if(worldMapPlayer >= 0)
+    {
+        worldMap.isOpen = !worldMap.isOpen;
+        worldMap.playerIndex = worldMapPlayer;
+        worldMap.center = normalizeWorldCoordinate(global.players[worldMapPlayer].position);
+        worldMap.zoomLevel = 0;
+    }
+
+    if(worldMap.isOpen)
+    {
+        updateWorldMap(delta);
+        return;
+    }
+
+    // Zoom buttons
+    for(int i = 0; i < global.playerCount; ++i)
+    {
+        const auto &player = global.players[i];
+        auto &camera = global.cameras[i];
+        if(player.isButtonPressed(ZoomOutButton))
+            camera.zoomLevel = std::max(camera.zoomLevel - 1, MinCameraZoomLevel);
+        if(player.isButtonPressed(ZoomInButton))
+            camera.zoomLevel = std::min(camera.zoomLevel + 1, MaxCameraZoomLevel);
+    }
 
     global.shotWasFired = false;
     global.itemWasPicked = false;
@@ -758,9 +924,13 @@ void update(float delta, const ControllerState &controllerState)
     updateMap(delta);
     doCheating();
 
-    updatePlayer(delta, global.player);
+    for(int i = 0; i < global.playerCount; ++i)
+        updatePlayer(delta, global.players[i]);
     updateScreenTileOccupants(delta);
     updateBullets(delta);
+    updateLights();
+    if(!global.isPaused)
+        global.particles.update(delta);
 
     if(global.shotWasFired)
         playShotSound(global.random.next32());
@@ -769,15 +939,20 @@ void update(float delta, const ControllerState &controllerState)
     if(global.somethingExploded)
         playExplosionSound(global.random.next32());
 
-    global.camera.position = global.player.position;
+    for(int i = 0; i < global.playerCount; ++i)
+        global.cameras[i].position = global.players[i].position;
 }
 
 void Entity::receiveDamage(float damage)
 {
     bool wasAlive = isAlive();
     health = std::max(health - damage, 0.0f);
+    global.particles.emitFraction(BloodBurst, position, damage*BloodParticlesPerDamage);
     if(wasAlive && !isAlive())
+    {
+        global.particles.emit(ExplosionBurst, position, ExplosionParticleCount);
         global.somethingExploded = true;
+    }
 }
 
 class GameInterfaceImpl : public GameInterface
@@ -785,8 +960,10 @@ class GameInterfaceImpl : public GameInterface
 public:
     virtual void setPersistentMemory(MemoryZone *zone) override;
     virtual void setTransientMemory(MemoryZone *zone) override;
-    virtual void update(float delta, const ControllerState &controllerState) override;
-    virtual void render(const Framebuffer &framebuffer) override;
+    virtual void update(float delta, const ControllerState *controllerStates, int playerCount) override;
+    virtual void publishRenderSnapshot(const RenderSettings &settings) override;
+    virtual bool consumeRenderSnapshot(RenderSettings &settings) override;
+    virtual void render(const Framebuffer &framebuffer, FramebufferDamage &damage) override;
 };
 
 void GameInterfaceImpl::setPersistentMemory(MemoryZone *zone)
@@ -799,14 +976,28 @@ void GameInterfaceImpl::setTransientMemory(MemoryZone *zone)
     transientMemoryZone = zone;
 }
 
-void GameInterfaceImpl::update(float delta, const ControllerState &controllerState)
+void GameInterfaceImpl::update(float delta, const ControllerState *controllerStates, int playerCount)
+{
+    ::update(delta, controllerStates, playerCount);
+}
+
+void GameInterfaceImpl::publishRenderSnapshot(const RenderSettings &settings)
+{
+    ::publishRenderSnapshot(settings);
+}
+
+bool GameInterfaceImpl::consumeRenderSnapshot(RenderSettings &settings)
 {
-    ::update(delta, controllerState);
+    auto consumed = ::consumeRenderSnapshot();
+    auto snapshot = getRenderSnapshot();
+    if(snapshot)
+        settings = snapshot->settings;
+    return consumed;
 }
 
-void GameInterfaceImpl::render(const Framebuffer &framebuffer)
+void GameInterfaceImpl::render(const Framebuffer &framebuffer, FramebufferDamage &damage)
 {
-    ::render(framebuffer);
+    ::render(framebuffer, damage);
 }
 
 static GameInterfaceImpl gameInterfaceImpl;
@@ -7,6 +7,8 @@
 #include "Box2.hpp"
 #include "Tile.hpp"
 #include "Random.hpp"
+#include "ParticleSystem.hpp"
+#include "LightMap.hpp"
 #include <algorithm>
 
 enum class SpriteType
@@ -107,8 +109,16 @@ struct PlayerState : Entity
     bool withDemolitionBullets;
     bool hasIceProtection;
     bool hasHolyProtection;
+    bool hasTorch;
     bool inBoat;
 
+    // Goes from one to zero after a hit.
+    float damageFlash;
+
+    // The controller of the player in this update and in the previous one.
+    ControllerState oldControllerState;
+    ControllerState controllerState;
+
     int roundedBelly() const
     {
         return int(belly + 0.5f);
@@ -129,20 +139,80 @@ struct PlayerState : Entity
         health = std::min(health + amount, 100.0f);
     }
 
+    // Unlike the damage received over time, a hit flashes the screen.
+    void receiveHit(float damage)
+    {
+        receiveDamage(damage);
+        damageFlash = 1.0f;
+    }
+
     Vector2 fireDirection() const
     {
         if(velocity.isNotZero())
             return velocity.normalized();
         return faceOrientationVector();
     }
+
+    bool isButtonPressed(int button) const
+    {
+        return controllerState.getButton(button) && !oldControllerState.getButton(button);
+    }
 };
 
+// The zoom of the camera is a power of two, so a tile always covers a whole
+// number of pixels. A level of zero is the unscaled view.
+static constexpr int MinCameraZoomLevel = -2;
+static constexpr int MaxCameraZoomLevel = 1;
+
 struct CameraState
 {
     Vector2 position;
+    int zoomLevel;
+
+    // Screen pixels per world pixel.
+    float zoom() const
+    {
+        return ldexpf(1.0f, zoomLevel);
+    }
+};
+
+// The full screen map. Its zoom is a power of two of screen pixels per tile.
+static constexpr int MinWorldMapZoomLevel = -3;
+static constexpr int MaxWorldMapZoomLevel = 3;
+
+struct WorldMapState
+{
+    bool isOpen;
+    Vector2 center;
+    int zoomLevel;
+
+    // The player that opened the map moves it.
+    int playerIndex;
+
+    float pixelsPerTile() const
+    {
+        return ldexpf(1.0f, zoomLevel);
+    }
+};
+
+// The tiles whose type changed, so the copies of the map colors that the
+// renderer reads are updated without going through the whole map. Whoever is
+// more than a capacity of changes behind copies everything again.
+struct TileChangeLog
+{
+    static constexpr int Capacity = 1024;
+
+    uint32_t revision;
+    int32_t tileIndices[Capacity];
+
+    void add(size_t tileIndex)
+    {
+        tileIndices[revision % Capacity] = int32_t(tileIndex);
+        ++revision;
+    }
 };
 
-static constexpr size_t MaxNumberOfBullets = 1024;
+static constexpr size_t MaxNumberOfBullets = 4096;
 
 namespace BulletFlags
 {
@@ -209,17 +279,25 @@ enum class DecayStage
 {
     Normal = 0,
     Dying,
-    Dead
+    Dead,
+
+    Count
 };
 
+// The map tiles are drawn with one palette per decay stage. In the image, the
+// art of each stage is MapTileDecayStageColumns tile columns to the right of
+// the previous one.
+static constexpr int MapTileDecayStageColumns = 2;
+static constexpr int MapTilePaletteCapacity = 8192;
+using MapTileSet = IndexedTileSetImage<uint16_t, MapTilePaletteCapacity, int(DecayStage::Count), 512, 512>;
+
 struct GlobalState
 {
     // Assets
     TileMap map;
-    TileSet mapTileSet;
-    TileSet characterTileSet;
+    MapTileSet mapTileSet;
+    CharacterTileSet characterTileSet;
     TileSet spriteSet;
-    MiniMapImage minimap;
 
     // Global states
     bool isInitialized;
@@ -228,13 +306,18 @@ struct GlobalState
     float currentTime;
     float matchTime;
     DecayStage decayStage;
-    ControllerState oldControllerState;
-    ControllerState controllerState;
+    TileChangeLog tileChanges;
+    LightMap lightMap;
+
+    // The light level of the tiles that no source reaches.
+    int ambientLight;
     Random random;
 
-    // Some "entities"
-    CameraState camera;
-    PlayerState player;
+    // Some "entities". Every player has the camera of its viewport.
+    int playerCount;
+    CameraState cameras[MaxPlayers];
+    WorldMapState worldMap;
+    PlayerState players[MaxPlayers];
     BulletState bullets[MaxNumberOfBullets];
 
     int numberOfDeadBullets;
@@ -242,15 +325,12 @@ struct GlobalState
     int numberOfAliveBullets;
     int aliveBullets[MaxNumberOfBullets];
 
+    ParticleSystem particles;
+
     // Sound effects
     bool shotWasFired;
     bool itemWasPicked;
     bool somethingExploded;
-
-    bool isButtonPressed(int button) const
-    {
-        return controllerState.getButton(button) && !oldControllerState.getButton(button);
-    }
 };
 
 static_assert(sizeof(GlobalState) < PersistentMemorySize, "Increase the persistentMemory");
@@ -259,12 +339,33 @@ extern GlobalState *globalState;
 
 #define global (*globalState)
 
+// The transient memory is scratch memory for one frame of rendering. It is
+// cleared at the start of every render.
 uint8_t *allocateTransientBytes(size_t byteCount);
+void clearTransientMemory();
 
 template<typename T>
 T *newTransient()
 {
-    return allocateTransientBytes(sizeof(T));
+    return reinterpret_cast<T*> (allocateTransientBytes(sizeof(T)));
+}
+
+template<typename T>
+T *newTransientArray(size_t count)
+{
+    return reinterpret_cast<T*> (allocateTransientBytes(sizeof(T)*count));
+}
+
+// Moves the count first elements of a transient array to one that is twice as
+// large. The old array stays in the transient memory until it is cleared.
+template<typename T>
+void growTransientArray(T *&array, int count, int &capacity)
+{
+    auto newCapacity = std::max(2*capacity, 16);
+    auto newArray = newTransientArray<T> (newCapacity);
+    std::copy(array, array + count, newArray);
+    array = newArray;
+    capacity = newCapacity;
 }
 
 #endif //SMALL_ECO_DESTROYED_GAME_LOGIC_INTERFACE_HPP
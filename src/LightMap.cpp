@@ -0,0 +1,151 @@
+#include "LightMap.hpp"
+#include "Float.hpp"
+#include <string.h>
+
+// The steps of a flood fill never go farther than Radius in either axis.
+static constexpr int SpreadSize = 2*LightMap::Radius + 1;
+
+inline bool blocksLight(TileType type)
+{
+    return type == TileType::Rock || type == TileType::DevilStone;
+}
+
+// The coordinates are at most a map size away from the map.
+inline int wrappedTileIndex(int x, int y)
+{
+    return ((y + TileMap::Height) % TileMap::Height)*TileMap::Width + (x + TileMap::Width) % TileMap::Width;
+}
+
+void LightMap::build(const TileMap &map)
+{
+    for(auto &carriedLight : carriedLights)
+        carriedLight = -1;
+    memset(invalidChunks, 1, sizeof(invalidChunks));
+    hasInvalidChunks = true;
+    update(map);
+}
+
+// A tile whose light changes is at most Radius steps away from the change.
+void LightMap::invalidateAround(int tileIndex)
+{
+    auto x = tileIndex % TileMap::Width;
+    auto y = tileIndex / TileMap::Width;
+    auto minChunkX = (x - Radius + TileMap::Width) / ChunkSize;
+    auto maxChunkX = (x + Radius + TileMap::Width) / ChunkSize;
+    auto minChunkY = (y - Radius + TileMap::Height) / ChunkSize;
+    auto maxChunkY = (y + Radius + TileMap::Height) / ChunkSize;
+    for(int chunkY = minChunkY; chunkY <= maxChunkY; ++chunkY)
+    {
+        for(int chunkX = minChunkX; chunkX <= maxChunkX; ++chunkX)
+            invalidChunks[(chunkY % ChunkRows)*ChunkColumns + chunkX % ChunkColumns] = true;
+    }
+    hasInvalidChunks = true;
+}
+
+void LightMap::setCarriedLight(int playerIndex, int tileIndex)
+{
+    auto &carriedLight = carriedLights[playerIndex];
+    if(tileIndex == carriedLight)
+        return;
+
+    if(carriedLight >= 0)
+        invalidateAround(carriedLight);
+    if(tileIndex >= 0)
+        invalidateAround(tileIndex);
+    carriedLight = tileIndex;
+}
+
+void LightMap::update(const TileMap &map)
+{
+    if(!hasInvalidChunks)
+        return;
+
+    for(int chunkY = 0; chunkY < ChunkRows; ++chunkY)
+    {
+        for(int chunkX = 0; chunkX < ChunkColumns; ++chunkX)
+        {
+            auto &isInvalid = invalidChunks[chunkY*ChunkColumns + chunkX];
+            if(isInvalid)
+            {
+                updateChunk(map, chunkX, chunkY);
+                isInvalid = false;
+            }
+        }
+    }
+    hasInvalidChunks = false;
+}
+
+// Every source that is close enough to light the chunk is filled again, but
+// only the tiles of the chunk are written.
+void LightMap::updateChunk(const TileMap &map, int chunkX, int chunkY)
+{
+    auto chunkMinX = chunkX*ChunkSize;
+    auto chunkMinY = chunkY*ChunkSize;
+    for(int y = 0; y < ChunkSize; ++y)
+        memset(levels + (chunkMinY + y)*TileMap::Width + chunkMinX, 0, ChunkSize);
+
+    auto minX = chunkMinX - Radius;
+    auto minY = chunkMinY - Radius;
+    auto maxX = chunkMinX + ChunkSize + Radius;
+    auto maxY = chunkMinY + ChunkSize + Radius;
+    for(int y = minY; y < maxY; ++y)
+    {
+        for(int x = minX; x < maxX; ++x)
+        {
+            if(isTileOccupantALightSource(map.occupants[wrappedTileIndex(x, y)]))
+                spreadLight(map, x, y, chunkMinX, chunkMinY);
+        }
+    }
+
+    // The carried lights are moved to the unwrapped coordinates around the chunk.
+    for(auto carriedLight : carriedLights)
+    {
+        if(carriedLight < 0)
+            continue;
+
+        auto x = minX + floorModule(carriedLight % TileMap::Width - minX, TileMap::Width);
+        auto y = minY + floorModule(carriedLight / TileMap::Width - minY, TileMap::Height);
+        if(x < maxX && y < maxY)
+            spreadLight(map, x, y, chunkMinX, chunkMinY);
+    }
+}
+
+void LightMap::spreadLight(const TileMap &map, int sourceX, int sourceY, int chunkMinX, int chunkMinY)
+{
+    static const int NeighbourOffsets[] = {-1, 1, -SpreadSize, SpreadSize};
+
+    // The steps to the tiles around the source, where -1 is not reached yet.
+    int8_t steps[SpreadSize*SpreadSize];
+    int16_t queue[SpreadSize*SpreadSize];
+    memset(steps, -1, sizeof(steps));
+
+    int queueBegin = 0;
+    int queueEnd = 0;
+    queue[queueEnd++] = Radius*SpreadSize + Radius;
+    steps[Radius*SpreadSize + Radius] = 0;
+    while(queueBegin < queueEnd)
+    {
+        auto spreadIndex = queue[queueBegin++];
+        auto step = steps[spreadIndex];
+        auto x = sourceX + spreadIndex % SpreadSize - Radius;
+        auto y = sourceY + spreadIndex / SpreadSize - Radius;
+        auto tileIndex = wrappedTileIndex(x, y);
+        if(unsigned(x - chunkMinX) < unsigned(ChunkSize) && unsigned(y - chunkMinY) < unsigned(ChunkSize))
+            levels[tileIndex] = std::max(levels[tileIndex], uint8_t(MaxLightLevel - step*Falloff));
+
+        // The rocks are lit, but the light stops at them. A source inside a
+        // rock still lights around it.
+        if(step == Radius || (step > 0 && blocksLight(map.tiles[tileIndex])))
+            continue;
+
+        for(auto offset : NeighbourOffsets)
+        {
+            auto neighbour = spreadIndex + offset;
+            if(steps[neighbour] < 0)
+            {
+                steps[neighbour] = step + 1;
+                queue[queueEnd++] = neighbour;
+            }
+        }
+    }
+}
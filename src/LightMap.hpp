@@ -0,0 +1,56 @@
+#ifndef SMALL_ECO_DESTROYED_LIGHT_MAP_HPP
+#define SMALL_ECO_DESTROYED_LIGHT_MAP_HPP
+
+#include "Tile.hpp"
+#include "GameInterface.hpp"
+
+// A tile with this light level keeps its colors, and zero is black.
+static constexpr int MaxLightLevel = 15;
+
+// The factor of the color channels of a tile with the light level, where 256
+// keeps them.
+inline uint32_t lightLevelColorFactor(int level)
+{
+    return uint32_t(level*256 / MaxLightLevel);
+}
+
+// The light that the torches and the gate on the map, and the torches carried by
+// the players, cast on every tile. The light spreads from a source with a
+// breadth first flood fill, loses Falloff levels with every step and does not
+// go past the rocks. The map is split in chunks, and a change only fills again
+// the chunks that the light of the sources near it can reach. The ambient light
+// is not in the map, so the night and the decay do not fill anything.
+class LightMap
+{
+public:
+    static constexpr int ChunkSize = 8;
+    static constexpr int ChunkColumns = TileMap::Width / ChunkSize;
+    static constexpr int ChunkRows = TileMap::Height / ChunkSize;
+    static constexpr int Falloff = 2;
+
+    // Steps that the light of a source goes before it is gone.
+    static constexpr int Radius = MaxLightLevel / Falloff;
+
+    void build(const TileMap &map);
+
+    // A source or a rock appeared or went away at the tile.
+    void invalidateAround(int tileIndex);
+
+    // Moves the light of a player, where -1 is no light.
+    void setCarriedLight(int playerIndex, int tileIndex);
+
+    // Fills again the chunks that were invalidated since the last update.
+    void update(const TileMap &map);
+
+    uint8_t levels[TileMap::Width*TileMap::Height];
+
+private:
+    void updateChunk(const TileMap &map, int chunkX, int chunkY);
+    void spreadLight(const TileMap &map, int sourceX, int sourceY, int chunkMinX, int chunkMinY);
+
+    int carriedLights[MaxPlayers];
+    bool hasInvalidChunks;
+    bool invalidChunks[ChunkColumns*ChunkRows];
+};
+
+#endif //SMALL_ECO_DESTROYED_LIGHT_MAP_HPP
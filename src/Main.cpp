@@ -8,12 +8,21 @@
 #include "GameInterface.hpp"
 #include "ControllerState.hpp"
 #include "SoundSamples.hpp"
+#include "FrameGovernor.hpp"
+#include "OutputScaler.hpp"
+#include <string.h>
 #include <algorithm>
+#include <stdlib.h>
 
 #define GAME_TITLE "SMALCODED: Small Eco Destroyed World"
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#else
+#define HAS_SIMULATION_THREAD 1
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #endif
 
 #ifdef USE_LIVE_CODING
@@ -59,8 +68,11 @@ typedef void *LibraryHandle;
 #endif
 #endif
 
-static int screenWidth = 640;
-static int screenHeight = 480;
+// The internal resolution goes from the largest screen size down to 3/8 of it.
+static int maxScreenWidth = 1280;
+static int maxScreenHeight = 960;
+static int initialScreenWidth = 640;
+static int initialScreenHeight = 480;
 #ifdef USE_LIVE_CODING
 static int windowWidth = 640;
 static int windowHeight = 480;
@@ -70,20 +82,131 @@ static int windowHeight = 768;
 #endif
 static MemoryZone persistentMemory;
 static MemoryZone transientMemory;
+static MemoryZone framebufferMemory;
 static bool quitting = false;
+static bool presentRequired = true;
+static bool gameMemoryWasReset = false;
 static GameInterface *currentGameInterface;
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_Texture *texture;
 
-static int gameControllerIndex;
-static SDL_GameController *gameController;
+// The render time budget of a frame can be set in milliseconds with the
+// SMALCODED_RENDER_BUDGET_MS environment variable. Zero keeps the initial
+// settings.
+static float renderBudgetMilliseconds()
+{
+    auto budget = getenv("SMALCODED_RENDER_BUDGET_MS");
+    return budget ? float(atof(budget)) : 8.0f;
+}
+
+static FrameGovernor frameGovernor(maxScreenWidth, maxScreenHeight, renderBudgetMilliseconds());
+
+// The settings of the last snapshot that was consumed, which give the size of
+// the framebuffer and of its uploads. They are those of the frame governor
+// until the first snapshot.
+static RenderSettings snapshotRenderSettings;
+
+// The framebuffer is scaled to the window as set by the SMALCODED_OUTPUT_SCALE
+// environment variable (texture, integer or sharp), and F2 goes through the
+// modes. Other than the texture mode, the scaling is done here into a texture
+// with the size of the window, which is then copied without scaling.
+static OutputScaleMode initialOutputScaleMode()
+{
+    auto name = getenv("SMALCODED_OUTPUT_SCALE");
+    for(int i = 0; name && i < int(OutputScaleMode::Count); ++i)
+    {
+        if(!strcmp(name, outputScaleModeName(OutputScaleMode(i))))
+            return OutputScaleMode(i);
+    }
+    return OutputScaleMode::Texture;
+}
+
+static OutputScaleMode outputScaleMode = initialOutputScaleMode();
+static bool outputScaleModeChanged = true;
+static OutputScaler outputScaler;
+static SDL_Texture *outputTexture;
+static int outputTextureWidth;
+static int outputTextureHeight;
+static float outputTime;
+
+// The streaming textures use a format that the renderer supports, so SDL never
+// converts their pixels. It is the format of the window when the renderer takes
+// it, and the first one of the renderer otherwise. It can be forced with the
+// SMALCODED_TEXTURE_FORMAT environment variable (abgr8888, argb8888 or rgb565).
+// Only the textures use that format. The renderer, the tile sets and the pixel
+// kernels always work on 32 bit colors, and an RGB565 frame is packed row by
+// row while its damaged rectangles are uploaded.
+static DisplayPixelFormat displayPixelFormat = DisplayPixelFormat::ABGR8888;
+static Uint32 textureFormat = SDL_PIXELFORMAT_ABGR8888;
+
+static bool displayPixelFormatFor(Uint32 format, DisplayPixelFormat &result)
+{
+    switch(format)
+    {
+    case SDL_PIXELFORMAT_ABGR8888:
+    case SDL_PIXELFORMAT_BGR888:
+        result = DisplayPixelFormat::ABGR8888;
+        return true;
+    case SDL_PIXELFORMAT_ARGB8888:
+    case SDL_PIXELFORMAT_RGB888:
+        result = DisplayPixelFormat::ARGB8888;
+        return true;
+    case SDL_PIXELFORMAT_RGB565:
+        result = DisplayPixelFormat::RGB565;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void chooseTextureFormat()
+{
+    SDL_RendererInfo info;
+    if(SDL_GetRendererInfo(renderer, &info) != 0)
+        return;
+
+    auto forcedName = getenv("SMALCODED_TEXTURE_FORMAT");
+    auto windowFormat = SDL_GetWindowPixelFormat(window);
+    auto bestRank = 3;
+    for(Uint32 i = 0; i < info.num_texture_formats; ++i)
+    {
+        DisplayPixelFormat format;
+        if(!displayPixelFormatFor(info.texture_formats[i], format))
+            continue;
+
+        auto rank = 2;
+        if(forcedName && !strcmp(forcedName, displayPixelFormatName(format)))
+            rank = 0;
+        else if(info.texture_formats[i] == windowFormat)
+            rank = 1;
+
+        if(rank < bestRank)
+        {
+            bestRank = rank;
+            displayPixelFormat = format;
+            textureFormat = info.texture_formats[i];
+        }
+    }
+}
+
+// The number of local players is set by the SMALCODED_PLAYERS environment
+// variable. Every player has a game controller, in the order in which they are
+// found, and the first one also plays with the keyboard.
+static int localPlayerCount()
+{
+    auto players = getenv("SMALCODED_PLAYERS");
+    return players ? std::min(std::max(atoi(players), 1), MaxPlayers) : 1;
+}
+
+static int playerCount = localPlayerCount();
+static SDL_GameController *gameControllers[MaxPlayers];
 
 static ControllerState oldKeyboardControllerState;
 static ControllerState keyboardControllerState;
-static ControllerState oldGamepadControllerState;
-static ControllerState gamepadControllerState;
-static ControllerState currentControllerState;
+static ControllerState oldGamepadControllerStates[MaxPlayers];
+static ControllerState gamepadControllerStates[MaxPlayers];
+static ControllerState currentControllerStates[MaxPlayers];
 
 #ifdef USE_LIVE_CODING
 static constexpr const char *GameLogicLibraryName = LIBRARY_FILENAME("SmalcodedGameLogic");
@@ -195,6 +318,15 @@ static void onKeyEvent(const SDL_KeyboardEvent &event, bool isDown)
     case SDLK_TAB:
         keyboardControllerState.setButton(ControllerButton::B, isDown);
         break;
+    case SDLK_MINUS:
+        keyboardControllerState.setButton(ZoomOutButton, isDown);
+        break;
+    case SDLK_EQUALS:
+        keyboardControllerState.setButton(ZoomInButton, isDown);
+        break;
+    case SDLK_m:
+        keyboardControllerState.setButton(ControllerButton::Select, isDown);
+        break;
 /*    case SDLK_z:
         keyboardControllerState.setButton(ControllerButton::A, isDown);
         break;
@@ -250,11 +382,19 @@ static void onKeyEvent(const SDL_KeyboardEvent &event, bool isDown)
         keyboardControllerState.setButton(ControllerButton::Select, isDown);
         break;
 */
+    case SDLK_F2:
+        if(isDown)
+        {
+            outputScaleMode = OutputScaleMode((int(outputScaleMode) + 1) % int(OutputScaleMode::Count));
+            outputScaleModeChanged = true;
+        }
+        break;
     case SDLK_r:
         if(isDown)
         {
             persistentMemory.reset();
             transientMemory.reset();
+            gameMemoryWasReset = true;
         }
         break;
 #ifdef USE_LIVE_CODING
@@ -268,24 +408,42 @@ static void onKeyEvent(const SDL_KeyboardEvent &event, bool isDown)
 
 }
 
-static void openGameController()
+// Gives the controllers that are not open yet to the players without one.
+static void openGameControllers()
 {
-    if(gameController)
-        return;
-
     auto joystickCount = SDL_NumJoysticks();
-    gameControllerIndex = -1;
     for(auto i = 0; i < joystickCount; ++i)
     {
-        if(SDL_IsGameController(i))
+        if(!SDL_IsGameController(i))
+            continue;
+
+        auto instanceId = SDL_JoystickGetDeviceInstanceID(i);
+        auto isOpen = false;
+        auto freePlayer = -1;
+        for(int player = 0; player < MaxPlayers; ++player)
         {
-            gameControllerIndex = i;
-            break;
+            auto controller = gameControllers[player];
+            if(controller && SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(controller)) == instanceId)
+                isOpen = true;
+            else if(!controller && freePlayer < 0)
+                freePlayer = player;
         }
-    }
 
-    gameController = SDL_GameControllerOpen(gameControllerIndex);
+        if(!isOpen && freePlayer >= 0)
+            gameControllers[freePlayer] = SDL_GameControllerOpen(i);
+    }
+}
 
+static void closeGameController(SDL_JoystickID instanceId)
+{
+    for(int player = 0; player < MaxPlayers; ++player)
+    {
+        if(gameControllers[player] && gameControllers[player] == SDL_GameControllerFromInstanceID(instanceId))
+        {
+            SDL_GameControllerClose(gameControllers[player]);
+            gameControllers[player] = nullptr;
+        }
+    }
 }
 
 constexpr int AxisMinValue = -32768;
@@ -318,11 +476,8 @@ inline int mapDigitalAxis(SDL_GameController *controller, SDL_GameControllerButt
         return 0;
 }
 
-static void pollJoysticks()
+static void pollGameController(SDL_GameController *gameController, ControllerState &gamepadControllerState)
 {
-    if(!gameController)
-        return;
-
     gamepadControllerState.leftXAxis = mapAxisValue(SDL_GameControllerGetAxis(gameController, SDL_CONTROLLER_AXIS_LEFTX));
     gamepadControllerState.leftYAxis = -mapAxisValue(SDL_GameControllerGetAxis(gameController, SDL_CONTROLLER_AXIS_LEFTY));
     gamepadControllerState.rightXAxis = mapAxisValue(SDL_GameControllerGetAxis(gameController, SDL_CONTROLLER_AXIS_RIGHTX));
@@ -348,6 +503,18 @@ static void pollJoysticks()
 #undef BUTTON_MAPPING
     gamepadControllerState.setButton(ControllerButton::LeftTrigger, mapTriggerValue(SDL_GameControllerGetAxis(gameController, SDL_CONTROLLER_AXIS_TRIGGERLEFT)));
     gamepadControllerState.setButton(ControllerButton::RightTrigger, mapTriggerValue(SDL_GameControllerGetAxis(gameController, SDL_CONTROLLER_AXIS_TRIGGERRIGHT)));
+}
+
+static void pollJoysticks()
+{
+    for(int player = 0; player < MaxPlayers; ++player)
+    {
+        // A removed controller lets go of everything.
+        if(gameControllers[player])
+            pollGameController(gameControllers[player], gamepadControllerStates[player]);
+        else
+            gamepadControllerStates[player] = ControllerState();
+    }
     //printf("joystickCount %d\n", joystickCount);
 }
 
@@ -369,18 +536,17 @@ static void processEvents()
         case SDL_QUIT:
             quitting = true;
             break;
+        case SDL_WINDOWEVENT:
+            if(event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+                presentRequired = true;
+            break;
         case SDL_CONTROLLERDEVICEADDED:
             //printf("Controller added: %d\n", event.cdevice.which);
-            openGameController();
+            openGameControllers();
             break;
         case SDL_CONTROLLERDEVICEREMOVED:
             //printf("Controller removed: %d\n", event.cdevice.which);
-            if(gameController == SDL_GameControllerFromInstanceID(event.cdevice.which))
-            {
-                SDL_GameControllerClose(gameController);
-                gameController = nullptr;
-                gameControllerIndex = -1;
-            }
+            closeGameController(event.cdevice.which);
             break;
         case SDL_CONTROLLERDEVICEREMAPPED:
             //printf("Controller remapped\n");
@@ -388,35 +554,227 @@ static void processEvents()
         }
     }
 
-    oldGamepadControllerState = gamepadControllerState;
+    for(int player = 0; player < MaxPlayers; ++player)
+        oldGamepadControllerStates[player] = gamepadControllerStates[player];
     pollJoysticks();
 
-    currentControllerState.applyDifferencesOf(oldKeyboardControllerState, keyboardControllerState);
-    currentControllerState.applyDifferencesOf(oldGamepadControllerState, gamepadControllerState);
+    currentControllerStates[0].applyDifferencesOf(oldKeyboardControllerState, keyboardControllerState);
+    for(int player = 0; player < MaxPlayers; ++player)
+        currentControllerStates[player].applyDifferencesOf(oldGamepadControllerStates[player], gamepadControllerStates[player]);
 }
 
-static void update(float timestep)
+static void update(float timestep, const ControllerState *controllerStates)
 {
     if(currentGameInterface)
-        currentGameInterface->update(timestep, currentControllerState);
+        currentGameInterface->update(timestep, controllerStates, playerCount);
 }
 
-static void render()
+static void runUpdates(int iterationCount, float timestep, const ControllerState *controllerStates, const RenderSettings &settings)
 {
-    uint8_t *backBuffer;
+    for(int i = 0; i < iterationCount; ++i)
+        update(timestep, controllerStates);
+    if(currentGameInterface)
+        currentGameInterface->publishRenderSnapshot(settings);
+}
+
+#ifdef HAS_SIMULATION_THREAD
+// Runs the updates of the next frame while the main thread draws the snapshot
+// of the previous one. It is enabled with the SMALCODED_PIPELINED environment
+// variable. The main thread waits for the updates before processing the
+// events, so reloading or resetting the game never happens under them.
+class SimulationThread
+{
+public:
+    SimulationThread()
+        : enabled(false), quitting(false), busy(false), iterationCount(0), timestep(0), settings()
+    {
+        auto pipelined = getenv("SMALCODED_PIPELINED");
+        enabled = pipelined && atoi(pipelined) != 0;
+    }
+
+    ~SimulationThread()
+    {
+        if(!thread.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+        }
+        workAvailable.notify_one();
+        thread.join();
+    }
+
+    bool isEnabled() const
+    {
+        return enabled;
+    }
+
+    void start(int newIterationCount, float newTimestep, const ControllerState *newControllerStates, const RenderSettings &newSettings)
+    {
+        if(!thread.joinable())
+            thread = std::thread([this]{ threadMain(); });
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            iterationCount = newIterationCount;
+            timestep = newTimestep;
+            std::copy(newControllerStates, newControllerStates + MaxPlayers, controllerStates);
+            settings = newSettings;
+            busy = true;
+        }
+        workAvailable.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        workDone.wait(lock, [&]{ return !busy; });
+    }
+
+private:
+    void threadMain()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            workAvailable.wait(lock, [&]{ return busy || quitting; });
+            if(quitting)
+                return;
+
+            lock.unlock();
+            runUpdates(iterationCount, timestep, controllerStates, settings);
+            lock.lock();
+
+            busy = false;
+            workDone.notify_all();
+        }
+    }
+
+    bool enabled;
+    bool quitting;
+    bool busy;
+    int iterationCount;
+    float timestep;
+    ControllerState controllerStates[MaxPlayers];
+    RenderSettings settings;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable workDone;
+};
+
+static SimulationThread simulationThread;
+#endif
+
+static void uploadFramebufferRectangle(const Rectangle &rectangle)
+{
+    SDL_Rect rect = {rectangle.x, rectangle.y, rectangle.width, rectangle.height};
+    uint8_t *dest;
     int pitch;
+    if(SDL_LockTexture(texture, &rect, reinterpret_cast<void**> (&dest), &pitch) != 0)
+        return;
+
+    auto framebufferPitch = snapshotRenderSettings.viewWidth*4;
+    auto source = framebufferMemory.getData() + rectangle.y*framebufferPitch + rectangle.x*4;
+    for(int y = 0; y < rectangle.height; ++y, dest += pitch, source += framebufferPitch)
+        convertPixels(displayPixelFormat, dest, reinterpret_cast<const uint32_t*> (source), rectangle.width);
+    SDL_UnlockTexture(texture);
+}
+
+static void scaleOutputRectangle(const Rectangle &rectangle)
+{
+    if(rectangle.isEmpty())
+        return;
+
+    SDL_Rect rect = {rectangle.x, rectangle.y, rectangle.width, rectangle.height};
+    uint8_t *dest;
+    int pitch;
+    if(SDL_LockTexture(outputTexture, &rect, reinterpret_cast<void**> (&dest), &pitch) != 0)
+        return;
+
+    outputScaler.scale(framebufferMemory.getData(), snapshotRenderSettings.viewWidth*4, dest, pitch, rectangle);
+    SDL_UnlockTexture(outputTexture);
+}
+
+static void scaleFramebufferToOutput(const FramebufferDamage &damage)
+{
+    int width, height;
+    SDL_GetRendererOutputSize(renderer, &width, &height);
+    if(!outputTexture || width != outputTextureWidth || height != outputTextureHeight)
+    {
+        if(outputTexture)
+            SDL_DestroyTexture(outputTexture);
+        outputTexture = SDL_CreateTexture(renderer, textureFormat, SDL_TEXTUREACCESS_STREAMING, width, height);
+        outputTextureWidth = width;
+        outputTextureHeight = height;
+        outputScaler.configure(OutputScaleMode::Texture, displayPixelFormat, 0, 0, 0, 0);
+    }
+
+    // The locked pixels are not the old ones, so every rectangle is written whole.
+    if(outputScaler.configure(outputScaleMode, displayPixelFormat, snapshotRenderSettings.viewWidth, snapshotRenderSettings.viewHeight, width, height))
+    {
+        scaleOutputRectangle(Rectangle(0, 0, width, height));
+        return;
+    }
+
+    for(int i = 0; i < damage.rectangleCount; ++i)
+        scaleOutputRectangle(outputScaler.outputRectangleFor(damage.rectangles[i]));
+}
+
+static void render()
+{
+    // The game draws into a framebuffer that is kept between frames, and only
+    // the damaged regions are uploaded to the texture. The texture has the
+    // largest size, and the internal resolution uses its top left corner.
+    // The internal resolution is the view of the snapshot that is drawn.
+    if(currentGameInterface)
+        currentGameInterface->consumeRenderSnapshot(snapshotRenderSettings);
 
+    auto width = snapshotRenderSettings.viewWidth;
+    auto height = snapshotRenderSettings.viewHeight;
     if(currentGameInterface)
     {
-        SDL_LockTexture(texture, nullptr, reinterpret_cast<void**> (&backBuffer), &pitch);
-        Framebuffer fb;
-        fb.width = screenWidth;
-        fb.height = screenHeight;
-        fb.pixels = backBuffer;
-        fb.pitch = pitch;
-        currentGameInterface->render(fb);
-        SDL_UnlockTexture(texture);
+        auto startTime = SDL_GetPerformanceCounter();
+
+        FramebufferDamage damage;
+        Framebuffer fb(width, height, width*4, framebufferMemory.getData());
+        currentGameInterface->render(fb, damage);
+
+        // The texture mode only uploaded the damage while it was on.
+        if(outputScaleModeChanged)
+        {
+            outputScaleModeChanged = false;
+            presentRequired = true;
+            if(outputScaleMode == OutputScaleMode::Texture)
+            {
+                damage.clear();
+                damage.addRectangle(Rectangle(0, 0, width, height));
+            }
+        }
+
+        auto outputStartTime = SDL_GetPerformanceCounter();
+        if(outputScaleMode == OutputScaleMode::Texture)
+        {
+            for(int i = 0; i < damage.rectangleCount; ++i)
+                uploadFramebufferRectangle(damage.rectangles[i]);
+        }
+        else
+        {
+            scaleFramebufferToOutput(damage);
+        }
+
+        auto endTime = SDL_GetPerformanceCounter();
+        auto renderTime = float(endTime - startTime)*1000.0f / SDL_GetPerformanceFrequency();
+        frameGovernor.addFrameTime(renderTime);
+        outputTime += float(endTime - outputStartTime)*1000.0f / SDL_GetPerformanceFrequency();
+
+        // The previous frame is still on the screen.
+        if(damage.isEmpty() && !presentRequired)
+            return;
     }
+    presentRequired = false;
 
 #ifdef USE_LIVE_CODING
     SDL_SetRenderDrawColor(renderer, 255, 0, 255, 255);
@@ -425,7 +783,17 @@ static void render()
 #endif
     SDL_RenderClear(renderer);
     if(currentGameInterface)
-        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+    {
+        if(outputScaleMode == OutputScaleMode::Texture)
+        {
+            SDL_Rect sourceRect = {0, 0, width, height};
+            SDL_RenderCopy(renderer, texture, &sourceRect, nullptr);
+        }
+        else
+        {
+            SDL_RenderCopy(renderer, outputTexture, nullptr, nullptr);
+        }
+    }
     SDL_RenderPresent(renderer);
 }
 
@@ -437,6 +805,10 @@ static void mainLoopIteration()
 {
     static constexpr float TimeStep = 1.0f/60.0f;
 
+#ifdef HAS_SIMULATION_THREAD
+    if(simulationThread.isEnabled())
+        simulationThread.wait();
+#endif
     reloadGameInterface();
     processEvents();
 
@@ -451,11 +823,23 @@ static void mainLoopIteration()
     auto iterationCount = 0;
     while(accumulatedTime >= TimeStep - 0.01f && iterationCount < 3)
     {
-        update(TimeStep);
         accumulatedTime -= TimeStep;
         ++iterationCount;
     }
 
+    // The first update after a reset loads the assets again, so it cannot run
+    // while they are drawn.
+    auto settings = frameGovernor.getSettings();
+    auto pipelined = false;
+#ifdef HAS_SIMULATION_THREAD
+    pipelined = simulationThread.isEnabled() && !gameMemoryWasReset;
+    if(pipelined)
+        simulationThread.start(iterationCount, TimeStep, currentControllerStates, settings);
+#endif
+    if(!pipelined)
+        runUpdates(iterationCount, TimeStep, currentControllerStates, settings);
+    gameMemoryWasReset = false;
+
     //if(iterationCount == 0)
     //    printf("Not iterated update %f\n", accumulatedTime);
     //else if(iterationCount > 1)
@@ -469,10 +853,12 @@ static void mainLoopIteration()
     {
         float fps = frameRenderCount * 1000.0f / frameRenderTime;
         char buffer[256];
-        sprintf(buffer, GAME_TITLE " - %03.2f", fps);
+        sprintf(buffer, GAME_TITLE " - %03.2f - %dx%d - %s %s %.2f ms", fps, snapshotRenderSettings.viewWidth, snapshotRenderSettings.viewHeight,
+            outputScaleModeName(outputScaleMode), displayPixelFormatName(displayPixelFormat), outputTime / frameRenderCount);
         SDL_SetWindowTitle(window, buffer);
         frameRenderCount = 0;
         frameRenderTime = 0;
+        outputTime = 0.0f;
     }
 }
 
@@ -490,10 +876,15 @@ int main(int argc, char* argv[])
 
     window = SDL_CreateWindow(GAME_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, windowWidth, windowHeight, SDL_WINDOW_SHOWN);
     renderer = SDL_CreateRenderer(window, 0, SDL_RENDERER_PRESENTVSYNC);
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, screenWidth, screenHeight);
+    chooseTextureFormat();
+    texture = SDL_CreateTexture(renderer, textureFormat, SDL_TEXTUREACCESS_STREAMING, maxScreenWidth, maxScreenHeight);
 
     persistentMemory.reserve(PersistentMemorySize);
     transientMemory.reserve(TransientMemorySize);
+    framebufferMemory.reserve(maxScreenWidth*maxScreenHeight*4);
+
+    frameGovernor.startAt(initialScreenWidth, initialScreenHeight);
+    snapshotRenderSettings = frameGovernor.getSettings();
 
     lastUpdateTime = SDL_GetTicks();
 
@@ -0,0 +1,195 @@
+#include "OutputScaler.hpp"
+#include <string.h>
+
+static constexpr uint32_t LetterboxColor = 0xFF000000;
+
+const char *outputScaleModeName(OutputScaleMode mode)
+{
+    switch(mode)
+    {
+    case OutputScaleMode::Texture:
+        return "texture";
+    case OutputScaleMode::Integer:
+        return "integer";
+    case OutputScaleMode::SharpBilinear:
+        return "sharp";
+    default:
+        return "unknown";
+    }
+}
+
+void OutputScaler::Axis::buildInteger(int factor, int pictureSize)
+{
+    firstIndices.resize(pictureSize);
+    secondIndices.resize(pictureSize);
+    weights.assign(pictureSize, 0);
+    for(int i = 0; i < pictureSize; ++i)
+        firstIndices[i] = secondIndices[i] = i / factor;
+    isBlended = false;
+}
+
+// The source is first thought of as scaled by the largest whole factor that
+// fits, and that image is then sampled bilinearly at the centers of the output
+// pixels. Only the output pixels that straddle two source pixels get a blend.
+void OutputScaler::Axis::buildSharpBilinear(int sourceSize, int pictureSize)
+{
+    auto factor = std::max(1, pictureSize / sourceSize);
+    auto prescaledSize = sourceSize*factor;
+
+    firstIndices.resize(pictureSize);
+    secondIndices.resize(pictureSize);
+    weights.resize(pictureSize);
+    isBlended = false;
+    for(int i = 0; i < pictureSize; ++i)
+    {
+        auto position = (i + 0.5f)*prescaledSize/pictureSize - 0.5f;
+        position = std::min(std::max(position, 0.0f), float(prescaledSize - 1));
+        auto prescaledIndex = int(position);
+        auto fraction = position - prescaledIndex;
+
+        firstIndices[i] = prescaledIndex / factor;
+        secondIndices[i] = std::min(prescaledIndex + 1, prescaledSize - 1) / factor;
+        weights[i] = firstIndices[i] != secondIndices[i] ? int(fraction*BlendWeightOne + 0.5f) : 0;
+        isBlended = isBlended || weights[i] != 0;
+    }
+}
+
+// Both index lists only go up, so the range is found with binary searches.
+void OutputScaler::Axis::outputRangeFor(int sourceBegin, int sourceEnd, int &outputBegin, int &outputEnd) const
+{
+    outputBegin = int(std::lower_bound(secondIndices.begin(), secondIndices.end(), sourceBegin) - secondIndices.begin());
+    outputEnd = int(std::lower_bound(firstIndices.begin(), firstIndices.end(), sourceEnd) - firstIndices.begin());
+}
+
+OutputScaler::OutputScaler()
+    : mode(OutputScaleMode::Texture), format(DisplayPixelFormat::ABGR8888), sourceWidth(0), sourceHeight(0), outputWidth(0), outputHeight(0)
+{
+}
+
+bool OutputScaler::configure(OutputScaleMode newMode, DisplayPixelFormat newFormat, int newSourceWidth, int newSourceHeight, int newOutputWidth, int newOutputHeight)
+{
+    if(newMode == mode && newFormat == format && newSourceWidth == sourceWidth && newSourceHeight == sourceHeight &&
+        newOutputWidth == outputWidth && newOutputHeight == outputHeight)
+        return false;
+
+    mode = newMode;
+    format = newFormat;
+    sourceWidth = newSourceWidth;
+    sourceHeight = newSourceHeight;
+    outputWidth = newOutputWidth;
+    outputHeight = newOutputHeight;
+    if(mode == OutputScaleMode::Texture)
+    {
+        picture = Rectangle();
+        return true;
+    }
+
+    // A framebuffer that is larger than the output has no whole factor, and is
+    // scaled down with the blend.
+    int pictureWidth, pictureHeight;
+    auto factor = std::min(outputWidth / sourceWidth, outputHeight / sourceHeight);
+    if(mode == OutputScaleMode::Integer && factor >= 1)
+    {
+        pictureWidth = sourceWidth*factor;
+        pictureHeight = sourceHeight*factor;
+        columns.buildInteger(factor, pictureWidth);
+        rows.buildInteger(factor, pictureHeight);
+    }
+    else
+    {
+        auto scale = std::min(float(outputWidth) / sourceWidth, float(outputHeight) / sourceHeight);
+        pictureWidth = std::max(1, int(sourceWidth*scale));
+        pictureHeight = std::max(1, int(sourceHeight*scale));
+        columns.buildSharpBilinear(sourceWidth, pictureWidth);
+        rows.buildSharpBilinear(sourceHeight, pictureHeight);
+    }
+
+    picture = Rectangle((outputWidth - pictureWidth) / 2, (outputHeight - pictureHeight) / 2, pictureWidth, pictureHeight);
+    firstRow.resize(pictureWidth);
+    secondRow.resize(pictureWidth);
+    pictureRow.resize(format != DisplayPixelFormat::ABGR8888 ? pictureWidth : 0);
+
+    std::vector<uint32_t> letterbox(outputWidth, LetterboxColor);
+    letterboxRow.resize(outputWidth*displayPixelFormatSize(format));
+    convertPixels(format, letterboxRow.data(), letterbox.data(), outputWidth);
+    return true;
+}
+
+Rectangle OutputScaler::outputRectangleFor(const Rectangle &sourceRectangle) const
+{
+    if(sourceRectangle.isEmpty() || picture.isEmpty())
+        return Rectangle();
+
+    int minX, maxX, minY, maxY;
+    columns.outputRangeFor(sourceRectangle.x, sourceRectangle.x + sourceRectangle.width, minX, maxX);
+    rows.outputRangeFor(sourceRectangle.y, sourceRectangle.y + sourceRectangle.height, minY, maxY);
+    return Rectangle(picture.x + minX, picture.y + minY, maxX - minX, maxY - minY);
+}
+
+void OutputScaler::scaleRow(uint32_t *dest, const uint8_t *source, int sourcePitch, int sourceRow, int column, int count)
+{
+    auto row = reinterpret_cast<const uint32_t*> (source + sourceRow*sourcePitch);
+    if(columns.isBlended)
+        pixelKernels.gatherBlended(dest, row, &columns.firstIndices[column], &columns.secondIndices[column], &columns.weights[column], count);
+    else
+        pixelKernels.gather(dest, row, &columns.firstIndices[column], count);
+}
+
+void OutputScaler::scale(const uint8_t *source, int sourcePitch, uint8_t *dest, int destPitch, const Rectangle &outputRectangle)
+{
+    auto maxX = outputRectangle.x + outputRectangle.width;
+    auto pictureMinX = std::max(outputRectangle.x, picture.x);
+    auto pictureMaxX = std::min(maxX, picture.x + picture.width);
+    auto column = pictureMinX - picture.x;
+    auto count = pictureMaxX - pictureMinX;
+    auto pixelSize = displayPixelFormatSize(format);
+    auto isConverted = format != DisplayPixelFormat::ABGR8888;
+
+    // Whole multiples repeat the same output row, which is then just copied.
+    const uint8_t *previousPictureRow = nullptr;
+    auto previousPictureY = -1;
+
+    auto destRow = dest;
+    for(int y = outputRectangle.y; y < outputRectangle.y + outputRectangle.height; ++y, destRow += destPitch)
+    {
+        auto pictureY = y - picture.y;
+        if(count <= 0 || pictureY < 0 || pictureY >= picture.height)
+        {
+            memcpy(destRow, letterboxRow.data(), outputRectangle.width*pixelSize);
+            continue;
+        }
+
+        memcpy(destRow, letterboxRow.data(), (pictureMinX - outputRectangle.x)*pixelSize);
+        memcpy(destRow + (pictureMaxX - outputRectangle.x)*pixelSize, letterboxRow.data(), (maxX - pictureMaxX)*pixelSize);
+
+        auto pictureDest = destRow + (pictureMinX - outputRectangle.x)*pixelSize;
+        auto first = rows.firstIndices[pictureY];
+        auto second = rows.secondIndices[pictureY];
+        auto weight = rows.weights[pictureY];
+        if(previousPictureRow && first == rows.firstIndices[previousPictureY] &&
+            second == rows.secondIndices[previousPictureY] && weight == rows.weights[previousPictureY])
+        {
+            memcpy(pictureDest, previousPictureRow, count*pixelSize);
+        }
+        else
+        {
+            auto scaledRow = isConverted ? pictureRow.data() : reinterpret_cast<uint32_t*> (pictureDest);
+            if(weight == 0)
+            {
+                scaleRow(scaledRow, source, sourcePitch, first, column, count);
+            }
+            else
+            {
+                scaleRow(firstRow.data(), source, sourcePitch, first, column, count);
+                scaleRow(secondRow.data(), source, sourcePitch, second, column, count);
+                pixelKernels.blendRows(scaledRow, firstRow.data(), secondRow.data(), count, weight);
+            }
+
+            if(isConverted)
+                convertPixels(format, pictureDest, scaledRow, count);
+        }
+
+        previousPictureRow = pictureDest;
+        previousPictureY = pictureY;
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef SMALL_ECO_DESTROYED_OUTPUT_SCALER_HPP
+#define SMALL_ECO_DESTROYED_OUTPUT_SCALER_HPP
+
+#include "PixelKernels.hpp"
+#include "Rectangle.hpp"
+#include <stdint.h>
+#include <vector>
+
+enum class OutputScaleMode : uint8_t
+{
+    // The framebuffer is uploaded as it is, and the SDL renderer scales it.
+    Texture = 0,
+
+    // The largest whole multiple of the framebuffer that fits, with black bars.
+    Integer,
+
+    // Whole multiples inside the pixels, and a one pixel bilinear blend at
+    // their edges, so any scale looks sharp without uneven pixels.
+    SharpBilinear,
+
+    Count
+};
+
+const char *outputScaleModeName(OutputScaleMode mode);
+
+// Scales the framebuffer into an output image with the size of the window, with
+// the picture centered and black bars around it. The source pixels of every
+// output column and row are computed once for each size, so the scaling is a
+// single pass of gathers. The output can have any display pixel format.
+class OutputScaler
+{
+public:
+    OutputScaler();
+
+    // Returns true when the sizes, the format or the mode changed, and the whole
+    // output has to be written again. The texture mode is not scaled here.
+    bool configure(OutputScaleMode newMode, DisplayPixelFormat newFormat, int newSourceWidth, int newSourceHeight, int newOutputWidth, int newOutputHeight);
+
+    // The output pixels that read the source rectangle.
+    Rectangle outputRectangleFor(const Rectangle &sourceRectangle) const;
+
+    // Writes the output rectangle into dest, which points to its top left pixel.
+    void scale(const uint8_t *source, int sourcePitch, uint8_t *dest, int destPitch, const Rectangle &outputRectangle);
+
+private:
+    struct Axis
+    {
+        std::vector<int32_t> firstIndices;
+        std::vector<int32_t> secondIndices;
+        std::vector<int32_t> weights;
+        bool isBlended;
+
+        void buildInteger(int factor, int pictureSize);
+        void buildSharpBilinear(int sourceSize, int pictureSize);
+        void outputRangeFor(int sourceBegin, int sourceEnd, int &outputBegin, int &outputEnd) const;
+    };
+
+    void scaleRow(uint32_t *dest, const uint8_t *source, int sourcePitch, int sourceRow, int column, int count);
+
+    OutputScaleMode mode;
+    DisplayPixelFormat format;
+    int sourceWidth;
+    int sourceHeight;
+    int outputWidth;
+    int outputHeight;
+    Rectangle picture;
+
+    Axis columns;
+    Axis rows;
+    std::vector<uint32_t> firstRow;
+    std::vector<uint32_t> secondRow;
+
+    // The framebuffer colors of a picture row, when the format is not the
+    // framebuffer one, and a whole row of letterbox in the output format.
+    std::vector<uint32_t> pictureRow;
+    std::vector<uint8_t> letterboxRow;
+};
+
+#endif //SMALL_ECO_DESTROYED_OUTPUT_SCALER_HPP
@@ -0,0 +1,92 @@
+#include "ParticleSystem.hpp"
+#include <algorithm>
+#include <math.h>
+
+// SSE2 is part of every x86-64 CPU, so it needs no runtime selection.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PARTICLE_SYSTEM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static constexpr float TwoPi = 6.28318530718f;
+
+void ParticleSystem::emit(const ParticleBurst &burst, const Vector2 &position, int particleCount)
+{
+    particleCount = std::min(particleCount, MaxNumberOfParticles - count);
+    for(int i = 0; i < particleCount; ++i, ++count)
+    {
+        auto angle = random.nextFloatInRange(0.0f, TwoPi);
+        auto speed = random.nextFloatInRange(burst.minSpeed, burst.maxSpeed);
+        positionsX[count] = position.x;
+        positionsY[count] = position.y;
+        velocitiesX[count] = cosf(angle)*speed;
+        velocitiesY[count] = sinf(angle)*speed;
+        timesToLive[count] = random.nextFloatInRange(burst.minTimeToLive, burst.maxTimeToLive);
+        colors[count] = burst.colors[random.next32() % burst.colorCount];
+    }
+}
+
+void ParticleSystem::emitFraction(const ParticleBurst &burst, const Vector2 &position, float particleCount)
+{
+    auto wholeCount = int(particleCount);
+    if(random.nextFloat() < particleCount - wholeCount)
+        ++wholeCount;
+    emit(burst, position, wholeCount);
+}
+
+// Moves and ages particle i, and writes it at the slot alive, which is never
+// after it. Returns the slot of the next living particle.
+inline int updateParticle(ParticleSystem &particles, int i, int alive, float delta, float damping)
+{
+    auto timeToLive = particles.timesToLive[i] - delta;
+    particles.positionsX[alive] = particles.positionsX[i] + particles.velocitiesX[i]*delta;
+    particles.positionsY[alive] = particles.positionsY[i] + particles.velocitiesY[i]*delta;
+    particles.velocitiesX[alive] = particles.velocitiesX[i]*damping;
+    particles.velocitiesY[alive] = particles.velocitiesY[i]*damping;
+    particles.timesToLive[alive] = timeToLive;
+    particles.colors[alive] = particles.colors[i];
+    return alive + int(timeToLive > 0.0f);
+}
+
+void ParticleSystem::update(float delta)
+{
+    auto damping = powf(1.0f - Drag, delta);
+    int alive = 0;
+    int i = 0;
+
+#ifdef PARTICLE_SYSTEM_SSE2
+    // Four particles are updated in place until the first one dies. After
+    // that, the groups where one died go through the scalar path, which packs
+    // them without branches.
+    auto deltas = _mm_set1_ps(delta);
+    auto dampings = _mm_set1_ps(damping);
+    auto zero = _mm_setzero_ps();
+    for(; i + 4 <= count; i += 4)
+    {
+        auto timeToLive = _mm_sub_ps(_mm_loadu_ps(timesToLive + i), deltas);
+        if(_mm_movemask_ps(_mm_cmpgt_ps(timeToLive, zero)) != 15)
+        {
+            for(int lane = 0; lane < 4; ++lane)
+                alive = updateParticle(*this, i + lane, alive, delta, damping);
+            continue;
+        }
+
+        auto velocityX = _mm_loadu_ps(velocitiesX + i);
+        auto velocityY = _mm_loadu_ps(velocitiesY + i);
+        auto positionX = _mm_add_ps(_mm_loadu_ps(positionsX + i), _mm_mul_ps(velocityX, deltas));
+        auto positionY = _mm_add_ps(_mm_loadu_ps(positionsY + i), _mm_mul_ps(velocityY, deltas));
+        _mm_storeu_ps(positionsX + alive, positionX);
+        _mm_storeu_ps(positionsY + alive, positionY);
+        _mm_storeu_ps(velocitiesX + alive, _mm_mul_ps(velocityX, dampings));
+        _mm_storeu_ps(velocitiesY + alive, _mm_mul_ps(velocityY, dampings));
+        _mm_storeu_ps(timesToLive + alive, timeToLive);
+        if(alive != i)
+            _mm_storeu_si128(reinterpret_cast<__m128i*> (colors + alive), _mm_loadu_si128(reinterpret_cast<const __m128i*> (colors + i)));
+        alive += 4;
+    }
+#endif
+
+    for(; i < count; ++i)
+        alive = updateParticle(*this, i, alive, delta, damping);
+    count = alive;
+}
@@ -0,0 +1,58 @@
+#ifndef SMALL_ECO_DESTROYED_PARTICLE_SYSTEM_HPP
+#define SMALL_ECO_DESTROYED_PARTICLE_SYSTEM_HPP
+
+#include "Vector2.hpp"
+#include "Random.hpp"
+
+static constexpr int MaxNumberOfParticles = 65536;
+
+// How the particles of one burst are thrown. The speeds are in units per
+// second, and every particle picks one of the colors.
+struct ParticleBurst
+{
+    float minSpeed;
+    float maxSpeed;
+    float minTimeToLive;
+    float maxTimeToLive;
+    int colorCount;
+    uint32_t colors[4];
+};
+
+// Short lived points that fly away from where something happened and slow
+// down until they die. They are stored by field, so the update is a single
+// SIMD pass that moves, ages and drops the dead ones while keeping the living
+// ones packed at the start of the arrays. A burst into a full pool loses the
+// particles that do not fit.
+class ParticleSystem
+{
+public:
+    // Fraction of the velocity that is lost every second.
+    static constexpr float Drag = 0.95f;
+
+    void seed(uint64_t value)
+    {
+        random.seed = value;
+    }
+
+    void emit(const ParticleBurst &burst, const Vector2 &position, int particleCount);
+
+    // Emits a fractional count, where the fraction is a chance of one more.
+    void emitFraction(const ParticleBurst &burst, const Vector2 &position, float particleCount);
+
+    void update(float delta);
+
+    int count;
+    float positionsX[MaxNumberOfParticles];
+    float positionsY[MaxNumberOfParticles];
+    float velocitiesX[MaxNumberOfParticles];
+    float velocitiesY[MaxNumberOfParticles];
+    float timesToLive[MaxNumberOfParticles];
+    uint32_t colors[MaxNumberOfParticles];
+
+private:
+    // The particles have their own sequence, so they do not change the random
+    // numbers of the game.
+    Random random;
+};
+
+#endif //SMALL_ECO_DESTROYED_PARTICLE_SYSTEM_HPP
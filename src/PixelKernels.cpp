@@ -0,0 +1,1243 @@
+#include "PixelKernels.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXEL_KERNELS_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SSE2_FUNCTION
+#define AVX2_FUNCTION
+#else
+#define SSE2_FUNCTION __attribute__((target("sse2")))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+static constexpr uint32_t AlphaMask = 0xFF000000;
+
+//==============================================================================
+// Scalar kernels. These define the expected output of every other version.
+
+static void copyAlphaTestedScalar(uint32_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = source[i];
+        if((color & AlphaMask) != 0)
+            dest[i] = color;
+    }
+}
+
+static void copyAlphaTestedReversedScalar(uint32_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = source[-i];
+        if((color & AlphaMask) != 0)
+            dest[i] = color;
+    }
+}
+
+static void copyReversedScalar(uint32_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = source[-i];
+}
+
+static void copyTintedScalar(uint32_t *dest, const uint32_t *source, int count, uint32_t color)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto sourceColor = source[i];
+        if((sourceColor & AlphaMask) != 0)
+            dest[i] = color & sourceColor;
+    }
+}
+
+static void copyTintedReversedScalar(uint32_t *dest, const uint32_t *source, int count, uint32_t color)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto sourceColor = source[-i];
+        if((sourceColor & AlphaMask) != 0)
+            dest[i] = color & sourceColor;
+    }
+}
+
+// c*(255 - a)/255 is rounded as (x + (x >> 8)) >> 8 with x = c*(255 - a) + 128,
+// which fits in 16 bits, so two channels are done at once. The sums with the
+// source saturate the channels that overflow into the bit above them.
+inline uint32_t blendOverPixelScalar(uint32_t dest, uint32_t source)
+{
+    auto inverseAlpha = 255 - (source >> 24);
+    auto redBlue = (dest & 0x00FF00FF)*inverseAlpha + 0x00800080;
+    auto greenAlpha = ((dest >> 8) & 0x00FF00FF)*inverseAlpha + 0x00800080;
+    redBlue = ((redBlue + ((redBlue >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    greenAlpha = ((greenAlpha + ((greenAlpha >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+
+    redBlue += source & 0x00FF00FF;
+    greenAlpha += (source >> 8) & 0x00FF00FF;
+    redBlue = (redBlue | (((redBlue >> 8) & 0x00010001)*0xFF)) & 0x00FF00FF;
+    greenAlpha = (greenAlpha | (((greenAlpha >> 8) & 0x00010001)*0xFF)) & 0x00FF00FF;
+    return redBlue | (greenAlpha << 8);
+}
+
+static void blendOverScalar(uint32_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = source[i];
+        if((color & AlphaMask) == AlphaMask)
+            dest[i] = color;
+        else if((color & AlphaMask) != 0)
+            dest[i] = blendOverPixelScalar(dest[i], color);
+    }
+}
+
+static void blendOverReversedScalar(uint32_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = source[-i];
+        if((color & AlphaMask) == AlphaMask)
+            dest[i] = color;
+        else if((color & AlphaMask) != 0)
+            dest[i] = blendOverPixelScalar(dest[i], color);
+    }
+}
+
+static void fillScalar(uint32_t *dest, int count, uint32_t color)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = color;
+}
+
+static void fillOverScalar(uint32_t *dest, int count, uint32_t color)
+{
+    if((color & AlphaMask) == AlphaMask)
+    {
+        fillScalar(dest, count, color);
+        return;
+    }
+
+    if((color & AlphaMask) == 0)
+        return;
+
+    for(int i = 0; i < count; ++i)
+        dest[i] = blendOverPixelScalar(dest[i], color);
+}
+
+static void fill6x6Scalar(uint8_t *dest, int pitch, uint32_t color)
+{
+    for(int y = 0; y < 6; ++y, dest += pitch)
+        fillScalar(reinterpret_cast<uint32_t*> (dest), 6, color);
+}
+
+static void swapRedBlueScalar(uint32_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = source[i];
+        dest[i] = (color & 0xFF00FF00) | ((color & 0xFF) << 16) | ((color >> 16) & 0xFF);
+    }
+}
+
+static void packRGB565Scalar(uint16_t *dest, const uint32_t *source, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = source[i];
+        dest[i] = uint16_t(((color & 0xF8) << 8) | ((color & 0xFC00) >> 5) | ((color >> 19) & 0x1F));
+    }
+}
+
+static void expandIndexed8Scalar(uint32_t *dest, const uint8_t *source, int count, const uint32_t *palette)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = palette[source[i]];
+}
+
+static void expandIndexed16Scalar(uint32_t *dest, const uint16_t *source, int count, const uint32_t *palette)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = palette[source[i]];
+}
+
+static void gatherScalar(uint32_t *dest, const uint32_t *source, const int32_t *indices, int count)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = source[indices[i]];
+}
+
+// first + (((second - first)*weight) >> 7) is (first*(128 - weight) + second*weight) >> 7,
+// which fits in 16 bits, so two channels are blended at once.
+inline uint32_t blendScalar(uint32_t first, uint32_t second, int weight)
+{
+    auto firstWeight = uint32_t(BlendWeightOne - weight);
+    auto secondWeight = uint32_t(weight);
+    auto redBlue = (((first & 0x00FF00FF)*firstWeight + (second & 0x00FF00FF)*secondWeight) >> 7) & 0x00FF00FF;
+    auto greenAlpha = ((((first >> 8) & 0x00FF00FF)*firstWeight + ((second >> 8) & 0x00FF00FF)*secondWeight) >> 7) & 0x00FF00FF;
+    return redBlue | (greenAlpha << 8);
+}
+
+static void blendRowsScalar(uint32_t *dest, const uint32_t *first, const uint32_t *second, int count, int weight)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = blendScalar(first[i], second[i], weight);
+}
+
+static void gatherBlendedScalar(uint32_t *dest, const uint32_t *source, const int32_t *firstIndices, const int32_t *secondIndices, const int32_t *weights, int count)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = blendScalar(source[firstIndices[i]], source[secondIndices[i]], weights[i]);
+}
+
+// Every index is written, and only kept when its point is inside, so there are
+// no branches to mispredict.
+inline int selectPointsInBoxRange(int32_t *indices, int selected, int begin, int end, const float *x, const float *y, float minX, float minY, float maxX, float maxY)
+{
+    for(int i = begin; i < end; ++i)
+    {
+        indices[selected] = i;
+        selected += int(x[i] >= minX) & int(x[i] <= maxX) & int(y[i] >= minY) & int(y[i] <= maxY);
+    }
+    return selected;
+}
+
+static int selectPointsInBoxScalar(int32_t *indices, const float *x, const float *y, int count, float minX, float minY, float maxX, float maxY)
+{
+    return selectPointsInBoxRange(indices, 0, 0, count, x, y, minX, minY, maxX, maxY);
+}
+
+inline uint32_t tintScalar(uint32_t color, uint32_t tint)
+{
+    uint32_t result = 0;
+    for(int shift = 0; shift < 32; shift += 8)
+        result |= (((color >> shift) & 0xFF)*(((tint >> shift) & 0xFF) + 1) >> 8) << shift;
+    return result;
+}
+
+// The SIMD versions do the same float operations in the same order, so the
+// factors are the same.
+inline int vignetteFactorScalar(int x, float rowDistance2, const PostProcessParameters &parameters)
+{
+    auto u = (float(x) - parameters.vignetteCenterX)*parameters.vignetteScaleX;
+    auto outside = u*u + rowDistance2 - parameters.vignetteInnerRadius2;
+    outside = outside > 0.0f ? outside : 0.0f;
+    auto factor = 256.0f - outside*parameters.vignetteStrength;
+    return int(factor > 0.0f ? factor : 0.0f);
+}
+
+// Scales the color channels, and keeps the alpha.
+inline uint32_t scaleColorScalar(uint32_t color, uint32_t factor)
+{
+    auto redBlue = (((color & 0x00FF00FF)*factor) >> 8) & 0x00FF00FF;
+    auto green = (((color & 0x0000FF00)*factor) >> 8) & 0x0000FF00;
+    return redBlue | green | (color & AlphaMask);
+}
+
+inline float vignetteRowDistance2(int y, const PostProcessParameters &parameters)
+{
+    auto v = (float(y) - parameters.vignetteCenterY)*parameters.vignetteScaleY;
+    return v*v;
+}
+
+template<uint32_t Effects>
+static void postProcessScalarWith(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters)
+{
+    auto rowDistance2 = (Effects & PostProcessEffects::Vignette) ? vignetteRowDistance2(y, parameters) : 0.0f;
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = dest[i];
+        if(Effects & PostProcessEffects::Tint)
+            color = tintScalar(color, parameters.tintColor);
+        if(Effects & PostProcessEffects::Flash)
+            color = blendScalar(color, parameters.flashColor, parameters.flashWeight);
+        if(Effects & PostProcessEffects::Vignette)
+            color = scaleColorScalar(color, vignetteFactorScalar(x + i, rowDistance2, parameters));
+        if((Effects & PostProcessEffects::Checkerboard) && ((x + i) ^ y) & 1)
+            color &= parameters.checkerboardMask;
+        dest[i] = color;
+    }
+}
+
+// Every combination of effects has its own loop, indexed by the effect flags.
+#define POST_PROCESS_VARIANTS(function) { \
+    function<0>, function<1>, function<2>, function<3>, \
+    function<4>, function<5>, function<6>, function<7>, \
+    function<8>, function<9>, function<10>, function<11>, \
+    function<12>, function<13>, function<14>, function<15>, \
+}
+static_assert(PostProcessEffects::All == 15, "POST_PROCESS_VARIANTS has to cover every combination of effects");
+
+typedef void (*PostProcessFunction)(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters);
+
+static const PostProcessFunction PostProcessScalarVariants[] = POST_PROCESS_VARIANTS(postProcessScalarWith);
+
+static void postProcessScalar(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters)
+{
+    PostProcessScalarVariants[parameters.effects & PostProcessEffects::All](dest, count, x, y, parameters);
+}
+
+static void scaleColorsScalar(uint32_t *dest, int count, uint32_t factor)
+{
+    for(int i = 0; i < count; ++i)
+        dest[i] = scaleColorScalar(dest[i], factor);
+}
+
+static const PixelKernels ScalarPixelKernels = {
+    "scalar",
+    copyAlphaTestedScalar,
+    copyAlphaTestedReversedScalar,
+    copyReversedScalar,
+    copyTintedScalar,
+    copyTintedReversedScalar,
+    blendOverScalar,
+    blendOverReversedScalar,
+    fillScalar,
+    fillOverScalar,
+    fill6x6Scalar,
+    postProcessScalar,
+    scaleColorsScalar,
+    swapRedBlueScalar,
+    packRGB565Scalar,
+    expandIndexed8Scalar,
+    expandIndexed16Scalar,
+    gatherScalar,
+    blendRowsScalar,
+    gatherBlendedScalar,
+    selectPointsInBoxScalar,
+};
+
+#ifdef PIXEL_KERNELS_X86
+//==============================================================================
+// SSE2 kernels. Alpha testing is done with a select between source and dest.
+
+SSE2_FUNCTION inline __m128i opaqueMaskSSE2(__m128i color)
+{
+    auto transparent = _mm_cmpeq_epi32(_mm_and_si128(color, _mm_set1_epi32(AlphaMask)), _mm_setzero_si128());
+    return _mm_xor_si128(transparent, _mm_set1_epi32(-1));
+}
+
+SSE2_FUNCTION inline __m128i selectSSE2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+SSE2_FUNCTION inline __m128i reverseSSE2(__m128i value)
+{
+    return _mm_shuffle_epi32(value, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+SSE2_FUNCTION static void copyAlphaTestedSSE2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto color = _mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i));
+        auto destination = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), selectSSE2(opaqueMaskSSE2(color), color, destination));
+    }
+
+    copyAlphaTestedScalar(dest + i, source + i, count - i);
+}
+
+SSE2_FUNCTION static void copyAlphaTestedReversedSSE2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto color = reverseSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source - i - 3)));
+        auto destination = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), selectSSE2(opaqueMaskSSE2(color), color, destination));
+    }
+
+    copyAlphaTestedReversedScalar(dest + i, source - i, count - i);
+}
+
+SSE2_FUNCTION static void copyReversedSSE2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto color = reverseSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source - i - 3)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), color);
+    }
+
+    copyReversedScalar(dest + i, source - i, count - i);
+}
+
+SSE2_FUNCTION static void copyTintedSSE2(uint32_t *dest, const uint32_t *source, int count, uint32_t color)
+{
+    auto tint = _mm_set1_epi32(color);
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto sourceColor = _mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i));
+        auto destination = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        auto tinted = _mm_and_si128(sourceColor, tint);
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), selectSSE2(opaqueMaskSSE2(sourceColor), tinted, destination));
+    }
+
+    copyTintedScalar(dest + i, source + i, count - i, color);
+}
+
+SSE2_FUNCTION static void copyTintedReversedSSE2(uint32_t *dest, const uint32_t *source, int count, uint32_t color)
+{
+    auto tint = _mm_set1_epi32(color);
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto sourceColor = reverseSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source - i - 3)));
+        auto destination = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        auto tinted = _mm_and_si128(sourceColor, tint);
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), selectSSE2(opaqueMaskSSE2(sourceColor), tinted, destination));
+    }
+
+    copyTintedReversedScalar(dest + i, source - i, count - i, color);
+}
+
+// The inverse alpha of every pixel goes to the four 16 bit channels of its pixel.
+SSE2_FUNCTION inline void inverseAlphaWeightsSSE2(__m128i color, __m128i &lowWeights, __m128i &highWeights)
+{
+    auto inverseAlpha = _mm_sub_epi32(_mm_set1_epi32(255), _mm_srli_epi32(color, 24));
+    inverseAlpha = _mm_or_si128(inverseAlpha, _mm_slli_epi32(inverseAlpha, 16));
+    lowWeights = _mm_unpacklo_epi32(inverseAlpha, inverseAlpha);
+    highWeights = _mm_unpackhi_epi32(inverseAlpha, inverseAlpha);
+}
+
+SSE2_FUNCTION inline __m128i blendOverLanesSSE2(__m128i destination, __m128i color, __m128i lowWeights, __m128i highWeights)
+{
+    auto zero = _mm_setzero_si128();
+    auto rounding = _mm_set1_epi16(128);
+    auto low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(destination, zero), lowWeights), rounding);
+    auto high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(destination, zero), highWeights), rounding);
+    low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+    high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+    return _mm_adds_epu8(color, _mm_packus_epi16(low, high));
+}
+
+// Only the groups with translucent pixels read the destination.
+SSE2_FUNCTION inline void blendOverGroupSSE2(uint32_t *dest, __m128i color)
+{
+    auto alpha = _mm_and_si128(color, _mm_set1_epi32(AlphaMask));
+    auto transparent = _mm_cmpeq_epi32(alpha, _mm_setzero_si128());
+    if(_mm_movemask_epi8(transparent) == 0xFFFF)
+        return;
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_set1_epi32(AlphaMask))) == 0xFFFF)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest), color);
+        return;
+    }
+
+    __m128i lowWeights, highWeights;
+    inverseAlphaWeightsSSE2(color, lowWeights, highWeights);
+    auto destination = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest));
+    auto blended = blendOverLanesSSE2(destination, color, lowWeights, highWeights);
+    _mm_storeu_si128(reinterpret_cast<__m128i*> (dest), selectSSE2(transparent, destination, blended));
+}
+
+SSE2_FUNCTION static void blendOverSSE2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+        blendOverGroupSSE2(dest + i, _mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i)));
+
+    blendOverScalar(dest + i, source + i, count - i);
+}
+
+SSE2_FUNCTION static void blendOverReversedSSE2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+        blendOverGroupSSE2(dest + i, reverseSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source - i - 3))));
+
+    blendOverReversedScalar(dest + i, source - i, count - i);
+}
+
+SSE2_FUNCTION static void fillSSE2(uint32_t *dest, int count, uint32_t color)
+{
+    auto value = _mm_set1_epi32(color);
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), value);
+
+    fillScalar(dest + i, count - i, color);
+}
+
+SSE2_FUNCTION static void fillOverSSE2(uint32_t *dest, int count, uint32_t color)
+{
+    if((color & AlphaMask) == AlphaMask)
+    {
+        fillSSE2(dest, count, color);
+        return;
+    }
+
+    if((color & AlphaMask) == 0)
+        return;
+
+    auto value = _mm_set1_epi32(color);
+    __m128i lowWeights, highWeights;
+    inverseAlphaWeightsSSE2(value, lowWeights, highWeights);
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto destination = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), blendOverLanesSSE2(destination, value, lowWeights, highWeights));
+    }
+
+    fillOverScalar(dest + i, count - i, color);
+}
+
+// A row is a store of four pixels and one of two.
+SSE2_FUNCTION static void fill6x6SSE2(uint8_t *dest, int pitch, uint32_t color)
+{
+    auto value = _mm_set1_epi32(color);
+    for(int y = 0; y < 6; ++y, dest += pitch)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest), value);
+        _mm_storel_epi64(reinterpret_cast<__m128i*> (dest + 16), value);
+    }
+}
+
+// The channels are widened to 16 bits, where (second - first)*weight fits.
+SSE2_FUNCTION inline __m128i blendSSE2(__m128i first, __m128i second, __m128i lowWeights, __m128i highWeights)
+{
+    auto zero = _mm_setzero_si128();
+    auto firstLow = _mm_unpacklo_epi8(first, zero);
+    auto firstHigh = _mm_unpackhi_epi8(first, zero);
+    auto low = _mm_add_epi16(firstLow, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(second, zero), firstLow), lowWeights), 7));
+    auto high = _mm_add_epi16(firstHigh, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(second, zero), firstHigh), highWeights), 7));
+    return _mm_packus_epi16(low, high);
+}
+
+SSE2_FUNCTION static void blendRowsSSE2(uint32_t *dest, const uint32_t *first, const uint32_t *second, int count, int weight)
+{
+    auto weights = _mm_set1_epi16(short(weight));
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*> (first + i));
+        auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*> (second + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), blendSSE2(a, b, weights, weights));
+    }
+
+    blendRowsScalar(dest + i, first + i, second + i, count - i, weight);
+}
+
+// The channels of the enabled effects are done in 16 bits, where every product
+// fits, and packed back once at the end.
+template<uint32_t Effects>
+SSE2_FUNCTION static void postProcessSSE2With(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters)
+{
+    constexpr uint32_t ChannelEffects = PostProcessEffects::Tint | PostProcessEffects::Flash | PostProcessEffects::Vignette;
+
+    auto zero = _mm_setzero_si128();
+    auto tint = parameters.tintColor;
+    auto tintFactors = _mm_set1_epi64x(int64_t((tint & 0xFF) + 1) | (int64_t(((tint >> 8) & 0xFF) + 1) << 16) |
+        (int64_t(((tint >> 16) & 0xFF) + 1) << 32) | (int64_t((tint >> 24) + 1) << 48));
+    auto flash = _mm_unpacklo_epi8(_mm_set1_epi32(parameters.flashColor), zero);
+    auto flashWeights = _mm_set1_epi16(short(parameters.flashWeight));
+
+    auto rowDistance2 = _mm_set1_ps((Effects & PostProcessEffects::Vignette) ? vignetteRowDistance2(y, parameters) : 0.0f);
+    auto colorChannels = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    auto alphaFactors = _mm_setr_epi16(0, 0, 0, 256, 0, 0, 0, 256);
+
+    // Steps of four keep the parity of x, so the lane pattern is fixed for the row.
+    auto mask = parameters.checkerboardMask;
+    auto checkerboard = ((x ^ y) & 1)
+        ? _mm_setr_epi32(mask, -1, mask, -1)
+        : _mm_setr_epi32(-1, mask, -1, mask);
+
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto color = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        if(Effects & ChannelEffects)
+        {
+            auto low = _mm_unpacklo_epi8(color, zero);
+            auto high = _mm_unpackhi_epi8(color, zero);
+            if(Effects & PostProcessEffects::Tint)
+            {
+                low = _mm_srli_epi16(_mm_mullo_epi16(low, tintFactors), 8);
+                high = _mm_srli_epi16(_mm_mullo_epi16(high, tintFactors), 8);
+            }
+            if(Effects & PostProcessEffects::Flash)
+            {
+                low = _mm_add_epi16(low, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(flash, low), flashWeights), 7));
+                high = _mm_add_epi16(high, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(flash, high), flashWeights), 7));
+            }
+            if(Effects & PostProcessEffects::Vignette)
+            {
+                auto u = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x + i), _mm_setr_epi32(0, 1, 2, 3))),
+                    _mm_set1_ps(parameters.vignetteCenterX)), _mm_set1_ps(parameters.vignetteScaleX));
+                auto outside = _mm_max_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(u, u), rowDistance2), _mm_set1_ps(parameters.vignetteInnerRadius2)), _mm_setzero_ps());
+                auto factor = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(256.0f), _mm_mul_ps(outside, _mm_set1_ps(parameters.vignetteStrength))), _mm_setzero_ps());
+
+                // Every pixel factor goes to its three color channels.
+                auto pixelFactors = _mm_cvttps_epi32(factor);
+                pixelFactors = _mm_or_si128(pixelFactors, _mm_slli_epi32(pixelFactors, 16));
+                auto lowFactors = _mm_or_si128(_mm_and_si128(_mm_unpacklo_epi32(pixelFactors, pixelFactors), colorChannels), alphaFactors);
+                auto highFactors = _mm_or_si128(_mm_and_si128(_mm_unpackhi_epi32(pixelFactors, pixelFactors), colorChannels), alphaFactors);
+                low = _mm_srli_epi16(_mm_mullo_epi16(low, lowFactors), 8);
+                high = _mm_srli_epi16(_mm_mullo_epi16(high, highFactors), 8);
+            }
+            color = _mm_packus_epi16(low, high);
+        }
+        if(Effects & PostProcessEffects::Checkerboard)
+            color = _mm_and_si128(color, checkerboard);
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), color);
+    }
+
+    postProcessScalarWith<Effects>(dest + i, count - i, x + i, y, parameters);
+}
+
+SSE2_FUNCTION static void swapRedBlueSSE2(uint32_t *dest, const uint32_t *source, int count)
+{
+    auto greenAlpha = _mm_set1_epi32(0xFF00FF00);
+    auto low = _mm_set1_epi32(0xFF);
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto color = _mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i));
+        auto swapped = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(color, low), 16), _mm_and_si128(_mm_srli_epi32(color, 16), low));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), _mm_or_si128(_mm_and_si128(color, greenAlpha), swapped));
+    }
+
+    swapRedBlueScalar(dest + i, source + i, count - i);
+}
+
+SSE2_FUNCTION inline __m128i packRGB565LanesSSE2(__m128i color)
+{
+    auto red = _mm_slli_epi32(_mm_and_si128(color, _mm_set1_epi32(0xF8)), 8);
+    auto green = _mm_srli_epi32(_mm_and_si128(color, _mm_set1_epi32(0xFC00)), 5);
+    auto blue = _mm_and_si128(_mm_srli_epi32(color, 19), _mm_set1_epi32(0x1F));
+
+    // The pack saturates signed values, so the lanes are sign extended first.
+    auto packed = _mm_or_si128(_mm_or_si128(red, green), blue);
+    return _mm_srai_epi32(_mm_slli_epi32(packed, 16), 16);
+}
+
+SSE2_FUNCTION static void packRGB565SSE2(uint16_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto first = packRGB565LanesSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i)));
+        auto second = packRGB565LanesSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i + 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), _mm_packs_epi32(first, second));
+    }
+
+    packRGB565Scalar(dest + i, source + i, count - i);
+}
+
+// Groups of four points are tested at once, and the indices are only written
+// for the groups that have a point inside, which few do when most of the points
+// are far away.
+SSE2_FUNCTION static int selectPointsInBoxSSE2(int32_t *indices, const float *x, const float *y, int count, float minX, float minY, float maxX, float maxY)
+{
+    auto boxMinX = _mm_set1_ps(minX);
+    auto boxMinY = _mm_set1_ps(minY);
+    auto boxMaxX = _mm_set1_ps(maxX);
+    auto boxMaxY = _mm_set1_ps(maxY);
+    int selected = 0;
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto pointX = _mm_loadu_ps(x + i);
+        auto pointY = _mm_loadu_ps(y + i);
+        auto inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(pointX, boxMinX), _mm_cmple_ps(pointX, boxMaxX)),
+            _mm_and_ps(_mm_cmpge_ps(pointY, boxMinY), _mm_cmple_ps(pointY, boxMaxY)));
+        auto mask = _mm_movemask_ps(inside);
+        if(mask == 0)
+            continue;
+
+        for(int lane = 0; lane < 4; ++lane)
+        {
+            indices[selected] = i + lane;
+            selected += (mask >> lane) & 1;
+        }
+    }
+
+    return selectPointsInBoxRange(indices, selected, i, count, x, y, minX, minY, maxX, maxY);
+}
+
+static const PostProcessFunction PostProcessSSE2Variants[] = POST_PROCESS_VARIANTS(postProcessSSE2With);
+
+static void postProcessSSE2(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters)
+{
+    PostProcessSSE2Variants[parameters.effects & PostProcessEffects::All](dest, count, x, y, parameters);
+}
+
+// The same factor is used by the three color channels of every pixel.
+SSE2_FUNCTION static void scaleColorsSSE2(uint32_t *dest, int count, uint32_t factor)
+{
+    auto zero = _mm_setzero_si128();
+    auto colorFactor = short(factor);
+    auto factors = _mm_setr_epi16(colorFactor, colorFactor, colorFactor, 256, colorFactor, colorFactor, colorFactor, 256);
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        auto color = _mm_loadu_si128(reinterpret_cast<const __m128i*> (dest + i));
+        auto low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(color, zero), factors), 8);
+        auto high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(color, zero), factors), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), _mm_packus_epi16(low, high));
+    }
+
+    scaleColorsScalar(dest + i, count - i, factor);
+}
+
+static const PixelKernels SSE2PixelKernels = {
+    "sse2",
+    copyAlphaTestedSSE2,
+    copyAlphaTestedReversedSSE2,
+    copyReversedSSE2,
+    copyTintedSSE2,
+    copyTintedReversedSSE2,
+    blendOverSSE2,
+    blendOverReversedSSE2,
+    fillSSE2,
+    fillOverSSE2,
+    fill6x6SSE2,
+    postProcessSSE2,
+    scaleColorsSSE2,
+    swapRedBlueSSE2,
+    packRGB565SSE2,
+
+    // There are no gathers before AVX2.
+    expandIndexed8Scalar,
+    expandIndexed16Scalar,
+    gatherScalar,
+    blendRowsSSE2,
+    gatherBlendedScalar,
+    selectPointsInBoxSSE2,
+};
+
+//==============================================================================
+// AVX2 kernels. Alpha testing is done with masked stores, so the transparent
+// destination pixels are never read nor written.
+
+AVX2_FUNCTION inline __m256i opaqueMaskAVX2(__m256i color)
+{
+    auto transparent = _mm256_cmpeq_epi32(_mm256_and_si256(color, _mm256_set1_epi32(AlphaMask)), _mm256_setzero_si256());
+    return _mm256_xor_si256(transparent, _mm256_set1_epi32(-1));
+}
+
+AVX2_FUNCTION inline __m256i reverseAVX2(__m256i value)
+{
+    return _mm256_permutevar8x32_epi32(value, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+AVX2_FUNCTION static void copyAlphaTestedAVX2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (source + i));
+        _mm256_maskstore_epi32(reinterpret_cast<int*> (dest + i), opaqueMaskAVX2(color), color);
+    }
+
+    copyAlphaTestedScalar(dest + i, source + i, count - i);
+}
+
+AVX2_FUNCTION static void copyAlphaTestedReversedAVX2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = reverseAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*> (source - i - 7)));
+        _mm256_maskstore_epi32(reinterpret_cast<int*> (dest + i), opaqueMaskAVX2(color), color);
+    }
+
+    copyAlphaTestedReversedScalar(dest + i, source - i, count - i);
+}
+
+AVX2_FUNCTION static void copyReversedAVX2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = reverseAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*> (source - i - 7)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), color);
+    }
+
+    copyReversedScalar(dest + i, source - i, count - i);
+}
+
+AVX2_FUNCTION static void copyTintedAVX2(uint32_t *dest, const uint32_t *source, int count, uint32_t color)
+{
+    auto tint = _mm256_set1_epi32(color);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto sourceColor = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (source + i));
+        _mm256_maskstore_epi32(reinterpret_cast<int*> (dest + i), opaqueMaskAVX2(sourceColor), _mm256_and_si256(sourceColor, tint));
+    }
+
+    copyTintedScalar(dest + i, source + i, count - i, color);
+}
+
+AVX2_FUNCTION static void copyTintedReversedAVX2(uint32_t *dest, const uint32_t *source, int count, uint32_t color)
+{
+    auto tint = _mm256_set1_epi32(color);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto sourceColor = reverseAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*> (source - i - 7)));
+        _mm256_maskstore_epi32(reinterpret_cast<int*> (dest + i), opaqueMaskAVX2(sourceColor), _mm256_and_si256(sourceColor, tint));
+    }
+
+    copyTintedReversedScalar(dest + i, source - i, count - i, color);
+}
+
+AVX2_FUNCTION inline void inverseAlphaWeightsAVX2(__m256i color, __m256i &lowWeights, __m256i &highWeights)
+{
+    auto inverseAlpha = _mm256_sub_epi32(_mm256_set1_epi32(255), _mm256_srli_epi32(color, 24));
+    inverseAlpha = _mm256_or_si256(inverseAlpha, _mm256_slli_epi32(inverseAlpha, 16));
+    lowWeights = _mm256_unpacklo_epi32(inverseAlpha, inverseAlpha);
+    highWeights = _mm256_unpackhi_epi32(inverseAlpha, inverseAlpha);
+}
+
+AVX2_FUNCTION inline __m256i blendOverLanesAVX2(__m256i destination, __m256i color, __m256i lowWeights, __m256i highWeights)
+{
+    auto zero = _mm256_setzero_si256();
+    auto rounding = _mm256_set1_epi16(128);
+    auto low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(destination, zero), lowWeights), rounding);
+    auto high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(destination, zero), highWeights), rounding);
+    low = _mm256_srli_epi16(_mm256_add_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+    high = _mm256_srli_epi16(_mm256_add_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+    return _mm256_adds_epu8(color, _mm256_packus_epi16(low, high));
+}
+
+// The transparent pixels of a translucent group are left out of the store.
+AVX2_FUNCTION inline void blendOverGroupAVX2(uint32_t *dest, __m256i color)
+{
+    auto alpha = _mm256_and_si256(color, _mm256_set1_epi32(AlphaMask));
+    auto transparent = _mm256_cmpeq_epi32(alpha, _mm256_setzero_si256());
+    if(_mm256_movemask_epi8(transparent) == -1)
+        return;
+
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, _mm256_set1_epi32(AlphaMask))) == -1)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest), color);
+        return;
+    }
+
+    __m256i lowWeights, highWeights;
+    inverseAlphaWeightsAVX2(color, lowWeights, highWeights);
+    auto destination = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (dest));
+    auto blended = blendOverLanesAVX2(destination, color, lowWeights, highWeights);
+    _mm256_maskstore_epi32(reinterpret_cast<int*> (dest), _mm256_xor_si256(transparent, _mm256_set1_epi32(-1)), blended);
+}
+
+AVX2_FUNCTION static void blendOverAVX2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+        blendOverGroupAVX2(dest + i, _mm256_loadu_si256(reinterpret_cast<const __m256i*> (source + i)));
+
+    blendOverSSE2(dest + i, source + i, count - i);
+}
+
+AVX2_FUNCTION static void blendOverReversedAVX2(uint32_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+        blendOverGroupAVX2(dest + i, reverseAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*> (source - i - 7))));
+
+    blendOverReversedSSE2(dest + i, source - i, count - i);
+}
+
+AVX2_FUNCTION static void fillAVX2(uint32_t *dest, int count, uint32_t color)
+{
+    auto value = _mm256_set1_epi32(color);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), value);
+
+    fillScalar(dest + i, count - i, color);
+}
+
+AVX2_FUNCTION static void fillOverAVX2(uint32_t *dest, int count, uint32_t color)
+{
+    if((color & AlphaMask) == AlphaMask)
+    {
+        fillAVX2(dest, count, color);
+        return;
+    }
+
+    if((color & AlphaMask) == 0)
+        return;
+
+    auto value = _mm256_set1_epi32(color);
+    __m256i lowWeights, highWeights;
+    inverseAlphaWeightsAVX2(value, lowWeights, highWeights);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto destination = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (dest + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), blendOverLanesAVX2(destination, value, lowWeights, highWeights));
+    }
+
+    fillOverSSE2(dest + i, count - i, color);
+}
+
+AVX2_FUNCTION static void expandIndexed8AVX2(uint32_t *dest, const uint8_t *source, int count, const uint32_t *palette)
+{
+    auto table = reinterpret_cast<const int*> (palette);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*> (source + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), _mm256_i32gather_epi32(table, indices, 4));
+    }
+
+    expandIndexed8Scalar(dest + i, source + i, count - i, palette);
+}
+
+AVX2_FUNCTION static void expandIndexed16AVX2(uint32_t *dest, const uint16_t *source, int count, const uint32_t *palette)
+{
+    auto table = reinterpret_cast<const int*> (palette);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto indices = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), _mm256_i32gather_epi32(table, indices, 4));
+    }
+
+    expandIndexed16Scalar(dest + i, source + i, count - i, palette);
+}
+
+AVX2_FUNCTION static void gatherAVX2(uint32_t *dest, const uint32_t *source, const int32_t *indices, int count)
+{
+    auto table = reinterpret_cast<const int*> (source);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto sourceIndices = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (indices + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), _mm256_i32gather_epi32(table, sourceIndices, 4));
+    }
+
+    gatherScalar(dest + i, source, indices + i, count - i);
+}
+
+AVX2_FUNCTION inline __m256i blendAVX2(__m256i first, __m256i second, __m256i lowWeights, __m256i highWeights)
+{
+    auto zero = _mm256_setzero_si256();
+    auto firstLow = _mm256_unpacklo_epi8(first, zero);
+    auto firstHigh = _mm256_unpackhi_epi8(first, zero);
+    auto low = _mm256_add_epi16(firstLow, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_unpacklo_epi8(second, zero), firstLow), lowWeights), 7));
+    auto high = _mm256_add_epi16(firstHigh, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_unpackhi_epi8(second, zero), firstHigh), highWeights), 7));
+    return _mm256_packus_epi16(low, high);
+}
+
+AVX2_FUNCTION static void blendRowsAVX2(uint32_t *dest, const uint32_t *first, const uint32_t *second, int count, int weight)
+{
+    auto weights = _mm256_set1_epi16(short(weight));
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (first + i));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (second + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), blendAVX2(a, b, weights, weights));
+    }
+
+    blendRowsScalar(dest + i, first + i, second + i, count - i, weight);
+}
+
+AVX2_FUNCTION static void gatherBlendedAVX2(uint32_t *dest, const uint32_t *source, const int32_t *firstIndices, const int32_t *secondIndices, const int32_t *weights, int count)
+{
+    auto table = reinterpret_cast<const int*> (source);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto a = _mm256_i32gather_epi32(table, _mm256_loadu_si256(reinterpret_cast<const __m256i*> (firstIndices + i)), 4);
+        auto b = _mm256_i32gather_epi32(table, _mm256_loadu_si256(reinterpret_cast<const __m256i*> (secondIndices + i)), 4);
+
+        // Every pixel weight goes to the four 16 bit channels of its pixel.
+        auto pixelWeights = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (weights + i));
+        pixelWeights = _mm256_or_si256(pixelWeights, _mm256_slli_epi32(pixelWeights, 16));
+        auto lowWeights = _mm256_unpacklo_epi32(pixelWeights, pixelWeights);
+        auto highWeights = _mm256_unpackhi_epi32(pixelWeights, pixelWeights);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), blendAVX2(a, b, lowWeights, highWeights));
+    }
+
+    gatherBlendedScalar(dest + i, source, firstIndices + i, secondIndices + i, weights + i, count - i);
+}
+
+template<uint32_t Effects>
+AVX2_FUNCTION static void postProcessAVX2With(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters)
+{
+    constexpr uint32_t ChannelEffects = PostProcessEffects::Tint | PostProcessEffects::Flash | PostProcessEffects::Vignette;
+
+    auto zero = _mm256_setzero_si256();
+    auto tint = parameters.tintColor;
+    auto tintFactors = _mm256_set1_epi64x(int64_t((tint & 0xFF) + 1) | (int64_t(((tint >> 8) & 0xFF) + 1) << 16) |
+        (int64_t(((tint >> 16) & 0xFF) + 1) << 32) | (int64_t((tint >> 24) + 1) << 48));
+    auto flash = _mm256_unpacklo_epi8(_mm256_set1_epi32(parameters.flashColor), zero);
+    auto flashWeights = _mm256_set1_epi16(short(parameters.flashWeight));
+
+    auto rowDistance2 = _mm256_set1_ps((Effects & PostProcessEffects::Vignette) ? vignetteRowDistance2(y, parameters) : 0.0f);
+
+    auto mask = parameters.checkerboardMask;
+    auto checkerboard = ((x ^ y) & 1)
+        ? _mm256_setr_epi32(mask, -1, mask, -1, mask, -1, mask, -1)
+        : _mm256_setr_epi32(-1, mask, -1, mask, -1, mask, -1, mask);
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (dest + i));
+        if(Effects & ChannelEffects)
+        {
+            auto low = _mm256_unpacklo_epi8(color, zero);
+            auto high = _mm256_unpackhi_epi8(color, zero);
+            if(Effects & PostProcessEffects::Tint)
+            {
+                low = _mm256_srli_epi16(_mm256_mullo_epi16(low, tintFactors), 8);
+                high = _mm256_srli_epi16(_mm256_mullo_epi16(high, tintFactors), 8);
+            }
+            if(Effects & PostProcessEffects::Flash)
+            {
+                low = _mm256_add_epi16(low, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(flash, low), flashWeights), 7));
+                high = _mm256_add_epi16(high, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(flash, high), flashWeights), 7));
+            }
+            if(Effects & PostProcessEffects::Vignette)
+            {
+                auto u = _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x + i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))),
+                    _mm256_set1_ps(parameters.vignetteCenterX)), _mm256_set1_ps(parameters.vignetteScaleX));
+                auto outside = _mm256_max_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(u, u), rowDistance2), _mm256_set1_ps(parameters.vignetteInnerRadius2)), _mm256_setzero_ps());
+                auto factor = _mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(256.0f), _mm256_mul_ps(outside, _mm256_set1_ps(parameters.vignetteStrength))), _mm256_setzero_ps());
+
+                // The alpha channels keep a factor of 256.
+                auto pixelFactors = _mm256_cvttps_epi32(factor);
+                pixelFactors = _mm256_or_si256(pixelFactors, _mm256_slli_epi32(pixelFactors, 16));
+                auto alphaFactors = _mm256_set1_epi16(256);
+                auto lowFactors = _mm256_blend_epi16(_mm256_unpacklo_epi32(pixelFactors, pixelFactors), alphaFactors, 0x88);
+                auto highFactors = _mm256_blend_epi16(_mm256_unpackhi_epi32(pixelFactors, pixelFactors), alphaFactors, 0x88);
+                low = _mm256_srli_epi16(_mm256_mullo_epi16(low, lowFactors), 8);
+                high = _mm256_srli_epi16(_mm256_mullo_epi16(high, highFactors), 8);
+            }
+            color = _mm256_packus_epi16(low, high);
+        }
+        if(Effects & PostProcessEffects::Checkerboard)
+            color = _mm256_and_si256(color, checkerboard);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), color);
+    }
+
+    postProcessScalarWith<Effects>(dest + i, count - i, x + i, y, parameters);
+}
+
+AVX2_FUNCTION static void swapRedBlueAVX2(uint32_t *dest, const uint32_t *source, int count)
+{
+    auto order = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (source + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), _mm256_shuffle_epi8(color, order));
+    }
+
+    swapRedBlueScalar(dest + i, source + i, count - i);
+}
+
+AVX2_FUNCTION static void packRGB565AVX2(uint16_t *dest, const uint32_t *source, int count)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (source + i));
+        auto red = _mm256_slli_epi32(_mm256_and_si256(color, _mm256_set1_epi32(0xF8)), 8);
+        auto green = _mm256_srli_epi32(_mm256_and_si256(color, _mm256_set1_epi32(0xFC00)), 5);
+        auto blue = _mm256_and_si256(_mm256_srli_epi32(color, 19), _mm256_set1_epi32(0x1F));
+        auto packed = _mm256_or_si256(_mm256_or_si256(red, green), blue);
+
+        // The pack works inside the 128 bit lanes, so their halves are joined after it.
+        packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(packed, packed), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*> (dest + i), _mm256_castsi256_si128(packed));
+    }
+
+    packRGB565Scalar(dest + i, source + i, count - i);
+}
+
+AVX2_FUNCTION static int selectPointsInBoxAVX2(int32_t *indices, const float *x, const float *y, int count, float minX, float minY, float maxX, float maxY)
+{
+    auto boxMinX = _mm256_set1_ps(minX);
+    auto boxMinY = _mm256_set1_ps(minY);
+    auto boxMaxX = _mm256_set1_ps(maxX);
+    auto boxMaxY = _mm256_set1_ps(maxY);
+    int selected = 0;
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto pointX = _mm256_loadu_ps(x + i);
+        auto pointY = _mm256_loadu_ps(y + i);
+        auto inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(pointX, boxMinX, _CMP_GE_OQ), _mm256_cmp_ps(pointX, boxMaxX, _CMP_LE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(pointY, boxMinY, _CMP_GE_OQ), _mm256_cmp_ps(pointY, boxMaxY, _CMP_LE_OQ)));
+        auto mask = _mm256_movemask_ps(inside);
+        if(mask == 0)
+            continue;
+
+        for(int lane = 0; lane < 8; ++lane)
+        {
+            indices[selected] = i + lane;
+            selected += (mask >> lane) & 1;
+        }
+    }
+
+    return selectPointsInBoxRange(indices, selected, i, count, x, y, minX, minY, maxX, maxY);
+}
+
+static const PostProcessFunction PostProcessAVX2Variants[] = POST_PROCESS_VARIANTS(postProcessAVX2With);
+
+static void postProcessAVX2(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters)
+{
+    PostProcessAVX2Variants[parameters.effects & PostProcessEffects::All](dest, count, x, y, parameters);
+}
+
+AVX2_FUNCTION static void scaleColorsAVX2(uint32_t *dest, int count, uint32_t factor)
+{
+    auto zero = _mm256_setzero_si256();
+    auto colorFactor = short(factor);
+    auto factors = _mm256_setr_epi16(colorFactor, colorFactor, colorFactor, 256, colorFactor, colorFactor, colorFactor, 256,
+        colorFactor, colorFactor, colorFactor, 256, colorFactor, colorFactor, colorFactor, 256);
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        auto color = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (dest + i));
+        auto low = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(color, zero), factors), 8);
+        auto high = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(color, zero), factors), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*> (dest + i), _mm256_packus_epi16(low, high));
+    }
+
+    scaleColorsSSE2(dest + i, count - i, factor);
+}
+
+static const PixelKernels AVX2PixelKernels = {
+    "avx2",
+    copyAlphaTestedAVX2,
+    copyAlphaTestedReversedAVX2,
+    copyReversedAVX2,
+    copyTintedAVX2,
+    copyTintedReversedAVX2,
+    blendOverAVX2,
+    blendOverReversedAVX2,
+    fillAVX2,
+    fillOverAVX2,
+
+    // Six pixels are no wider than a SSE2 store and a half.
+    fill6x6SSE2,
+    postProcessAVX2,
+    scaleColorsAVX2,
+    swapRedBlueAVX2,
+    packRGB565AVX2,
+    expandIndexed8AVX2,
+    expandIndexed16AVX2,
+    gatherAVX2,
+    blendRowsAVX2,
+    gatherBlendedAVX2,
+    selectPointsInBoxAVX2,
+};
+
+static bool cpuSupportsSSE2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1<<26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool cpuSupportsAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] < 7)
+        return false;
+
+    // The OS has to save the YMM registers on context switches.
+    __cpuid(info, 1);
+    bool hasOSXSave = (info[2] & (1<<27)) != 0;
+    bool hasAVX = (info[2] & (1<<28)) != 0;
+    if(!hasOSXSave || !hasAVX || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1<<5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif //PIXEL_KERNELS_X86
+
+PixelKernels pixelKernels;
+
+const char *displayPixelFormatName(DisplayPixelFormat format)
+{
+    switch(format)
+    {
+    case DisplayPixelFormat::ABGR8888:
+        return "abgr8888";
+    case DisplayPixelFormat::ARGB8888:
+        return "argb8888";
+    case DisplayPixelFormat::RGB565:
+        return "rgb565";
+    default:
+        return "unknown";
+    }
+}
+
+int displayPixelFormatSize(DisplayPixelFormat format)
+{
+    return format == DisplayPixelFormat::RGB565 ? 2 : 4;
+}
+
+void convertPixels(DisplayPixelFormat format, uint8_t *dest, const uint32_t *source, int count)
+{
+    switch(format)
+    {
+    case DisplayPixelFormat::ARGB8888:
+        pixelKernels.swapRedBlue(reinterpret_cast<uint32_t*> (dest), source, count);
+        break;
+    case DisplayPixelFormat::RGB565:
+        pixelKernels.packRGB565(reinterpret_cast<uint16_t*> (dest), source, count);
+        break;
+    default:
+        memcpy(dest, source, count*4);
+        break;
+    }
+}
+
+static struct PixelKernelsSelector
+{
+    PixelKernelsSelector()
+    {
+        pixelKernels = ScalarPixelKernels;
+#ifdef PIXEL_KERNELS_X86
+        if(cpuSupportsAVX2())
+            pixelKernels = AVX2PixelKernels;
+        else if(cpuSupportsSSE2())
+            pixelKernels = SSE2PixelKernels;
+
+        // Allow forcing a lower version, to compare the outputs.
+        auto forcedName = getenv("SMALCODED_PIXEL_KERNELS");
+        if(forcedName)
+        {
+            if(!strcmp(forcedName, ScalarPixelKernels.name))
+                pixelKernels = ScalarPixelKernels;
+            else if(!strcmp(forcedName, SSE2PixelKernels.name) && cpuSupportsSSE2())
+                pixelKernels = SSE2PixelKernels;
+        }
+#endif
+    }
+} pixelKernelsSelector;
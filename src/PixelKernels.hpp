@@ -0,0 +1,143 @@
+#ifndef SMALL_ECO_DESTROYED_PIXEL_KERNELS_HPP
+#define SMALL_ECO_DESTROYED_PIXEL_KERNELS_HPP
+
+#include <stdint.h>
+
+namespace PostProcessEffects
+{
+// In the order in which they are applied.
+enum Effect
+{
+    None = 0,
+    Tint = 1<<0,
+    Flash = 1<<1,
+    Vignette = 1<<2,
+    Checkerboard = 1<<3,
+
+    All = Tint | Flash | Vignette | Checkerboard,
+};
+};
+
+struct PostProcessParameters
+{
+    uint32_t effects;
+
+    // Every channel c becomes (c*(t + 1)) >> 8, where t is the channel of the
+    // tint, so a tint of 0xFFFFFFFF keeps the colors.
+    uint32_t tintColor;
+
+    // Blends toward the color, with a weight from 0 to BlendWeightOne.
+    uint32_t flashColor;
+    int flashWeight;
+
+    // The color channels are scaled by a factor that goes from 256 down to
+    // zero as the squared distance to the center, in half screens, goes past
+    // the inner radius.
+    float vignetteCenterX;
+    float vignetteCenterY;
+    float vignetteScaleX;
+    float vignetteScaleY;
+    float vignetteInnerRadius2;
+    float vignetteStrength;
+
+    // Masks the pixels where (x ^ y) is odd.
+    uint32_t checkerboardMask;
+};
+
+// Span kernels used by the software renderer. Most of them work on a single row
+// of pixels. The best implementation for the running CPU is selected at startup.
+struct PixelKernels
+{
+    const char *name;
+
+    // dest[i] = source[i] when the alpha of source[i] is not zero.
+    void (*copyAlphaTested)(uint32_t *dest, const uint32_t *source, int count);
+
+    // dest[i] = source[-i] when the alpha of source[-i] is not zero.
+    void (*copyAlphaTestedReversed)(uint32_t *dest, const uint32_t *source, int count);
+
+    // dest[i] = source[-i]
+    void (*copyReversed)(uint32_t *dest, const uint32_t *source, int count);
+
+    // dest[i] = color & source[i] when the alpha of source[i] is not zero.
+    void (*copyTinted)(uint32_t *dest, const uint32_t *source, int count, uint32_t color);
+
+    // dest[i] = color & source[-i] when the alpha of source[-i] is not zero.
+    void (*copyTintedReversed)(uint32_t *dest, const uint32_t *source, int count, uint32_t color);
+
+    // The premultiplied source[i] over dest[i]: every channel c of dest[i]
+    // becomes s + c*(255 - a)/255, rounded and saturated, where s is the channel
+    // of source[i] and a its alpha. The pixels with a zero alpha are skipped.
+    // Groups of pixels that are all transparent or all opaque skip the blend.
+    void (*blendOver)(uint32_t *dest, const uint32_t *source, int count);
+
+    // The premultiplied source[-i] over dest[i].
+    void (*blendOverReversed)(uint32_t *dest, const uint32_t *source, int count);
+
+    // dest[i] = color
+    void (*fill)(uint32_t *dest, int count, uint32_t color);
+
+    // The premultiplied color over dest[i].
+    void (*fillOver)(uint32_t *dest, int count, uint32_t color);
+
+    // Fills the 6x6 pixels whose top left one is dest, with rows that are pitch
+    // bytes apart. This is the size of a bullet at the normal zoom.
+    void (*fill6x6)(uint8_t *dest, int pitch, uint32_t color);
+
+    // Applies every enabled effect to the count pixels that start at (x, y), in
+    // a single pass. The disabled effects have no cost.
+    void (*postProcess)(uint32_t *dest, int count, int x, int y, const PostProcessParameters &parameters);
+
+    // Every color channel c of dest[i] becomes (c*factor) >> 8, and the alpha
+    // is kept. A factor of 256 keeps the colors.
+    void (*scaleColors)(uint32_t *dest, int count, uint32_t factor);
+
+    // dest[i] = source[i] with the red and blue channels swapped.
+    void (*swapRedBlue)(uint32_t *dest, const uint32_t *source, int count);
+
+    // dest[i] = source[i] as RGB565, with the low bits of the channels dropped.
+    void (*packRGB565)(uint16_t *dest, const uint32_t *source, int count);
+
+    // dest[i] = palette[source[i]]
+    void (*expandIndexed8)(uint32_t *dest, const uint8_t *source, int count, const uint32_t *palette);
+    void (*expandIndexed16)(uint32_t *dest, const uint16_t *source, int count, const uint32_t *palette);
+
+    // dest[i] = source[indices[i]]
+    void (*gather)(uint32_t *dest, const uint32_t *source, const int32_t *indices, int count);
+
+    // Every channel of dest[i] goes from first[i] to second[i] as the weight goes
+    // from 0 to BlendWeightOne: first + (((second - first)*weight) >> 7).
+    void (*blendRows)(uint32_t *dest, const uint32_t *first, const uint32_t *second, int count, int weight);
+
+    // dest[i] is the blend of source[firstIndices[i]] and source[secondIndices[i]]
+    // with weights[i].
+    void (*gatherBlended)(uint32_t *dest, const uint32_t *source, const int32_t *firstIndices, const int32_t *secondIndices, const int32_t *weights, int count);
+
+    // Writes the indices of the points with minX <= x[i] <= maxX and
+    // minY <= y[i] <= maxY in increasing order, and returns their number.
+    int (*selectPointsInBox)(int32_t *indices, const float *x, const float *y, int count, float minX, float minY, float maxX, float maxY);
+};
+
+static constexpr int BlendWeightOne = 128;
+
+extern PixelKernels pixelKernels;
+
+// The pixel formats of a display texture that the framebuffer colors can be
+// converted to, named as packed values from the high bits down. The colors of
+// the framebuffer are ABGR8888.
+enum class DisplayPixelFormat : uint8_t
+{
+    ABGR8888 = 0,
+    ARGB8888,
+    RGB565,
+
+    Count
+};
+
+const char *displayPixelFormatName(DisplayPixelFormat format);
+int displayPixelFormatSize(DisplayPixelFormat format);
+
+// Writes count framebuffer colors into dest in the given format.
+void convertPixels(DisplayPixelFormat format, uint8_t *dest, const uint32_t *source, int count);
+
+#endif //SMALL_ECO_DESTROYED_PIXEL_KERNELS_HPP
@@ -1,12 +1,59 @@
 #ifndef SMALL_ECO_DESTROYED_RECTANGLE_HPP
 #define SMALL_ECO_DESTROYED_RECTANGLE_HPP
 
+#include <algorithm>
+
 class Rectangle
 {
 public:
     Rectangle(int x = 0, int y = 0, int width = 0, int height = 0)
         : x(x), y(y), width(width), height(height) {}
 
+    bool isEmpty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+
+    int area() const
+    {
+        return width*height;
+    }
+
+    bool operator==(const Rectangle &o) const
+    {
+        return x == o.x && y == o.y && width == o.width && height == o.height;
+    }
+
+    bool operator!=(const Rectangle &o) const
+    {
+        return !(*this == o);
+    }
+
+    // Whether the rectangles overlap or share an edge.
+    bool touches(const Rectangle &o) const
+    {
+        return x <= o.x + o.width && o.x <= x + width &&
+            y <= o.y + o.height && o.y <= y + height;
+    }
+
+    Rectangle unionWith(const Rectangle &o) const
+    {
+        auto minX = std::min(x, o.x);
+        auto minY = std::min(y, o.y);
+        auto maxX = std::max(x + width, o.x + o.width);
+        auto maxY = std::max(y + height, o.y + o.height);
+        return Rectangle(minX, minY, maxX - minX, maxY - minY);
+    }
+
+    Rectangle intersectionWith(const Rectangle &o) const
+    {
+        auto minX = std::max(x, o.x);
+        auto minY = std::max(y, o.y);
+        auto maxX = std::min(x + width, o.x + o.width);
+        auto maxY = std::min(y + height, o.y + o.height);
+        return Rectangle(minX, minY, std::max(0, maxX - minX), std::max(0, maxY - minY));
+    }
+
     int x, y;
     int width, height;
 };
@@ -0,0 +1,259 @@
+#include "RenderSnapshot.hpp"
+#include "Renderer.hpp"
+#include "PixelKernels.hpp"
+#include "TripleBuffer.hpp"
+#include <algorithm>
+
+static TripleBuffer<RenderSnapshot> renderSnapshots;
+static bool hasConsumedSnapshot;
+
+// Particles this close outside of the view can still touch its pixels.
+static constexpr float ParticleViewMargin = 0.125f;
+static int32_t particlesInView[MaxNumberOfParticles];
+
+static void captureEntity(EntityRenderState &state, const Entity &entity)
+{
+    state.position = entity.position;
+    state.boundingBox = entity.boundingBox;
+    state.spriteType = entity.spriteType;
+    state.spriteRow = entity.spriteRow;
+    state.spriteColumn = entity.spriteColumn;
+    state.flipHorizontal = entity.flipHorizontal;
+    state.flipVertical = entity.flipVertical;
+}
+
+static void capturePlayer(PlayerRenderState &state, PlayerState &player)
+{
+    captureEntity(state, player);
+    state.isAlive = player.isAlive();
+    state.inBoat = player.inBoat;
+    state.damageFlash = player.damageFlash;
+    state.health = player.roundedHealth();
+    state.belly = player.roundedBelly();
+    state.ammo = player.withDemolitionBullets ? player.demolitionBullets : player.bullets;
+    state.withDemolitionBullets = player.withDemolitionBullets;
+}
+
+static void captureBullets(RenderSnapshot &snapshot)
+{
+    snapshot.bulletCount = global.numberOfAliveBullets;
+    snapshot.bulletCullRadius = 0.0f;
+    for(int i = 0; i < global.numberOfAliveBullets; ++i)
+    {
+        const auto &bullet = global.bullets[global.aliveBullets[i]];
+        const auto &box = bullet.boundingBox;
+        snapshot.bulletPositionsX[i] = bullet.position.x;
+        snapshot.bulletPositionsY[i] = bullet.position.y;
+        snapshot.bulletBoundingBoxes[i] = box;
+        snapshot.bulletColors[i] = (int(bullet.timeToLive*10) & 1) != 0 ? bullet.color : bullet.flashColor;
+        snapshot.bulletCullRadius = std::max(snapshot.bulletCullRadius,
+            std::max(std::max(-box.min.x, -box.min.y), std::max(box.max.x, box.max.y)));
+    }
+}
+
+// The world box that a viewport shows, grown by the margin on every side.
+static Box2 viewportWorldBox(const CameraState &camera, const Rectangle &rectangle, float margin)
+{
+    auto halfExtent = pixels2Units(Vector2(rectangle.width/2, rectangle.height/2)) * (1.0f / camera.zoom()) + Vector2(margin, margin);
+    return Box2(camera.position - halfExtent, camera.position + halfExtent);
+}
+
+// A particle in several viewports is only captured for the first of them.
+static void captureParticles(RenderSnapshot &snapshot, const RenderSettings &settings)
+{
+    snapshot.particleCount = 0;
+    if(!(settings.features & RenderFeatures::Particles))
+        return;
+
+    const auto &particles = global.particles;
+    Box2 viewBoxes[MaxPlayers];
+    int count = 0;
+    for(int i = 0; i < snapshot.playerCount; ++i)
+    {
+        auto rectangle = splitScreenViewport(settings.viewWidth, settings.viewHeight, snapshot.playerCount, i);
+        auto &viewBox = viewBoxes[i];
+        viewBox = viewportWorldBox(snapshot.viewports[i].camera, rectangle, ParticleViewMargin);
+
+        auto selectedCount = pixelKernels.selectPointsInBox(particlesInView, particles.positionsX, particles.positionsY, particles.count,
+            viewBox.min.x, viewBox.min.y, viewBox.max.x, viewBox.max.y);
+        for(int j = 0; j < selectedCount; ++j)
+        {
+            auto index = particlesInView[j];
+            auto position = Vector2(particles.positionsX[index], particles.positionsY[index]);
+            auto isInPreviousView = false;
+            for(int previous = 0; previous < i && !isInPreviousView; ++previous)
+                isInPreviousView = viewBoxes[previous].containsPoint(position);
+            if(isInPreviousView)
+                continue;
+
+            snapshot.particlePositionsX[count] = position.x;
+            snapshot.particlePositionsY[count] = position.y;
+            snapshot.particleColors[count] = particles.colors[index];
+            ++count;
+        }
+    }
+    snapshot.particleCount = count;
+}
+
+// The tiles of a viewport with the margin, in unwrapped world coordinates.
+static Rectangle viewportTileRectangle(const CameraState &camera, const Rectangle &rectangle)
+{
+    auto zoom = camera.zoom();
+    auto viewWidth = std::min(int(rectangle.width / zoom), MaxRenderViewWidth);
+    auto viewHeight = std::min(int(rectangle.height / zoom), MaxRenderViewHeight);
+
+    auto halfExtent = pixels2Units(Vector2(viewWidth/2, viewHeight/2));
+    auto minPosition = (camera.position - halfExtent).floor();
+    auto maxPosition = (camera.position + halfExtent).ceil();
+
+    auto minX = int(minPosition.x) - RenderSnapshotTileMargin;
+    auto minY = int(minPosition.y) - RenderSnapshotTileMargin;
+    return Rectangle(minX, minY, int(maxPosition.x) + RenderSnapshotTileMargin - minX + 1, int(maxPosition.y) + RenderSnapshotTileMargin - minY + 1);
+}
+
+// Two windows become one when it has no more tiles than both of them, so the
+// tiles of the players that are close are resolved once. Merging can make
+// the new window overlap a third one, so it goes on until nothing merges.
+static int mergeTileWindows(RenderSnapshot &snapshot, Rectangle *windowRectangles, int windowCount)
+{
+    for(auto merged = true; merged; )
+    {
+        merged = false;
+        for(int first = 0; first < windowCount && !merged; ++first)
+        {
+            for(int second = first + 1; second < windowCount && !merged; ++second)
+            {
+                auto together = windowRectangles[first].unionWith(windowRectangles[second]);
+                if(together.area() > windowRectangles[first].area() + windowRectangles[second].area())
+                    continue;
+
+                // The last window takes the place of the second one.
+                windowRectangles[first] = together;
+                windowRectangles[second] = windowRectangles[--windowCount];
+                for(int i = 0; i < snapshot.playerCount; ++i)
+                {
+                    auto &tileWindow = snapshot.viewports[i].tileWindow;
+                    if(tileWindow == second)
+                        tileWindow = first;
+                    else if(tileWindow == windowCount)
+                        tileWindow = second;
+                }
+                merged = true;
+            }
+        }
+    }
+
+    return windowCount;
+}
+
+static void captureTileWindow(RenderSnapshot &snapshot, const RenderTileWindow &window, int animationVariant, uint8_t ambientLight)
+{
+    const auto &map = global.map;
+    auto dest = snapshot.tiles + window.firstTile;
+    for(int y = 0; y < window.rows; ++y)
+    {
+        auto tileRow = floorModule(window.minY + y, TileMap::Height) * TileMap::Width;
+        for(int x = 0; x < window.columns; ++x, ++dest)
+        {
+            auto tileIndex = tileRow + floorModule(window.minX + x, TileMap::Width);
+            auto occupant = map.occupants[tileIndex];
+            dest->type = map.tiles[tileIndex];
+            dest->occupant = occupant;
+            dest->occupantVariation = occupant != TileOccupant::None ? map.occupantStates[tileIndex].generic.renderState & 1 : 0;
+            dest->animationVariant = Random::hashBit(animationVariant ^ map.tileRandom[tileIndex]);
+            dest->transition = map.transitions[tileIndex];
+            dest->light = std::max(ambientLight, global.lightMap.levels[tileIndex]);
+        }
+    }
+}
+
+static void captureTiles(RenderSnapshot &snapshot, const RenderSettings &settings)
+{
+    Rectangle windowRectangles[MaxPlayers];
+    for(int i = 0; i < snapshot.playerCount; ++i)
+    {
+        auto &viewport = snapshot.viewports[i];
+        auto rectangle = splitScreenViewport(settings.viewWidth, settings.viewHeight, snapshot.playerCount, i);
+        windowRectangles[i] = viewportTileRectangle(viewport.camera, rectangle);
+        viewport.tileWindow = i;
+    }
+    snapshot.tileWindowCount = mergeTileWindows(snapshot, windowRectangles, snapshot.playerCount);
+
+    // Without the animation every tile keeps one of its variants.
+    auto animationVariant = (settings.features & RenderFeatures::TileAnimation) ? global.map.animationVariant : 0;
+    auto ambientLight = uint8_t(global.ambientLight);
+
+    // The windows that do not fit lose their last rows, which the renderer
+    // waits for.
+    int firstTile = 0;
+    for(int i = 0; i < snapshot.tileWindowCount; ++i)
+    {
+        const auto &rectangle = windowRectangles[i];
+        auto &window = snapshot.tileWindows[i];
+        window.minX = rectangle.x;
+        window.minY = rectangle.y;
+        window.columns = rectangle.width;
+        window.rows = std::min(rectangle.height, (MaxRenderSnapshotTiles - firstTile) / rectangle.width);
+        window.firstTile = firstTile;
+        captureTileWindow(snapshot, window, animationVariant, ambientLight);
+        firstTile += window.columns*window.rows;
+    }
+}
+
+static void captureTileColors(RenderSnapshot &snapshot)
+{
+    const auto &changes = global.tileChanges;
+    auto behind = changes.revision - snapshot.tileColorRevision;
+    if(!snapshot.hasTileColors || behind > uint32_t(TileChangeLog::Capacity))
+    {
+        snapshot.tileColors.build(global.map.tiles);
+        snapshot.hasTileColors = true;
+    }
+    else
+    {
+        for(auto revision = snapshot.tileColorRevision; revision != changes.revision; ++revision)
+            snapshot.tileColors.updateTile(global.map.tiles, changes.tileIndices[revision % TileChangeLog::Capacity]);
+    }
+
+    snapshot.tileColorRevision = changes.revision;
+}
+
+void publishRenderSnapshot(const RenderSettings &settings)
+{
+    setScreenSize(settings.viewWidth, settings.viewHeight);
+
+    auto &snapshot = renderSnapshots.back();
+    snapshot.settings = settings;
+    snapshot.isPaused = global.isPaused;
+    snapshot.isGameCompleted = global.isGameCompleted;
+    snapshot.matchTime = global.matchTime;
+    snapshot.decayStage = global.decayStage;
+    snapshot.worldMap = global.worldMap;
+
+    snapshot.playerCount = global.playerCount;
+    for(int i = 0; i < global.playerCount; ++i)
+    {
+        capturePlayer(snapshot.players[i], global.players[i]);
+        snapshot.viewports[i].camera = global.cameras[i];
+    }
+    captureBullets(snapshot);
+    captureParticles(snapshot, settings);
+    captureTiles(snapshot, settings);
+    captureTileColors(snapshot);
+
+    renderSnapshots.publish();
+}
+
+bool consumeRenderSnapshot()
+{
+    if(!renderSnapshots.consume())
+        return false;
+
+    hasConsumedSnapshot = true;
+    return true;
+}
+
+const RenderSnapshot *getRenderSnapshot()
+{
+    return hasConsumedSnapshot ? &renderSnapshots.front() : nullptr;
+}
@@ -0,0 +1,149 @@
+#ifndef SMALL_ECO_DESTROYED_RENDER_SNAPSHOT_HPP
+#define SMALL_ECO_DESTROYED_RENDER_SNAPSHOT_HPP
+
+#include "GameLogic.hpp"
+#include "TileColorPyramid.hpp"
+
+// The largest view that a snapshot keeps the tiles for, in unscaled pixels. A
+// zoomed out camera needs more of them than the screen has.
+static constexpr int MaxRenderViewWidth = 8192;
+static constexpr int MaxRenderViewHeight = 8192;
+
+// Extra tiles kept around the view on every side.
+static constexpr int RenderSnapshotTileMargin = 2;
+static constexpr int MaxRenderSnapshotColumns = MaxRenderViewWidth / int(Units2Pixels) + 2*RenderSnapshotTileMargin + 2;
+static constexpr int MaxRenderSnapshotRows = MaxRenderViewHeight / int(Units2Pixels) + 2*RenderSnapshotTileMargin + 2;
+
+// The viewports of all the players share this many tiles.
+static constexpr int MaxRenderSnapshotTiles = MaxRenderSnapshotColumns*MaxRenderSnapshotRows;
+
+// Everything that decides how a tile looks.
+struct RenderTile
+{
+    TileType type;
+    TileOccupant occupant;
+    uint8_t occupantVariation;
+    uint8_t animationVariant;
+    uint8_t transition;
+
+    // From zero to MaxLightLevel.
+    uint8_t light;
+};
+
+struct EntityRenderState
+{
+    Vector2 position;
+    Box2 boundingBox;
+
+    SpriteType spriteType;
+    int spriteRow;
+    int spriteColumn;
+    bool flipHorizontal;
+    bool flipVertical;
+};
+
+struct PlayerRenderState : EntityRenderState
+{
+    bool isAlive;
+    bool inBoat;
+    float damageFlash;
+
+    // HUD values
+    int health;
+    int belly;
+    int ammo;
+    bool withDemolitionBullets;
+};
+
+// A rectangle of the snapshot tiles, in unwrapped world coordinates, whose rows
+// are stored one after the other from firstTile.
+struct RenderTileWindow
+{
+    int minX;
+    int minY;
+    int columns;
+    int rows;
+    int firstTile;
+};
+
+// The view of a player. The viewports whose tiles overlap read them from the
+// same window, so they are only captured once.
+struct RenderViewport
+{
+    CameraState camera;
+    int tileWindow;
+};
+
+// A copy of the state that the renderer reads, taken after an update. The
+// renderer never looks at the global state other than the assets, so it can
+// draw one snapshot while the next update runs on another thread.
+struct RenderSnapshot
+{
+    // The view that the snapshot was captured for, which is also the size of
+    // the framebuffer that it is drawn into.
+    RenderSettings settings;
+
+    bool isPaused;
+    bool isGameCompleted;
+    float matchTime;
+    DecayStage decayStage;
+    WorldMapState worldMap;
+
+    // Every player has the viewport with the same index.
+    int playerCount;
+    PlayerRenderState players[MaxPlayers];
+    RenderViewport viewports[MaxPlayers];
+
+    // The bullets are stored by field, so that the renderer can cull their
+    // positions in a single sweep. No corner of a bounding box is further than
+    // the cull radius from its position on either axis.
+    int bulletCount;
+    float bulletCullRadius;
+    float bulletPositionsX[MaxNumberOfBullets];
+    float bulletPositionsY[MaxNumberOfBullets];
+    Box2 bulletBoundingBoxes[MaxNumberOfBullets];
+    uint32_t bulletColors[MaxNumberOfBullets];
+
+    // The particles in the viewports, stored by field like the bullets. There
+    // are none when the settings shed the particles.
+    int particleCount;
+    float particlePositionsX[MaxNumberOfParticles];
+    float particlePositionsY[MaxNumberOfParticles];
+    uint32_t particleColors[MaxNumberOfParticles];
+
+    // The tiles around the cameras.
+    int tileWindowCount;
+    RenderTileWindow tileWindows[MaxPlayers];
+    RenderTile tiles[MaxRenderSnapshotTiles];
+
+    // The colors of the whole map, for the minimap and the world map. Every
+    // snapshot buffer keeps its own copy, and only catches up with the tile
+    // changes since it was last published.
+    bool hasTileColors;
+    uint32_t tileColorRevision;
+    TileColorPyramid tileColors;
+
+    // Null for the tiles that are not in the window.
+    const RenderTile *tileAt(const RenderTileWindow &window, int x, int y) const
+    {
+        auto column = x - window.minX;
+        auto row = y - window.minY;
+        if(column < 0 || column >= window.columns || row < 0 || row >= window.rows)
+            return nullptr;
+        return &tiles[window.firstTile + row*window.columns + column];
+    }
+};
+
+// Copies the render state of the last update into a new snapshot, with the
+// tiles of the viewports of the view of the settings, and hands it to the
+// renderer. The view also becomes the screen of the following updates.
+void publishRenderSnapshot(const RenderSettings &settings);
+
+// Takes the most recently published snapshot. Returns false when there is no
+// new one since the last call.
+bool consumeRenderSnapshot();
+
+// The snapshot taken by the last consume, or null when there is none yet.
+const RenderSnapshot *getRenderSnapshot();
+
+#endif //SMALL_ECO_DESTROYED_RENDER_SNAPSHOT_HPP
@@ -1,8 +1,14 @@
 #include "Renderer.hpp"
 #include "GameLogic.hpp"
+#include "RenderSnapshot.hpp"
+#include "PixelKernels.hpp"
+#include "WorkerThreads.hpp"
 #include <math.h>
 #include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include <stdio.h>
+#include <string.h>
 
 static const Rectangle TileOccupantSprites[] = {
     {0, 0, 32, 32},
@@ -63,6 +69,23 @@ static struct FontCharacterMapBuilder
     }
 } fontCharacterMapBuilder;
 
+// The snapshot that is being drawn.
+static const RenderSnapshot *snapshot;
+
+// The viewport that is being drawn, which belongs to the player with its index.
+static int viewportIndex;
+static const RenderViewport *viewport;
+
+inline const PlayerRenderState &viewportPlayer()
+{
+    return snapshot->players[viewportIndex];
+}
+
+inline const RenderTile *viewportTileAt(int x, int y)
+{
+    return snapshot->tileAt(snapshot->tileWindows[viewport->tileWindow], x, y);
+}
+
 inline int clampCoordinate(int min, int max, int x)
 {
     if(x < min)
@@ -75,22 +98,22 @@ inline int clampCoordinate(int min, int max, int x)
 
 inline Vector2 viewToScreen(const Framebuffer &framebuffer, const Vector2 &v)
 {
-    return units2Pixels(v) + Vector2(framebuffer.width/2, framebuffer.height/2);
+    return units2Pixels(v)*viewport->camera.zoom() + Vector2(framebuffer.width/2, framebuffer.height/2);
 }
 
 inline Vector2 screenToView(const Framebuffer &framebuffer, const Vector2 &v)
 {
-    return pixels2Units(v - Vector2(framebuffer.width/2, framebuffer.height/2));
+    return pixels2Units(v - Vector2(framebuffer.width/2, framebuffer.height/2)) * (1.0f / viewport->camera.zoom());
 }
 
 inline Vector2 worldToView(const Vector2 &v)
 {
-    return v - global.camera.position;
+    return v - viewport->camera.position;
 }
 
 inline Vector2 viewToWorld(const Vector2 &v)
 {
-    return v + global.camera.position;
+    return v + viewport->camera.position;
 }
 
 inline Vector2 screenToWorld(const Framebuffer &framebuffer, const Vector2 &v)
@@ -120,113 +143,404 @@ static void drawRectangle(const Framebuffer &framebuffer, uint32_t color, int x,
     auto maxX = x + width;
     auto maxY = y + height;
 
-    minX = clampCoordinate(0, framebuffer.width, minX);
-    maxX = clampCoordinate(0, framebuffer.width, maxX);
-    minY = clampCoordinate(0, framebuffer.height, minY);
-    maxY = clampCoordinate(0, framebuffer.height, maxY);
+    minX = clampCoordinate(framebuffer.clipMinX, framebuffer.clipMaxX, minX);
+    maxX = clampCoordinate(framebuffer.clipMinX, framebuffer.clipMaxX, maxX);
+    minY = clampCoordinate(framebuffer.clipMinY, framebuffer.clipMaxY, minY);
+    maxY = clampCoordinate(framebuffer.clipMinY, framebuffer.clipMaxY, maxY);
     //printf("rctangle size: %d %d\n", width, height);
 
+    // A color that is not opaque is premultiplied, and drawn over the pixels.
+    auto fill = (color & 0xFF000000) == 0xFF000000 ? pixelKernels.fill : pixelKernels.fillOver;
     auto rowStart = framebuffer.pixels + minY* framebuffer.pitch;
     for(int dy = minY; dy < maxY; ++dy, rowStart += framebuffer.pitch)
     {
         auto row = reinterpret_cast<uint32_t*> (rowStart);
-        for(int dx = minX; dx < maxX; ++dx)
-            row[dx] = color;
+        fill(row + minX, maxX - minX, color);
     }
 }
 
-template<typename TileSetImageType>
-static void blitTileRectangle(const Framebuffer &framebuffer, int destX, int destY, const TileSetImageType &tileSet, const Rectangle &rectangle, bool flipHorizontal=false, bool flipVertical=false)
+// Visits the visible spans of a cell row that fall into count destination pixels.
+// Destination pixel k reads the cell column firstColumn + k, or firstColumn - k
+// when the row is flipped.
+template<bool Flipped, typename SpanFunction>
+inline void cellRowSpansDo(const TileSpan *span, const TileSpan *spansEnd, int firstColumn, int count, const SpanFunction &f)
 {
-    auto minX = destX;
-    auto minY = destY;
-    auto maxX = destX + rectangle.width;
-    auto maxY = destY + rectangle.height;
+    for(; span != spansEnd; ++span)
+    {
+        int begin, end;
+        if(Flipped)
+        {
+            begin = firstColumn + 1 - span->end;
+            end = firstColumn + 1 - span->begin;
+        }
+        else
+        {
+            begin = span->begin - firstColumn;
+            end = span->end - firstColumn;
+        }
 
-    if(minX >= framebuffer.width || minY >= framebuffer.height)
-        return;
+        begin = std::max(begin, 0);
+        end = std::min(end, count);
+        if(begin < end)
+            f(begin, end - begin);
+    }
+}
 
-    minX = clampCoordinate(0, framebuffer.width, minX);
-    maxX = clampCoordinate(0, framebuffer.width, maxX);
-    minY = clampCoordinate(0, framebuffer.height, minY);
-    maxY = clampCoordinate(0, framebuffer.height, maxY);
+// How the source alpha is handled. CellOpacity picks a straight copy, a skip, a
+// span walk or a blend of the spans from the analysis of the source cell, and
+// otherwise alpha tests or blends as the alpha of the tile set says.
+enum class BlitAlphaMode : uint8_t
+{
+    Opaque = 0,
+    AlphaTested,
+    CellOpacity,
+};
 
-    auto offsetX = minX - destX;
-    auto offsetY = minY - destY;
-    if(offsetX >= rectangle.width || offsetY >= rectangle.height)
-        return;
+// Pixel copy policies write a run of source pixels into the destination. A
+// reversed run reads the source backwards, for the horizontal flips. A blended
+// run comes from a premultiplied tile set, and is drawn over the destination.
+struct DirectPixelCopy
+{
+    typedef uint32_t SourceType;
 
-    auto rowStart = framebuffer.pixels + minY* framebuffer.pitch;
-    auto sourceStart = tileSet.data + rectangle.y * TileSetImageType::Width + rectangle.x;
-    if(flipVertical)
-        sourceStart += (rectangle.height - 1) * TileSetImageType::Width;
-    else
-        sourceStart += offsetY * TileSetImageType::Width;
-    if(flipHorizontal)
-        sourceStart += rectangle.width - 1;
-    else
-        sourceStart += offsetX;
+    template<bool Reversed>
+    void opaque(uint32_t *dest, const uint32_t *source, int count) const
+    {
+        if(Reversed)
+            pixelKernels.copyReversed(dest, source, count);
+        else
+            memcpy(dest, source, count*4);
+    }
 
-    auto sourceRowDelta = flipHorizontal ? -1 : 1;
-    for(int dy = minY; dy < maxY; ++dy, rowStart += framebuffer.pitch, sourceStart += TileSetImageType::Width)
+    template<bool Reversed>
+    void alphaTested(uint32_t *dest, const uint32_t *source, int count) const
     {
-        auto row = reinterpret_cast<uint32_t*> (rowStart);
-        auto sourceRow = sourceStart;
-        for(int dx = minX; dx < maxX; ++dx, sourceRow += sourceRowDelta)
+        if(Reversed)
+            pixelKernels.copyAlphaTestedReversed(dest, source, count);
+        else
+            pixelKernels.copyAlphaTested(dest, source, count);
+    }
+
+    template<bool Reversed>
+    void blended(uint32_t *dest, const uint32_t *source, int count) const
+    {
+        if(Reversed)
+            pixelKernels.blendOverReversed(dest, source, count);
+        else
+            pixelKernels.blendOver(dest, source, count);
+    }
+};
+
+// The color replaces the color of the opaque source pixels.
+struct TintedPixelCopy
+{
+    typedef uint32_t SourceType;
+
+    TintedPixelCopy(uint32_t color)
+        : color(color) {}
+
+    template<bool Reversed>
+    void opaque(uint32_t *dest, const uint32_t *source, int count) const
+    {
+        alphaTested<Reversed>(dest, source, count);
+    }
+
+    template<bool Reversed>
+    void alphaTested(uint32_t *dest, const uint32_t *source, int count) const
+    {
+        if(Reversed)
+            pixelKernels.copyTintedReversed(dest, source, count, color);
+        else
+            pixelKernels.copyTinted(dest, source, count, color);
+    }
+
+    // The tint replaces the colors, so the translucent pixels are tested too.
+    template<bool Reversed>
+    void blended(uint32_t *dest, const uint32_t *source, int count) const
+    {
+        alphaTested<Reversed>(dest, source, count);
+    }
+
+    uint32_t color;
+};
+
+inline void expandIndexed(uint32_t *dest, const uint8_t *source, int count, const uint32_t *palette)
+{
+    pixelKernels.expandIndexed8(dest, source, count, palette);
+}
+
+inline void expandIndexed(uint32_t *dest, const uint16_t *source, int count, const uint32_t *palette)
+{
+    pixelKernels.expandIndexed16(dest, source, count, palette);
+}
+
+template<typename IndexType>
+struct IndexedPixelCopy
+{
+    typedef IndexType SourceType;
+
+    IndexedPixelCopy(const uint32_t *palette)
+        : palette(palette) {}
+
+    template<bool Reversed>
+    void opaque(uint32_t *dest, const IndexType *source, int count) const
+    {
+        if(Reversed)
+        {
+            for(int i = 0; i < count; ++i)
+                dest[i] = palette[source[-i]];
+        }
+        else
         {
-            auto color = *sourceRow;
-            if((color & 0xFF000000) != 0) // Alpha testing
-                row[dx] = color;
+            expandIndexed(dest, source, count, palette);
+        }
+    }
+
+    template<bool Reversed>
+    void alphaTested(uint32_t *dest, const IndexType *source, int count) const
+    {
+        auto sourceStep = Reversed ? -1 : 1;
+        for(int i = 0; i < count; ++i)
+        {
+            auto color = palette[source[i*sourceStep]];
+            if((color & 0xFF000000) != 0)
+                dest[i] = color;
+        }
+    }
+
+    // The colors are expanded a piece of the run at a time, and then blended.
+    template<bool Reversed>
+    void blended(uint32_t *dest, const IndexType *source, int count) const
+    {
+        static constexpr int PieceSize = 64;
+        uint32_t colors[PieceSize];
+        for(int first = 0; first < count; first += PieceSize)
+        {
+            auto pieceCount = std::min(PieceSize, count - first);
+            if(Reversed)
+            {
+                for(int i = 0; i < pieceCount; ++i)
+                    colors[i] = palette[source[-first - i]];
+            }
+            else
+            {
+                expandIndexed(colors, source + first, pieceCount, palette);
+            }
+            pixelKernels.blendOver(dest + first, colors, pieceCount);
         }
     }
-}
 
-template<typename TileSetImageType>
-static void blitTileRectangleWithColor(const Framebuffer &framebuffer, uint32_t color, int destX, int destY, const TileSetImageType &tileSet, const Rectangle &rectangle, bool flipHorizontal=false, bool flipVertical=false)
+    const uint32_t *palette;
+};
+
+// Walks the rows of a blit. Everything but the positions is a compile time
+// parameter: the flips, whether the destination has to be clipped, a fixed
+// size for whole tiles (zero uses the size of the rectangle), the alpha mode
+// and the pixel copy policy.
+template<bool FlipHorizontal, bool FlipVertical, bool Clipped, int FixedSize, BlitAlphaMode AlphaMode, typename TileSetImageType, typename PixelCopy>
+static void blitTileRectangleRows(const Framebuffer &framebuffer, int destX, int destY, const TileSetImageType &tileSet, const Rectangle &rectangle, const PixelCopy &pixels)
 {
+    auto width = FixedSize ? FixedSize : rectangle.width;
+    auto height = FixedSize ? FixedSize : rectangle.height;
     auto minX = destX;
     auto minY = destY;
-    auto maxX = destX + rectangle.width;
-    auto maxY = destY + rectangle.height;
+    auto maxX = destX + width;
+    auto maxY = destY + height;
 
-    if(minX >= framebuffer.width || minY >= framebuffer.height)
-        return;
+    if(Clipped)
+    {
+        if(minX >= framebuffer.clipMaxX || minY >= framebuffer.clipMaxY)
+            return;
 
-    minX = clampCoordinate(0, framebuffer.width, minX);
-    maxX = clampCoordinate(0, framebuffer.width, maxX);
-    minY = clampCoordinate(0, framebuffer.height, minY);
-    maxY = clampCoordinate(0, framebuffer.height, maxY);
+        minX = clampCoordinate(framebuffer.clipMinX, framebuffer.clipMaxX, minX);
+        maxX = clampCoordinate(framebuffer.clipMinX, framebuffer.clipMaxX, maxX);
+        minY = clampCoordinate(framebuffer.clipMinY, framebuffer.clipMaxY, minY);
+        maxY = clampCoordinate(framebuffer.clipMinY, framebuffer.clipMaxY, maxY);
+    }
 
     auto offsetX = minX - destX;
     auto offsetY = minY - destY;
-    if(offsetX >= rectangle.width || offsetY >= rectangle.height)
+    if(Clipped && (offsetX >= width || offsetY >= height))
         return;
 
-    auto rowStart = framebuffer.pixels + minY* framebuffer.pitch;
-    auto sourceStart = tileSet.data + rectangle.y * TileSetImageType::Width + rectangle.x;
-    if(flipVertical)
-        sourceStart += (rectangle.height - 1) * TileSetImageType::Width;
-    else
-        sourceStart += offsetY * TileSetImageType::Width;
+    // Swizzled rows are only contiguous inside a cell, so other rectangles are
+    // drawn one cell piece at a time.
+    if(TileSetImageType::Layout == TileSetLayout::SwizzledCells && !tileSet.isRectangleInsideOneCell(rectangle))
+    {
+        auto rectangleMaxX = rectangle.x + rectangle.width;
+        auto rectangleMaxY = rectangle.y + rectangle.height;
+        for(int pieceY = rectangle.y; pieceY < rectangleMaxY; )
+        {
+            auto pieceMaxY = std::min(rectangleMaxY, (pieceY / TileSetImageType::CellHeight + 1)*TileSetImageType::CellHeight);
+            auto pieceDestY = FlipVertical ? destY + rectangleMaxY - pieceMaxY : destY + pieceY - rectangle.y;
+            for(int pieceX = rectangle.x; pieceX < rectangleMaxX; )
+            {
+                auto pieceMaxX = std::min(rectangleMaxX, (pieceX / TileSetImageType::CellWidth + 1)*TileSetImageType::CellWidth);
+                auto pieceDestX = FlipHorizontal ? destX + rectangleMaxX - pieceMaxX : destX + pieceX - rectangle.x;
+                blitTileRectangleRows<FlipHorizontal, FlipVertical, Clipped, 0, AlphaMode>(framebuffer, pieceDestX, pieceDestY, tileSet,
+                    Rectangle(pieceX, pieceY, pieceMaxX - pieceX, pieceMaxY - pieceY), pixels);
+                pieceX = pieceMaxX;
+            }
+            pieceY = pieceMaxY;
+        }
+        return;
+    }
+
+    // The clip offsets are applied to the flipped source too, so a partial redraw
+    // of a sprite matches the full one.
+    auto rowStart = framebuffer.pixels + minY* framebuffer.pitch + minX*4;
+    auto sourceX = rectangle.x + (FlipHorizontal ? width - 1 - offsetX : offsetX);
+    auto sourceY = rectangle.y + (FlipVertical ? height - 1 - offsetY : offsetY);
+    auto sourceStart = tileSet.data + TileSetImageType::pixelIndex(sourceX, sourceY);
+    auto sourcePitch = FlipVertical ? -TileSetImageType::RowPitch : TileSetImageType::RowPitch;
+
+    auto count = maxX - minX;
+    auto cellIndex = -1;
+    auto opacity = AlphaMode == BlitAlphaMode::Opaque ? TileCellOpacity::Opaque : tileSet.partialOpacity();
+    if(AlphaMode == BlitAlphaMode::CellOpacity && !FlipVertical)
+    {
+        cellIndex = tileSet.cellIndexOfRectangle(rectangle);
+        if(cellIndex >= 0)
+            opacity = tileSet.cellOpacity[cellIndex];
+    }
+
+    switch(opacity)
+    {
+    case TileCellOpacity::Transparent:
+        break;
+    case TileCellOpacity::Opaque:
+        for(int dy = minY; dy < maxY; ++dy, rowStart += framebuffer.pitch, sourceStart += sourcePitch)
+            pixels.template opaque<FlipHorizontal> (reinterpret_cast<uint32_t*> (rowStart), sourceStart, count);
+        break;
+    case TileCellOpacity::Mixed:
+    case TileCellOpacity::Translucent:
+        {
+            auto firstColumn = FlipHorizontal ? width - 1 - offsetX : offsetX;
+            auto sourceRowDelta = FlipHorizontal ? -1 : 1;
+            auto cellRow = offsetY;
+            auto isTranslucent = opacity == TileCellOpacity::Translucent;
+            for(int dy = minY; dy < maxY; ++dy, ++cellRow, rowStart += framebuffer.pitch, sourceStart += sourcePitch)
+            {
+                auto row = reinterpret_cast<uint32_t*> (rowStart);
+                cellRowSpansDo<FlipHorizontal> (tileSet.rowSpansBegin(cellIndex, cellRow), tileSet.rowSpansEnd(cellIndex, cellRow), firstColumn, count, [&](int first, int spanCount) {
+                    if(isTranslucent)
+                        pixels.template blended<FlipHorizontal> (row + first, sourceStart + first*sourceRowDelta, spanCount);
+                    else
+                        pixels.template opaque<FlipHorizontal> (row + first, sourceStart + first*sourceRowDelta, spanCount);
+                });
+            }
+        }
+        break;
+    case TileCellOpacity::Blended:
+        for(int dy = minY; dy < maxY; ++dy, rowStart += framebuffer.pitch, sourceStart += sourcePitch)
+            pixels.template blended<FlipHorizontal> (reinterpret_cast<uint32_t*> (rowStart), sourceStart, count);
+        break;
+    case TileCellOpacity::AlphaTested:
+    default:
+        for(int dy = minY; dy < maxY; ++dy, rowStart += framebuffer.pitch, sourceStart += sourcePitch)
+            pixels.template alphaTested<FlipHorizontal> (reinterpret_cast<uint32_t*> (rowStart), sourceStart, count);
+        break;
+    }
+}
+
+// Selects the instantiation for the flips of a clipped blit.
+template<typename TileSetImageType, typename PixelCopy>
+static void blitClippedTileRectangle(const Framebuffer &framebuffer, int destX, int destY, const TileSetImageType &tileSet, const Rectangle &rectangle, bool flipHorizontal, bool flipVertical, const PixelCopy &pixels)
+{
+    static constexpr auto AlphaMode = BlitAlphaMode::CellOpacity;
     if(flipHorizontal)
-        sourceStart += rectangle.width - 1;
+    {
+        if(flipVertical)
+            blitTileRectangleRows<true, true, true, 0, AlphaMode>(framebuffer, destX, destY, tileSet, rectangle, pixels);
+        else
+            blitTileRectangleRows<true, false, true, 0, AlphaMode>(framebuffer, destX, destY, tileSet, rectangle, pixels);
+    }
     else
-        sourceStart += offsetX;
+    {
+        if(flipVertical)
+            blitTileRectangleRows<false, true, true, 0, AlphaMode>(framebuffer, destX, destY, tileSet, rectangle, pixels);
+        else
+            blitTileRectangleRows<false, false, true, 0, AlphaMode>(framebuffer, destX, destY, tileSet, rectangle, pixels);
+    }
+}
+
+template<int W, int H, int CW, int CH, TileSetLayout L>
+static void blitTileRectangle(const Framebuffer &framebuffer, int destX, int destY, const TileSetImage<W, H, CW, CH, L> &tileSet, const Rectangle &rectangle, bool flipHorizontal=false, bool flipVertical=false)
+{
+    blitClippedTileRectangle(framebuffer, destX, destY, tileSet, rectangle, flipHorizontal, flipVertical, DirectPixelCopy());
+}
+
+template<int W, int H, int CW, int CH, TileSetLayout L>
+static void blitTileRectangleWithColor(const Framebuffer &framebuffer, uint32_t color, int destX, int destY, const TileSetImage<W, H, CW, CH, L> &tileSet, const Rectangle &rectangle, bool flipHorizontal=false, bool flipVertical=false)
+{
+    blitClippedTileRectangle(framebuffer, destX, destY, tileSet, rectangle, flipHorizontal, flipVertical, TintedPixelCopy(color));
+}
+
+template<typename IT, int PC, int PN, int W, int H, int CW, int CH, TileSetLayout L>
+static void blitTileRectangle(const Framebuffer &framebuffer, int destX, int destY, const IndexedTileSetImage<IT, PC, PN, W, H, CW, CH, L> &tileSet, const Rectangle &rectangle, bool flipHorizontal=false, bool flipVertical=false, int paletteIndex=0)
+{
+    blitClippedTileRectangle(framebuffer, destX, destY, tileSet, rectangle, flipHorizontal, flipVertical, IndexedPixelCopy<IT>(tileSet.palette(paletteIndex)));
+}
+
+// Nearest neighbour scaling of the rectangle to the destination rectangle, for
+// the sprites of a zoomed camera. The source pixels of every destination row
+// are picked first and then written with the alpha test, or blended when the
+// tile set is premultiplied. Wider rows are done in pieces of the row buffer.
+static constexpr int MaxScaledBlitWidth = 256;
+
+template<typename TileSetImageType, typename PixelCopy>
+static void blitScaledTileRectangle(const Framebuffer &framebuffer, const Rectangle &destRectangle, const TileSetImageType &tileSet, const Rectangle &rectangle, bool flipHorizontal, bool flipVertical, const PixelCopy &pixels)
+{
+    auto clipRectangle = Rectangle(framebuffer.clipMinX, framebuffer.clipMinY, framebuffer.clipMaxX - framebuffer.clipMinX, framebuffer.clipMaxY - framebuffer.clipMinY);
+    auto clipped = destRectangle.intersectionWith(clipRectangle);
+    if(clipped.isEmpty())
+        return;
+
+    auto stepX = (rectangle.width << 16) / destRectangle.width;
+    auto stepY = (rectangle.height << 16) / destRectangle.height;
 
-    auto sourceRowDelta = flipHorizontal ? -1 : 1;
-    for(int dy = minY; dy < maxY; ++dy, rowStart += framebuffer.pitch, sourceStart += TileSetImageType::Width)
+    auto isBlended = tileSet.alpha == TileSetAlpha::Premultiplied;
+    typename PixelCopy::SourceType row[MaxScaledBlitWidth];
+    auto destRow = framebuffer.pixels + clipped.y*framebuffer.pitch + clipped.x*4;
+    for(int y = clipped.y; y < clipped.y + clipped.height; ++y, destRow += framebuffer.pitch)
     {
-        auto row = reinterpret_cast<uint32_t*> (rowStart);
-        auto sourceRow = sourceStart;
-        for(int dx = minX; dx < maxX; ++dx, sourceRow += sourceRowDelta)
+        auto sourceY = ((2*(y - destRectangle.y) + 1)*stepY) >> 17;
+        if(flipVertical)
+            sourceY = rectangle.height - 1 - sourceY;
+
+        for(int i0 = 0; i0 < clipped.width; i0 += MaxScaledBlitWidth)
         {
-            auto sourceColor = *sourceRow;
-            if((sourceColor & 0xFF000000) != 0) // Alpha testing
-                row[dx] = color & sourceColor;
+            auto count = std::min(clipped.width - i0, MaxScaledBlitWidth);
+            for(int i = 0; i < count; ++i)
+            {
+                auto sourceX = ((2*(clipped.x + i0 + i - destRectangle.x) + 1)*stepX) >> 17;
+                if(flipHorizontal)
+                    sourceX = rectangle.width - 1 - sourceX;
+                row[i] = tileSet.data[TileSetImageType::pixelIndex(rectangle.x + sourceX, rectangle.y + sourceY)];
+            }
+
+            auto dest = reinterpret_cast<uint32_t*> (destRow) + i0;
+            if(isBlended)
+                pixels.template blended<false> (dest, row, count);
+            else
+                pixels.template alphaTested<false> (dest, row, count);
         }
     }
 }
 
+// A whole unflipped tile that is known to be inside the clip rectangle, so it
+// skips the clipping and runs fixed size loops.
+static constexpr int InteriorTileSize = 32;
+
+template<BlitAlphaMode AlphaMode, typename TileSetImageType, typename PixelCopy>
+static void blitInteriorTile(const Framebuffer &framebuffer, int destX, int destY, const TileSetImageType &tileSet, const Rectangle &rectangle, const PixelCopy &pixels)
+{
+    assert(rectangle.width == InteriorTileSize && rectangle.height == InteriorTileSize);
+    assert(framebuffer.clipMinX <= destX && destX + InteriorTileSize <= framebuffer.clipMaxX);
+    assert(framebuffer.clipMinY <= destY && destY + InteriorTileSize <= framebuffer.clipMaxY);
+    blitTileRectangleRows<false, false, false, InteriorTileSize, AlphaMode>(framebuffer, destX, destY, tileSet, rectangle, pixels);
+}
+
 static void drawText(const Framebuffer &framebuffer, uint32_t color, int destX, int destY, const char *text)
 {
     auto startX = destX;
@@ -257,284 +571,2110 @@ static void drawText(const Framebuffer &framebuffer, uint32_t color, int destX,
     }
 }
 
-static void drawBox(const Framebuffer &framebuffer, uint32_t color, const Box2 &box)
+static Rectangle boxScreenRectangle(const Framebuffer &framebuffer, const Box2 &box)
 {
     auto min = viewToScreen(framebuffer, box.min).floor();
     auto max = viewToScreen(framebuffer, box.max).floor();
     auto extent = max - min;
 
-    drawRectangle(framebuffer, color, min.x, framebuffer.height - (min.y + extent.y) - 1, extent.x, extent.y);
+    return Rectangle(min.x, framebuffer.height - (min.y + extent.y) - 1, extent.x, extent.y);
 }
 
-static void renderBackground(const Framebuffer &framebuffer)
-{
-    auto minPosition = screenToWorld(framebuffer, 0, 0).floor();
-    auto maxPosition = screenToWorld(framebuffer, framebuffer.width, framebuffer.height).ceil();
+// A bin holds 64KB of framebuffer, which stays in the cache while all of its
+// layers are drawn. Square 64x64 bins measured slower: the background copy is
+// made of rows that are too short to stream well.
+static constexpr int DrawBinWidth = 256;
+static constexpr int DrawBinHeight = 64;
 
-    auto offset = worldToScreen(framebuffer, minPosition);
-    int offsetX = offset.x;
-    int offsetY = offset.y;
-    int pixelsPerTile = Units2Pixels;
-
-    int minX = minPosition.x;
-    int minY = minPosition.y;
-    int maxX = maxPosition.x;
-    int maxY = maxPosition.y;
-
-    auto destY = offsetY;
-    int decayStageOffset = int(global.decayStage)*2;
-
-    //printf("offsets %d %d\n", offsetX, offsetY);
-    for(int y = minY; y <= maxY; ++y, destY += pixelsPerTile)
-    {
-        auto tileRow = (floorModule(y, TileMap::Height)) * TileMap::Width;
-        auto destX = offsetX;
-        for(int x = minX; x <= maxX; ++x, destX += pixelsPerTile)
-        {
-            auto tx = floorModule(x, TileMap::Width);
-            auto tileIndex = tileRow + tx;
-            //printf("tile index: %d\n", tileIndex);
-            auto tileType = global.map.tiles[tileIndex];
-
-            //drawRectangle(framebuffer, color, destX, framebuffer.height - destY - pixelsPerTile, pixelsPerTile, pixelsPerTile);
-            int animationVariant = Random::hashBit(global.map.animationVariant ^ global.map.tileRandom[tileIndex]);
-            blitTileRectangle(framebuffer, destX, framebuffer.height -1 - (destY + pixelsPerTile) , global.mapTileSet,
-                global.mapTileSet.getTileRectangle(int(tileType), animationVariant + decayStageOffset, pixelsPerTile, pixelsPerTile));
-
-            // Draw the tile occupant
-            auto occupant = global.map.occupants[tileIndex];
-            auto occupantVariation = global.map.occupantStates[tileIndex].generic.renderState & 1;
-            if(occupant != TileOccupant::None)
-            {
-                //printf("Draw occupant\n");
-                auto spriteRectangle = TileOccupantSprites[int(occupant)];
-                spriteRectangle.x += spriteRectangle.width*occupantVariation;
-                blitTileRectangle(framebuffer, destX, framebuffer.height - 1 - (destY + spriteRectangle.height), global.spriteSet, spriteRectangle);
-            }
-        }
-    }
-}
+// Commands of a lower layer are drawn first. Inside a layer, they keep the
+// order in which they were added.
+enum class DrawLayer : uint8_t
+{
+    Background = 0,
+    Entities,
+    Particles,
+    Bullets,
+    PostProcess,
+    Hud,
+
+    Count
+};
 
-static void renderEntity(const Framebuffer &framebuffer, const Entity &entity)
+enum class DrawCommandType : uint8_t
 {
-    auto spritePosition = worldToScreen(framebuffer, entity.position + entity.boundingBox.bottomLeft());
-    auto destX = spritePosition.x;
-    auto destY = spritePosition.y;
+    Background = 0,
+    Blit,
+    ScaledBlit,
+    Fill,
+    PostProcess,
+    HudElement,
+    MapView,
+    BulletBatch,
+    ParticleBatch,
+};
 
-    switch(entity.spriteType)
-    {
-    case SpriteType::Tile:
-        blitTileRectangle(framebuffer, destX, framebuffer.height - (destY + 32) - 1, global.mapTileSet, global.mapTileSet.getTileRectangle(entity.spriteRow, entity.spriteColumn, 32, 32),
-        entity.flipHorizontal, entity.flipVertical);
-        break;
-    case SpriteType::Character:
-        blitTileRectangle(framebuffer, destX, framebuffer.height - (destY + 48) - 1, global.characterTileSet, global.characterTileSet.getTileRectangle(entity.spriteRow, entity.spriteColumn, 32, 48),
-        entity.flipHorizontal, entity.flipVertical);
-        break;
-    case SpriteType::None:
-    default:
-    //drawBox(framebuffer, encodeColor(255, 255, 255, 255), entity.boundingBox.translatedBy(translation));
-        drawBox(framebuffer, encodeColor(255, 255, 255, 255), entity.boundingBox.translatedBy(worldToView(entity.position)));
-        break;
-    }
-}
+enum class DrawTileSet : uint8_t
+{
+    Map = 0,
+    Character,
+    Sprites,
+};
 
-static void renderPlayer(const Framebuffer &framebuffer, const PlayerState &player)
+struct DrawCommand
 {
-    if(global.isGameCompleted)
-        return;
+    DrawCommandType type;
+    DrawLayer layer;
+    DrawTileSet tileSet;
+    uint8_t paletteIndex;
+    bool flipHorizontal;
+    bool flipVertical;
+
+    // The screen pixels that the command can change. A fill covers all of them.
+    Rectangle clipRectangle;
+
+    int destX;
+    int destY;
+    Rectangle sourceRectangle;
+    uint32_t color;
+
+    // The background view, the HUD element, the map view, or the bullet or
+    // particle batch.
+    const void *object;
+};
 
-    auto boatOffset = Vector2(0.0f, -0.2f);
-    auto spritePosition = worldToScreen(framebuffer, player.position + player.boundingBox.bottomLeft() + boatOffset);
-    auto destX = spritePosition.x;
-    auto destY = framebuffer.height - (spritePosition.y + /*Sprite size */ 32 ) - 1;
+static void executeDrawCommand(const Framebuffer &framebuffer, const DrawCommand &command);
 
-    if(player.inBoat)
-        blitTileRectangle(framebuffer, destX, destY, global.spriteSet, BoatBack);
-    //printf("feetExtent %f %f\n", feetExtent.x, feetExtent.y);
-    renderEntity(framebuffer, player);
-    if(player.inBoat)
-        blitTileRectangle(framebuffer, destX, destY, global.spriteSet, BoatFront);
+// Calls f with the index of every bin that the rectangle touches.
+template<typename FT>
+static void drawBinsDo(const Rectangle &rectangle, const Rectangle &bounds, int binColumns, const FT &f)
+{
+    auto clipped = rectangle.intersectionWith(bounds);
+    if(clipped.isEmpty())
+        return;
 
+    auto maxX = (clipped.x + clipped.width - 1) / DrawBinWidth;
+    auto maxY = (clipped.y + clipped.height - 1) / DrawBinHeight;
+    for(int y = clipped.y / DrawBinHeight; y <= maxY; ++y)
+    {
+        for(int x = clipped.x / DrawBinWidth; x <= maxX; ++x)
+            f(y*binColumns + x);
+    }
 }
 
-static void renderEntities(const Framebuffer &framebuffer)
+// The bin of a pixel, which is moved into the screen when it is outside.
+inline int drawBinAt(const Framebuffer &framebuffer, int binColumns, int x, int y)
 {
-    renderPlayer(framebuffer, global.player);
+    auto binX = std::min(std::max(x, 0), framebuffer.width - 1) / DrawBinWidth;
+    auto binY = std::min(std::max(y, 0), framebuffer.height - 1) / DrawBinHeight;
+    return binY*binColumns + binX;
 }
 
-static void renderMinimap(const Framebuffer &framebuffer)
+// The drawing of a frame is recorded into transient memory, and then executed
+// one bin of the screen at a time. Every bin draws all of its layers while its
+// pixels are in the cache, and the bins are spread between the worker threads.
+class DrawCommandList
 {
-    auto rectangle = global.minimap.wholeRectangle();
-    auto x = framebuffer.width - rectangle.width;
-    auto y = framebuffer.height - rectangle.height;
+public:
+    DrawCommandList(int capacity)
+        : commands(newTransientArray<DrawCommand>(capacity)), count(0), capacity(capacity) {}
 
-    blitTileRectangle(framebuffer, x, y, global.minimap, rectangle);
+    // The capacity is an estimate, and the list grows when it is short.
+    DrawCommand &addCommand(DrawCommandType type, DrawLayer layer, const Rectangle &clipRectangle)
+    {
+        if(count == capacity)
+            growTransientArray(commands, count, capacity);
+
+        auto &command = commands[count++];
+        command = DrawCommand();
+        command.type = type;
+        command.layer = layer;
+        command.clipRectangle = clipRectangle;
+        return command;
+    }
 
-    auto cursorX = x + floor(global.player.position.x * rectangle.width / float(WorldWidth));
-    auto cursorY = y + rectangle.height - floor(global.player.position.y * rectangle.height / float(WorldHeight));
-    auto cursorWidth = 4;
-    auto cursorHeight = 4;
-    drawRectangle(framebuffer, 0xFF0000FF, cursorX - cursorWidth/2, cursorY - cursorHeight/2, cursorWidth, cursorHeight);
-}
+    void addBlit(DrawLayer layer, DrawTileSet tileSet, int destX, int destY, const Rectangle &sourceRectangle, bool flipHorizontal = false, bool flipVertical = false)
+    {
+        auto &command = addCommand(DrawCommandType::Blit, layer, Rectangle(destX, destY, sourceRectangle.width, sourceRectangle.height));
+        command.tileSet = tileSet;
+        command.flipHorizontal = flipHorizontal;
+        command.flipVertical = flipVertical;
+        command.destX = destX;
+        command.destY = destY;
+        command.sourceRectangle = sourceRectangle;
+    }
 
-static void renderBullets(const Framebuffer &framebuffer)
-{
-    for(int i = 0; i < global.numberOfAliveBullets; ++i)
+    // A sprite that is scaled when the destination size is not its own.
+    void addSprite(DrawLayer layer, DrawTileSet tileSet, const Rectangle &destRectangle, const Rectangle &sourceRectangle, bool flipHorizontal = false, bool flipVertical = false)
     {
-        auto bulletIndex = global.aliveBullets[i];
-        auto &bullet = global.bullets[bulletIndex];
-        auto bulletColor = (int(bullet.timeToLive*10) & 1) != 0 ? bullet.color : bullet.flashColor;
+        if(destRectangle.width == sourceRectangle.width && destRectangle.height == sourceRectangle.height)
+        {
+            addBlit(layer, tileSet, destRectangle.x, destRectangle.y, sourceRectangle, flipHorizontal, flipVertical);
+            return;
+        }
 
-        auto box = bullet.boundingBox.translatedBy(worldToView(bullet.position));
-        drawBox(framebuffer, bulletColor, box);
+        auto &command = addCommand(DrawCommandType::ScaledBlit, layer, destRectangle);
+        command.tileSet = tileSet;
+        command.flipHorizontal = flipHorizontal;
+        command.flipVertical = flipVertical;
+        command.sourceRectangle = sourceRectangle;
     }
-}
 
-inline uint32_t colorForPercentageMeter(int percentage)
-{
-    if(percentage > 75)
-        return 0xFFFF0000;
-    else if(percentage > 50)
-        return 0xFF00FF00;
-    else if(percentage > 25)
-        return 0xFF00FFFF;
-    else
-        return 0xFF0000FF;
-}
+    void addFill(DrawLayer layer, uint32_t color, const Rectangle &rectangle)
+    {
+        auto &command = addCommand(DrawCommandType::Fill, layer, rectangle);
+        command.color = color;
+    }
 
-static void renderHealth(const Framebuffer &framebuffer)
-{
-    char buffer[64];
-    int health = global.player.roundedHealth();
+    void execute(const Framebuffer &framebuffer, const FramebufferDamage &damage) const
+    {
+        auto bounds = Rectangle(0, 0, framebuffer.width, framebuffer.height);
+        auto binColumns = (framebuffer.width + DrawBinWidth - 1) / DrawBinWidth;
+        auto binRows = (framebuffer.height + DrawBinHeight - 1) / DrawBinHeight;
+        auto binCount = binColumns*binRows;
+
+        // Only the bins that touch the damage are drawn.
+        auto activeBins = newTransientArray<uint8_t> (binCount);
+        memset(activeBins, 0, binCount);
+        for(int i = 0; i < damage.rectangleCount; ++i)
+            drawBinsDo(damage.rectangles[i], bounds, binColumns, [&](int bin) { activeBins[bin] = 1; });
+
+        // Stable counting sort of the commands by layer.
+        int layerStart[int(DrawLayer::Count) + 1] = {};
+        for(int i = 0; i < count; ++i)
+            ++layerStart[int(commands[i].layer) + 1];
+        for(int i = 0; i < int(DrawLayer::Count); ++i)
+            layerStart[i + 1] += layerStart[i];
+        auto order = newTransientArray<int> (count);
+        for(int i = 0; i < count; ++i)
+            order[layerStart[int(commands[i].layer)]++] = i;
+
+        // The command list of every bin, with the same counting sort.
+        auto binStart = newTransientArray<int> (binCount + 1);
+        memset(binStart, 0, (binCount + 1)*sizeof(int));
+        for(int i = 0; i < count; ++i)
+        {
+            drawBinsDo(commands[order[i]].clipRectangle, bounds, binColumns, [&](int bin) {
+                if(activeBins[bin])
+                    ++binStart[bin + 1];
+            });
+        }
+
+        auto binEnd = newTransientArray<int> (binCount);
+        for(int i = 0; i < binCount; ++i)
+        {
+            binStart[i + 1] += binStart[i];
+            binEnd[i] = binStart[i];
+        }
 
-    blitTileRectangle(framebuffer, 0, 0, global.spriteSet, TileOccupantSprites[int(TileOccupant::Medkit)]);
+        auto binCommands = newTransientArray<int> (binStart[binCount]);
+        for(int i = 0; i < count; ++i)
+        {
+            drawBinsDo(commands[order[i]].clipRectangle, bounds, binColumns, [&](int bin) {
+                if(activeBins[bin])
+                    binCommands[binEnd[bin]++] = order[i];
+            });
+        }
 
-    sprintf(buffer, "%03d", health);
-    drawText(framebuffer, colorForPercentageMeter(health), FontTileSize, 0, buffer);
-}
+        auto activeBinList = newTransientArray<int> (binCount);
+        int activeBinCount = 0;
+        for(int i = 0; i < binCount; ++i)
+        {
+            if(activeBins[i])
+                activeBinList[activeBinCount++] = i;
+        }
 
-static void renderBelly(const Framebuffer &framebuffer)
-{
-    char buffer[64];
-    int belly = global.player.roundedBelly();
+        parallelFor(activeBinCount, [&](int i) {
+            auto bin = activeBinList[i];
+            auto binRectangle = Rectangle((bin % binColumns)*DrawBinWidth, (bin / binColumns)*DrawBinHeight, DrawBinWidth, DrawBinHeight);
+            for(int j = 0; j < damage.rectangleCount; ++j)
+            {
+                auto region = binRectangle.intersectionWith(damage.rectangles[j]);
+                if(region.isEmpty())
+                    continue;
+
+                auto regionFramebuffer = framebuffer.clippedTo(region);
+                for(int k = binStart[bin]; k < binStart[bin + 1]; ++k)
+                {
+                    const auto &command = commands[binCommands[k]];
+                    if(!command.clipRectangle.intersectionWith(region).isEmpty())
+                        executeDrawCommand(regionFramebuffer, command);
+                }
+            }
+        });
+    }
 
-    blitTileRectangle(framebuffer, 0, FontTileSize, global.spriteSet, TileOccupantSprites[int(TileOccupant::Meat)]);
+private:
+    DrawCommand *commands;
+    int count;
+    int capacity;
+};
 
-    sprintf(buffer, "%03d", belly);
-    drawText(framebuffer, colorForPercentageMeter(belly), FontTileSize, FontTileSize, buffer);
-}
+static constexpr int BackgroundTileSize = 32;
+static constexpr int TileCellPixelCount = BackgroundTileSize*BackgroundTileSize;
+static constexpr uint64_t InvalidBackgroundTileKey = ~uint64_t(0);
 
-static void renderAmmo(const Framebuffer &framebuffer)
+// The pixels of a tile that the terrain of a neighbour covers, for every set of
+// edges. The border is ragged, and its depth repeats with the tile size, so the
+// borders of a row of tiles meet without seams.
+static struct TileEdgeMasks
 {
-    char buffer[64];
+    TileEdgeMasks()
+    {
+        int depths[BackgroundTileSize];
+        for(int u = 0; u < BackgroundTileSize; ++u)
+        {
+            auto angle = 6.28318530718f*u/BackgroundTileSize;
+            depths[u] = int(7.5f + 2.0f*sinf(angle) + 1.5f*sinf(3.0f*angle + 1.0f));
+        }
 
-    auto bulletSprite = global.player.withDemolitionBullets ? TileOccupant::TripleDemolitionBullet : TileOccupant::TripleBullet;
-    blitTileRectangle(framebuffer, 0, FontTileSize*2, global.spriteSet, TileOccupantSprites[int(bulletSprite)]);
+        for(int edges = 0; edges <= TileEdge::All; ++edges)
+        {
+            auto mask = masks[edges];
+            for(int y = 0; y < BackgroundTileSize; ++y)
+            {
+                for(int x = 0; x < BackgroundTileSize; ++x)
+                {
+                    auto last = BackgroundTileSize - 1;
+                    mask[y*BackgroundTileSize + x] =
+                        ((edges & TileEdge::North) && y < depths[x]) ||
+                        ((edges & TileEdge::South) && last - y < depths[x]) ||
+                        ((edges & TileEdge::West) && x < depths[y]) ||
+                        ((edges & TileEdge::East) && last - x < depths[y]);
+                }
+            }
+        }
+    }
 
-    sprintf(buffer, "%03d", global.player.withDemolitionBullets ? global.player.demolitionBullets : global.player.bullets);
-    drawText(framebuffer, 0xFF00FFFF, FontTileSize, FontTileSize*2, buffer);
-}
+    uint8_t masks[TileEdge::All + 1][BackgroundTileSize*BackgroundTileSize];
+} tileEdgeMasks;
 
-static void renderGameTime(const Framebuffer &framebuffer)
+// Draws the terrain of a tile, with the terrain of its transition over the
+// covered edges. The occupants are drawn with the sprites.
+static void compositeTile(const Framebuffer &framebuffer, int destX, int destY, const RenderTile &tile, int paletteIndex)
 {
-    char buffer[64];
+    // The tiles are always drawn inside their target, and the terrain covers them.
+    IndexedPixelCopy<MapTileSet::IndexType> pixels(global.mapTileSet.palette(paletteIndex));
+    blitInteriorTile<BlitAlphaMode::Opaque>(framebuffer, destX, destY, global.mapTileSet,
+        global.mapTileSet.getTileRectangle(int(tile.type), tile.animationVariant, BackgroundTileSize, BackgroundTileSize), pixels);
 
-    sprintf(buffer, "%d", int(global.matchTime));
-    drawText(framebuffer, 0xFFFFFFFF, (framebuffer.width - FontTileSize*strlen(buffer))/2, 0, buffer);
-}
-static void renderPostProcess(const Framebuffer &framebuffer)
-{
-    if(!global.isPaused && !global.isGameCompleted)
+    auto edges = tileTransitionEdges(tile.transition);
+    if(edges == TileEdge::None)
         return;
 
-    uint32_t colorMask = 0xFF808080;
+    uint32_t overlay[TileCellPixelCount];
+    auto overlayFramebuffer = Framebuffer(BackgroundTileSize, BackgroundTileSize, BackgroundTileSize*4, reinterpret_cast<uint8_t*> (overlay));
+    blitInteriorTile<BlitAlphaMode::Opaque>(overlayFramebuffer, 0, 0, global.mapTileSet,
+        global.mapTileSet.getTileRectangle(int(tileTransitionOverlay(tile.transition)), tile.animationVariant, BackgroundTileSize, BackgroundTileSize), pixels);
 
-    auto destRow = framebuffer.pixels;
-    for(int y = 0; y < framebuffer.height; ++y, destRow += framebuffer.pitch)
+    auto mask = tileEdgeMasks.masks[edges];
+    auto destRow = framebuffer.pixels + destY*framebuffer.pitch + destX*4;
+    for(int y = 0; y < BackgroundTileSize; ++y, destRow += framebuffer.pitch)
     {
         auto dest = reinterpret_cast<uint32_t*> (destRow);
-        for(int x = 0; x < framebuffer.width; ++x, ++dest)
+        for(int x = 0; x < BackgroundTileSize; ++x)
         {
-            if((x ^ y) & 1)
-                *dest &= colorMask;
+            if(mask[y*BackgroundTileSize + x])
+                dest[x] = overlay[y*BackgroundTileSize + x];
         }
     }
 }
-static void renderMessage(const Framebuffer &framebuffer)
-{
-    const char *message = nullptr;
-    uint32_t color = -1;
 
-    if(global.isGameCompleted)
-    {
-        message = "Congratulations!\0You have escaped\0the Earth\0 \0Welcome to Hell!!!\0 \0Press R to reset\0";
-        color = 0xff00FFFF;
-    }
-    else if(!global.player.isAlive())
+// Composited tiles, keyed by everything that changes their terrain but not by
+// their position, so drawing a tile again is a single opaque copy. The cells are
+// composited on demand, and the least recently used one is recycled when the
+// cache is full. All the viewports share the cache, and a cell that one of them
+// used in a frame is kept for the others.
+static constexpr int TileCellCacheCapacity = 512;
+
+class TileCellCache
+{
+public:
+    TileCellCache()
+        : frame(0), hits(0), misses(0)
     {
-        message = "Game Over\0Press R to reset\0";
-        color = 0xff000080;
+        pixels.assign(TileCellCacheCapacity*TileCellPixelCount, 0);
+
+        // The list is circular through the sentinel at TileCellCacheCapacity,
+        // with the least recently used cell after it.
+        for(int i = 0; i <= TileCellCacheCapacity; ++i)
+        {
+            auto &cell = cells[i];
+            cell.key = InvalidBackgroundTileKey;
+            cell.lastUsedFrame = 0;
+            cell.previous = i > 0 ? i - 1 : TileCellCacheCapacity;
+            cell.next = i < TileCellCacheCapacity ? i + 1 : 0;
+        }
     }
-    else if(global.isPaused)
+
+    void beginFrame()
     {
-        message = "Paused\0";
-        color = 0xffff0000;
+        ++frame;
+        newCells.clear();
     }
 
-    if(!message)
+    // Returns the cell that holds the tile, or -1 when every cell is used by
+    // the current frame. New cells are drawn by the next compositeNewCells.
+    int acquire(const RenderTile &tile, int paletteIndex)
+    {
+        auto key = cellKey(tile, paletteIndex);
+        auto found = cellIndices.find(key);
+        if(found != cellIndices.end())
+        {
+            ++hits;
+            use(found->second);
+            return found->second;
+        }
+
+        ++misses;
+        auto index = cells[TileCellCacheCapacity].next;
+        auto &cell = cells[index];
+        if(cell.lastUsedFrame == frame)
+            return -1;
+
+        if(cell.key != InvalidBackgroundTileKey)
+            cellIndices.erase(cell.key);
+        cell.key = key;
+        cell.tile = tile;
+        cell.paletteIndex = paletteIndex;
+        cellIndices[key] = index;
+        use(index);
+        newCells.push_back(index);
+        return index;
+    }
+
+    void compositeNewCells()
+    {
+        parallelFor(int(newCells.size()), [&](int i) {
+            const auto &cell = cells[newCells[i]];
+            compositeTile(cellFramebuffer(newCells[i]), 0, 0, cell.tile, cell.paletteIndex);
+        });
+        newCells.clear();
+    }
+
+    const uint32_t *cellPixels(int index) const
+    {
+        return &pixels[index*TileCellPixelCount];
+    }
+
+    void copyCellTo(const Framebuffer &framebuffer, int destX, int destY, int index) const
+    {
+        auto source = cellPixels(index);
+        auto destRow = framebuffer.pixels + destY*framebuffer.pitch + destX*4;
+        for(int y = 0; y < BackgroundTileSize; ++y, destRow += framebuffer.pitch, source += BackgroundTileSize)
+            memcpy(destRow, source, BackgroundTileSize*4);
+    }
+
+    TileCellCacheCounters getCounters() const
+    {
+        return TileCellCacheCounters{hits, misses};
+    }
+
+private:
+    struct Cell
+    {
+        uint64_t key;
+        RenderTile tile;
+        int paletteIndex;
+        uint32_t lastUsedFrame;
+        int previous;
+        int next;
+    };
+
+    static uint64_t cellKey(const RenderTile &tile, int paletteIndex)
+    {
+        return uint64_t(tile.type) | (uint64_t(tile.animationVariant) << 8) | (uint64_t(paletteIndex) << 16) |
+            (uint64_t(tile.transition) << 24);
+    }
+
+    // Moves the cell to the most recently used end of the list.
+    void use(int index)
+    {
+        auto &cell = cells[index];
+        cells[cell.previous].next = cell.next;
+        cells[cell.next].previous = cell.previous;
+
+        auto &sentinel = cells[TileCellCacheCapacity];
+        cell.previous = sentinel.previous;
+        cell.next = TileCellCacheCapacity;
+        cells[sentinel.previous].next = index;
+        sentinel.previous = index;
+        cell.lastUsedFrame = frame;
+    }
+
+    Framebuffer cellFramebuffer(int index)
+    {
+        return Framebuffer(BackgroundTileSize, BackgroundTileSize, BackgroundTileSize*4, reinterpret_cast<uint8_t*> (&pixels[index*TileCellPixelCount]));
+    }
+
+    uint32_t frame;
+    uint64_t hits;
+    uint64_t misses;
+    Cell cells[TileCellCacheCapacity + 1];
+    std::unordered_map<uint64_t, int> cellIndices;
+    std::vector<int> newCells;
+    std::vector<uint32_t> pixels;
+};
+
+static TileCellCache tileCellCache;
+
+TileCellCacheCounters getTileCellCacheCounters()
+{
+    return tileCellCache.getCounters();
+}
+
+struct BackgroundView
+{
+    // Size of a tile on the screen, which is BackgroundTileSize scaled by the
+    // camera zoom.
+    int tileSize;
+
+    // Visible tiles, in unwrapped world coordinates.
+    int minX, minY, maxX, maxY;
+
+    // Position of the tile (minX, minY) with the y axis going up.
+    int offsetX, offsetY;
+
+    // Added to a framebuffer pixel to get the scaled world pixel that addresses
+    // the background cache. World pixel rows go down, so the top row of the tile
+    // y is at -(y + 1)*tileSize.
+    int originX, originY;
+};
+
+static BackgroundView computeBackgroundView(const Framebuffer &framebuffer)
+{
+    auto minPosition = screenToWorld(framebuffer, 0, 0).floor();
+    auto maxPosition = screenToWorld(framebuffer, framebuffer.width, framebuffer.height).ceil();
+    auto offset = worldToScreen(framebuffer, minPosition);
+
+    // The tile row below minY is included because the y flip leaves the last
+    // framebuffer row uncovered when offset.y is truncated to zero.
+    BackgroundView view;
+    view.tileSize = int(BackgroundTileSize*viewport->camera.zoom());
+    view.minX = minPosition.x;
+    view.minY = int(minPosition.y) - 1;
+    view.maxX = maxPosition.x;
+    view.maxY = maxPosition.y;
+    view.offsetX = offset.x;
+    view.offsetY = int(offset.y) - view.tileSize;
+    view.originX = view.minX*view.tileSize - view.offsetX;
+    view.originY = 1 + view.offsetY - framebuffer.height - view.minY*view.tileSize;
+    return view;
+}
+
+// Offscreen copy of the background tiles, kept as a ring buffer of tile slots a
+// little larger than the screen. Every slot remembers what it holds, so a frame
+// only renders the tiles that scrolled into view or whose look changed. The
+// slots have the size of the tiles on the screen, so a zoomed camera scales a
+// tile once when it is rendered, and not on every frame.
+class BackgroundCache
+{
+public:
+    struct DirtySlot
+    {
+        int slot;
+        RenderTile tile;
+        int cell;
+        int screenX;
+        int screenY;
+    };
+
+    BackgroundCache()
+        : tileSize(0), columns(0), rows(0) {}
+
+    void ensureSize(int framebufferWidth, int framebufferHeight, int newTileSize)
+    {
+        auto newColumns = framebufferWidth / newTileSize + 4;
+        auto newRows = framebufferHeight / newTileSize + 4;
+        if(newTileSize == tileSize && newColumns == columns && newRows == rows)
+            return;
+
+        tileSize = newTileSize;
+        columns = newColumns;
+        rows = newRows;
+        pixels.assign(pixelWidth()*pixelHeight(), 0);
+        slotKeys.assign(columns*rows, InvalidBackgroundTileKey);
+
+        // Nearest neighbour sampling of the cell at the centers of the scaled
+        // pixels, in 16.16 fixed point.
+        auto step = (BackgroundTileSize << 16) / tileSize;
+        scaledCellColumns.resize(tileSize);
+        for(int i = 0; i < tileSize; ++i)
+            scaledCellColumns[i] = ((2*i + 1)*step) >> 17;
+    }
+
+    int pixelWidth() const
+    {
+        return columns*tileSize;
+    }
+
+    int pixelHeight() const
+    {
+        return rows*tileSize;
+    }
+
+    int slotIndexAt(int x, int y) const
+    {
+        return floorModule(-y - 1, rows)*columns + floorModule(x, columns);
+    }
+
+    // Everything that changes the look of a tile, plus its unwrapped position.
+    // The occupant is not in the slot, but a change of it damages the tile. The
+    // fields are packed to their sizes: the types have less than 16 and 32
+    // values, the variant with the decay stage offset less than 16, and the
+    // occupant variation is a single bit.
+    static uint64_t tileKey(int x, int y, const RenderTile &tile, int decayStageOffset)
+    {
+        return uint64_t(uint16_t(x)) | (uint64_t(uint16_t(y)) << 16) |
+            (uint64_t(tile.type) << 32) | (uint64_t(tile.animationVariant + decayStageOffset) << 36) |
+            (uint64_t(tile.occupant) << 40) | (uint64_t(tile.occupantVariation) << 45) |
+            (uint64_t(tile.light) << 46) | (uint64_t(tile.transition) << 50);
+    }
+
+    void update(const Framebuffer &framebuffer, const BackgroundView &view)
+    {
+        auto paletteIndex = int(snapshot->decayStage);
+        auto decayStageOffset = paletteIndex*MapTileDecayStageColumns;
+
+        dirtySlots.clear();
+        auto destY = view.offsetY;
+        for(int y = view.minY; y <= view.maxY; ++y, destY += tileSize)
+        {
+            auto screenTop = framebuffer.height - 1 - (destY + tileSize);
+            if(screenTop >= framebuffer.clipMaxY || screenTop + tileSize <= framebuffer.clipMinY)
+                continue;
+
+            auto destX = view.offsetX;
+            for(int x = view.minX; x <= view.maxX; ++x, destX += tileSize)
+            {
+                if(destX >= framebuffer.clipMaxX || destX + tileSize <= framebuffer.clipMinX)
+                    continue;
+
+                // Tiles missing from the snapshot wait for one that has them.
+                auto tile = viewportTileAt(x, y);
+                if(!tile)
+                    continue;
+
+                auto key = tileKey(x, y, *tile, decayStageOffset);
+                auto slot = slotIndexAt(x, y);
+                if(slotKeys[slot] != key)
+                {
+                    slotKeys[slot] = key;
+                    auto cell = tileCellCache.acquire(*tile, paletteIndex);
+                    dirtySlots.push_back(DirtySlot{slot, *tile, cell, destX, screenTop});
+                }
+            }
+        }
+
+        tileCellCache.compositeNewCells();
+
+        auto cacheFramebuffer = Framebuffer(pixelWidth(), pixelHeight(), pixelWidth()*4, reinterpret_cast<uint8_t*> (pixels.data()));
+        parallelFor(int(dirtySlots.size()), [&](int i) {
+            renderSlot(cacheFramebuffer, dirtySlots[i], paletteIndex);
+        });
+    }
+
+    // The screen tiles that were rendered again by the last update.
+    void addDirtyTilesTo(FramebufferDamage &damage) const
+    {
+        for(const auto &dirtySlot : dirtySlots)
+            damage.addRectangle(Rectangle(dirtySlot.screenX, dirtySlot.screenY, tileSize, tileSize));
+    }
+
+    void copyTo(const Framebuffer &framebuffer, const BackgroundView &view) const
+    {
+        auto cacheWidth = pixelWidth();
+        auto cacheHeight = pixelHeight();
+        auto width = framebuffer.clipMaxX - framebuffer.clipMinX;
+        auto cacheColumn = floorModule(framebuffer.clipMinX + view.originX, cacheWidth);
+        auto firstPieceWidth = std::min(width, cacheWidth - cacheColumn);
+
+        auto cacheRow = floorModule(framebuffer.clipMinY + view.originY, cacheHeight);
+        auto destRow = framebuffer.pixels + framebuffer.clipMinY*framebuffer.pitch + framebuffer.clipMinX*4;
+        for(int y = framebuffer.clipMinY; y < framebuffer.clipMaxY; ++y, destRow += framebuffer.pitch)
+        {
+            auto dest = reinterpret_cast<uint32_t*> (destRow);
+            auto source = &pixels[cacheRow*cacheWidth];
+            memcpy(dest, source + cacheColumn, firstPieceWidth*4);
+            if(firstPieceWidth < width)
+                memcpy(dest + firstPieceWidth, source, (width - firstPieceWidth)*4);
+            if(++cacheRow == cacheHeight)
+                cacheRow = 0;
+        }
+    }
+
+private:
+    void renderSlot(const Framebuffer &cacheFramebuffer, const DirtySlot &dirtySlot, int paletteIndex) const
+    {
+        auto destX = (dirtySlot.slot % columns)*tileSize;
+        auto destY = (dirtySlot.slot / columns)*tileSize;
+        if(tileSize == BackgroundTileSize)
+        {
+            if(dirtySlot.cell >= 0)
+                tileCellCache.copyCellTo(cacheFramebuffer, destX, destY, dirtySlot.cell);
+            else
+                compositeTile(cacheFramebuffer, destX, destY, dirtySlot.tile, paletteIndex);
+            lightSlot(cacheFramebuffer, destX, destY, dirtySlot.tile.light);
+            return;
+        }
+
+        // Zoomed tiles are sampled from the unscaled cell.
+        uint32_t compositedTile[TileCellPixelCount];
+        const uint32_t *cellPixels = compositedTile;
+        if(dirtySlot.cell >= 0)
+        {
+            cellPixels = tileCellCache.cellPixels(dirtySlot.cell);
+        }
+        else
+        {
+            auto tileFramebuffer = Framebuffer(BackgroundTileSize, BackgroundTileSize, BackgroundTileSize*4, reinterpret_cast<uint8_t*> (compositedTile));
+            compositeTile(tileFramebuffer, 0, 0, dirtySlot.tile, paletteIndex);
+        }
+
+        auto destRow = cacheFramebuffer.pixels + destY*cacheFramebuffer.pitch + destX*4;
+        for(int y = 0; y < tileSize; ++y, destRow += cacheFramebuffer.pitch)
+        {
+            pixelKernels.gather(reinterpret_cast<uint32_t*> (destRow), cellPixels + scaledCellColumns[y]*BackgroundTileSize,
+                scaledCellColumns.data(), tileSize);
+        }
+        lightSlot(cacheFramebuffer, destX, destY, dirtySlot.tile.light);
+    }
+
+    // The cells are unlit, and the light of the tile scales its slot a row at
+    // a time.
+    void lightSlot(const Framebuffer &cacheFramebuffer, int destX, int destY, int light) const
+    {
+        if(light >= MaxLightLevel)
+            return;
+
+        auto factor = lightLevelColorFactor(light);
+        auto destRow = cacheFramebuffer.pixels + destY*cacheFramebuffer.pitch + destX*4;
+        for(int y = 0; y < tileSize; ++y, destRow += cacheFramebuffer.pitch)
+            pixelKernels.scaleColors(reinterpret_cast<uint32_t*> (destRow), tileSize, factor);
+    }
+
+    int tileSize;
+    int columns;
+    int rows;
+    std::vector<uint32_t> pixels;
+    std::vector<uint64_t> slotKeys;
+    std::vector<int32_t> scaledCellColumns;
+    std::vector<DirtySlot> dirtySlots;
+};
+
+static BackgroundCache backgroundCaches[MaxPlayers];
+
+// The cache of the viewport that is being drawn.
+static BackgroundCache *backgroundCache;
+
+static void updateBackground(const Framebuffer &framebuffer, const BackgroundView &view)
+{
+    backgroundCache->ensureSize(framebuffer.width, framebuffer.height, view.tileSize);
+    backgroundCache->update(framebuffer, view);
+}
+
+static void renderBackground(DrawCommandList &commands, const Framebuffer &framebuffer, const BackgroundView &view)
+{
+    auto &command = commands.addCommand(DrawCommandType::Background, DrawLayer::Background, Rectangle(0, 0, framebuffer.width, framebuffer.height));
+    command.object = &view;
+}
+
+// The framebuffer rectangle of a sprite whose bottom left corner is at the
+// screen position, scaled by the camera zoom.
+static Rectangle spriteScreenRectangle(const Framebuffer &framebuffer, const Vector2 &position, int width, int height)
+{
+    auto zoom = viewport->camera.zoom();
+    auto scaledWidth = int(width*zoom);
+    auto scaledHeight = int(height*zoom);
+    return Rectangle(int(position.x), int(framebuffer.height - (position.y + scaledHeight) - 1), scaledWidth, scaledHeight);
+}
+
+// The sprites that stand on the ground: the occupants, the player and its
+// boat. They are collected in any order with the framebuffer row of their feet,
+// and drawn after the terrain from the top of the screen down, so whatever
+// stands in front covers what is behind. Sprites with the same feet row keep
+// the order in which they were added.
+class SpriteLayer
+{
+public:
+    void begin(int newCapacity)
+    {
+        sprites = newTransientArray<Sprite> (newCapacity);
+        count = 0;
+        capacity = newCapacity;
+    }
+
+    // The capacity is an estimate, and the layer grows when it is short.
+    void add(int footY, DrawTileSet tileSet, const Rectangle &destRectangle, const Rectangle &sourceRectangle, bool flipHorizontal = false, bool flipVertical = false)
+    {
+        if(count == capacity)
+            growTransientArray(sprites, count, capacity);
+
+        auto &sprite = sprites[count++];
+        sprite.key = uint16_t(std::min(std::max(footY + FootYBias, 0), 0xFFFF));
+        sprite.tileSet = tileSet;
+        sprite.flipHorizontal = flipHorizontal;
+        sprite.flipVertical = flipVertical;
+        sprite.destRectangle = destRectangle;
+        sprite.sourceRectangle = sourceRectangle;
+    }
+
+    // Least significant digit radix sort of the keys, one byte per pass. Both
+    // passes are stable, so equal keys keep their order.
+    void record(DrawCommandList &commands) const
+    {
+        auto order = newTransientArray<int> (count);
+        auto sortedOrder = newTransientArray<int> (count);
+        for(int i = 0; i < count; ++i)
+            order[i] = i;
+
+        for(int shift = 0; shift < 16; shift += 8)
+        {
+            int digitStart[257] = {};
+            for(int i = 0; i < count; ++i)
+                ++digitStart[((sprites[i].key >> shift) & 0xFF) + 1];
+            for(int i = 0; i < 256; ++i)
+                digitStart[i + 1] += digitStart[i];
+            for(int i = 0; i < count; ++i)
+                sortedOrder[digitStart[(sprites[order[i]].key >> shift) & 0xFF]++] = order[i];
+            std::swap(order, sortedOrder);
+        }
+
+        for(int i = 0; i < count; ++i)
+        {
+            const auto &sprite = sprites[order[i]];
+            commands.addSprite(DrawLayer::Entities, sprite.tileSet, sprite.destRectangle, sprite.sourceRectangle,
+                sprite.flipHorizontal, sprite.flipVertical);
+        }
+    }
+
+private:
+    // Keeps the feet of the sprites that stick out of the top of the screen.
+    static constexpr int FootYBias = 1024;
+
+    struct Sprite
+    {
+        uint16_t key;
+        DrawTileSet tileSet;
+        bool flipHorizontal;
+        bool flipVertical;
+        Rectangle destRectangle;
+        Rectangle sourceRectangle;
+    };
+
+    Sprite *sprites;
+    int count;
+    int capacity;
+};
+
+static SpriteLayer spriteLayer;
+
+// Every player with the boat back and front, and room for more entities.
+static constexpr int MaxEntitySprites = 3*MaxPlayers + 5;
+
+static int maxSpriteCount(const BackgroundView &view)
+{
+    return (view.maxX - view.minX + 1)*(view.maxY - view.minY + 1) + MaxEntitySprites;
+}
+
+static void addOccupantSprites(const Framebuffer &framebuffer, const BackgroundView &view)
+{
+    auto tileSize = view.tileSize;
+    auto destY = view.offsetY;
+    for(int y = view.minY; y <= view.maxY; ++y, destY += tileSize)
+    {
+        auto screenBottom = framebuffer.height - 1 - destY;
+        auto destX = view.offsetX;
+        for(int x = view.minX; x <= view.maxX; ++x, destX += tileSize)
+        {
+            auto tile = viewportTileAt(x, y);
+            if(!tile || tile->occupant == TileOccupant::None)
+                continue;
+
+            // The occupants stand on the bottom of their tile.
+            auto spriteRectangle = TileOccupantSprites[int(tile->occupant)];
+            spriteRectangle.x += spriteRectangle.width*tile->occupantVariation;
+            auto spriteHeight = spriteRectangle.height*tileSize / BackgroundTileSize;
+            spriteLayer.add(screenBottom, DrawTileSet::Sprites,
+                Rectangle(destX, screenBottom - spriteHeight, spriteRectangle.width*tileSize / BackgroundTileSize, spriteHeight), spriteRectangle);
+        }
+    }
+}
+
+static void addEntitySprite(DrawCommandList &commands, const Framebuffer &framebuffer, const EntityRenderState &entity, int footY)
+{
+    auto spritePosition = worldToScreen(framebuffer, entity.position + entity.boundingBox.bottomLeft());
+
+    switch(entity.spriteType)
+    {
+    case SpriteType::Tile:
+        spriteLayer.add(footY, DrawTileSet::Map, spriteScreenRectangle(framebuffer, spritePosition, 32, 32), global.mapTileSet.getTileRectangle(entity.spriteRow, entity.spriteColumn, 32, 32),
+        entity.flipHorizontal, entity.flipVertical);
+        break;
+    case SpriteType::Character:
+        spriteLayer.add(footY, DrawTileSet::Character, spriteScreenRectangle(framebuffer, spritePosition, 32, 48), global.characterTileSet.getTileRectangle(entity.spriteRow, entity.spriteColumn, 32, 48),
+        entity.flipHorizontal, entity.flipVertical);
+        break;
+    case SpriteType::None:
+    default:
+    //drawBox(framebuffer, encodeColor(255, 255, 255, 255), entity.boundingBox.translatedBy(translation));
+        commands.addFill(DrawLayer::Entities, encodeColor(255, 255, 255, 255), boxScreenRectangle(framebuffer, entity.boundingBox.translatedBy(worldToView(entity.position))));
+        break;
+    }
+}
+
+// The boat is drawn around the player, so all three sort by the feet of the
+// player.
+static void addPlayerSprites(DrawCommandList &commands, const Framebuffer &framebuffer, const PlayerRenderState &player)
+{
+    if(snapshot->isGameCompleted)
+        return;
+
+    auto boatOffset = Vector2(0.0f, -0.2f);
+    auto spritePosition = worldToScreen(framebuffer, player.position + player.boundingBox.bottomLeft() + boatOffset);
+    auto boatRectangle = spriteScreenRectangle(framebuffer, spritePosition, /*Sprite size */ 32, 32);
+    auto footPosition = worldToScreen(framebuffer, player.position + player.boundingBox.bottomLeft());
+    auto footY = int(framebuffer.height - footPosition.y - 1);
+
+    if(player.inBoat)
+        spriteLayer.add(footY, DrawTileSet::Sprites, boatRectangle, BoatBack);
+    //printf("feetExtent %f %f\n", feetExtent.x, feetExtent.y);
+    addEntitySprite(commands, framebuffer, player, footY);
+    if(player.inBoat)
+        spriteLayer.add(footY, DrawTileSet::Sprites, boatRectangle, BoatFront);
+
+}
+
+// Covers the character sprite and the boat.
+static Rectangle playerScreenRectangle(const Framebuffer &framebuffer, const PlayerRenderState &player)
+{
+    auto spritePosition = worldToScreen(framebuffer, player.position + player.boundingBox.bottomLeft());
+    auto boatPosition = worldToScreen(framebuffer, player.position + player.boundingBox.bottomLeft() + Vector2(0.0f, -0.2f));
+
+    auto characterRectangle = spriteScreenRectangle(framebuffer, spritePosition, 32, 48);
+    if(!player.inBoat)
+        return characterRectangle;
+
+    auto boatRectangle = spriteScreenRectangle(framebuffer, boatPosition, 32, 32);
+    return characterRectangle.unionWith(boatRectangle);
+}
+
+// A player as the viewport sees it, at its copy in the wrapped world that is
+// the nearest to the camera.
+static PlayerRenderState viewedPlayer(int index)
+{
+    auto player = snapshot->players[index];
+    auto delta = player.position - viewport->camera.position;
+    delta.x -= WorldWidth*floor(delta.x/WorldWidth + 0.5f);
+    delta.y -= WorldHeight*floor(delta.y/WorldHeight + 0.5f);
+    player.position = viewport->camera.position + delta;
+    return player;
+}
+
+static void renderSprites(DrawCommandList &commands, const Framebuffer &framebuffer, const BackgroundView &view)
+{
+    spriteLayer.begin(maxSpriteCount(view));
+    addOccupantSprites(framebuffer, view);
+    for(int i = 0; i < snapshot->playerCount; ++i)
+        addPlayerSprites(commands, framebuffer, viewedPlayer(i));
+    spriteLayer.record(commands);
+}
+
+// A screen rectangle that shows the map colors of the snapshot around a world
+// point, wrapped like the world. It samples the pyramid level with one texel
+// per pixel, or the whole map level when it is zoomed in, so a frame never
+// reads more texels than it has pixels.
+struct MapView
+{
+    Rectangle rectangle;
+    const uint32_t *texels;
+    int levelWidth;
+    int levelHeight;
+
+    // The texel row of the top pixel row and its step, in 16.16 fixed point.
+    uint32_t topRow;
+    uint32_t rowStep;
+
+    // The texel column of every pixel column of the rectangle.
+    int32_t *columnIndices;
+};
+
+inline uint32_t mapTexelFixedPoint(float texel)
+{
+    return uint32_t(int64_t(floor(texel*65536.0f)));
+}
+
+static const MapView *newMapView(const Rectangle &rectangle, const Vector2 &center, int zoomLevel)
+{
+    auto level = std::min(std::max(-zoomLevel, 0), TileColorPyramid::LevelCount - 1);
+    auto texelsPerTile = ldexpf(1.0f, -level);
+    auto texelsPerPixel = ldexpf(1.0f, -level - zoomLevel);
+
+    auto view = newTransient<MapView>();
+    view->rectangle = rectangle;
+    view->texels = snapshot->tileColors.levelTexels(level);
+    view->levelWidth = TileColorPyramid::levelWidth(level);
+    view->levelHeight = TileColorPyramid::levelHeight(level);
+
+    // Screen rows go down and map rows go up. The widths are powers of two,
+    // so the masks wrap the negative texels too.
+    auto halfWidth = rectangle.width*0.5f;
+    auto halfHeight = rectangle.height*0.5f;
+    view->topRow = mapTexelFixedPoint(center.y*texelsPerTile + (halfHeight - 0.5f)*texelsPerPixel);
+    view->rowStep = mapTexelFixedPoint(texelsPerPixel);
+
+    auto column = mapTexelFixedPoint(center.x*texelsPerTile - (halfWidth - 0.5f)*texelsPerPixel);
+    auto columnStep = view->rowStep;
+    view->columnIndices = newTransientArray<int32_t> (rectangle.width);
+    for(int x = 0; x < rectangle.width; ++x, column += columnStep)
+        view->columnIndices[x] = (column >> 16) & (view->levelWidth - 1);
+    return view;
+}
+
+static void executeMapView(const Framebuffer &framebuffer, const MapView &view)
+{
+    auto &rectangle = view.rectangle;
+    auto minX = std::max(framebuffer.clipMinX, rectangle.x);
+    auto maxX = std::min(framebuffer.clipMaxX, rectangle.x + rectangle.width);
+    auto minY = std::max(framebuffer.clipMinY, rectangle.y);
+    auto maxY = std::min(framebuffer.clipMaxY, rectangle.y + rectangle.height);
+    if(minX >= maxX)
+        return;
+
+    auto row = view.topRow - uint32_t(minY - rectangle.y)*view.rowStep;
+    auto destRow = framebuffer.pixels + minY*framebuffer.pitch + minX*4;
+    for(int y = minY; y < maxY; ++y, destRow += framebuffer.pitch, row -= view.rowStep)
+    {
+        auto source = view.texels + ((row >> 16) & (view.levelHeight - 1))*view.levelWidth;
+        pixelKernels.gather(reinterpret_cast<uint32_t*> (destRow), source, view.columnIndices + minX - rectangle.x, maxX - minX);
+    }
+}
+
+static void addMapView(DrawCommandList &commands, DrawLayer layer, const Rectangle &rectangle, const Vector2 &center, int zoomLevel)
+{
+    auto &command = commands.addCommand(DrawCommandType::MapView, layer, rectangle);
+    command.object = newMapView(rectangle, center, zoomLevel);
+}
+
+// The minimap is the whole world at the pyramid level with a texel per pixel.
+static constexpr int MinimapZoomLevel = -2;
+static constexpr int MinimapWidth = WorldWidth >> -MinimapZoomLevel;
+static constexpr int MinimapHeight = WorldHeight >> -MinimapZoomLevel;
+
+static Rectangle minimapRectangle(const Framebuffer &framebuffer)
+{
+    return Rectangle(framebuffer.width - MinimapWidth, framebuffer.height - MinimapHeight, MinimapWidth, MinimapHeight);
+}
+
+static Rectangle minimapCursorRectangle(const Framebuffer &framebuffer)
+{
+    auto rectangle = minimapRectangle(framebuffer);
+    const auto &player = viewportPlayer();
+    auto cursorX = rectangle.x + floor(player.position.x * rectangle.width / float(WorldWidth));
+    auto cursorY = rectangle.y + rectangle.height - floor(player.position.y * rectangle.height / float(WorldHeight));
+    auto cursorWidth = 4;
+    auto cursorHeight = 4;
+    return Rectangle(cursorX - cursorWidth/2, cursorY - cursorHeight/2, cursorWidth, cursorHeight);
+}
+
+static void renderMinimap(DrawCommandList &commands, const Framebuffer &framebuffer)
+{
+    addMapView(commands, DrawLayer::Hud, minimapRectangle(framebuffer), Vector2(WorldWidth/2, WorldHeight/2), MinimapZoomLevel);
+    commands.addFill(DrawLayer::Hud, 0xFF0000FF, minimapCursorRectangle(framebuffer));
+}
+
+static Rectangle worldMapCursorRectangle(const Framebuffer &framebuffer, const PlayerRenderState &player)
+{
+    const auto &worldMap = snapshot->worldMap;
+    auto pixelsPerTile = worldMap.pixelsPerTile();
+
+    // The nearest copy of the player in the wrapped world.
+    auto delta = player.position - worldMap.center;
+    delta.x -= WorldWidth*floor(delta.x/WorldWidth + 0.5f);
+    delta.y -= WorldHeight*floor(delta.y/WorldHeight + 0.5f);
+
+    auto cursorX = int(floor(framebuffer.width*0.5f + delta.x*pixelsPerTile));
+    auto cursorY = int(floor(framebuffer.height*0.5f - delta.y*pixelsPerTile));
+    auto cursorSize = std::max(4, int(pixelsPerTile));
+    return Rectangle(cursorX - cursorSize/2, cursorY - cursorSize/2, cursorSize, cursorSize);
+}
+
+static void renderWorldMap(DrawCommandList &commands, const Framebuffer &framebuffer)
+{
+    const auto &worldMap = snapshot->worldMap;
+    addMapView(commands, DrawLayer::Background, Rectangle(0, 0, framebuffer.width, framebuffer.height), worldMap.center, worldMap.zoomLevel);
+    for(int i = 0; i < snapshot->playerCount; ++i)
+        commands.addFill(DrawLayer::Hud, 0xFF0000FF, worldMapCursorRectangle(framebuffer, snapshot->players[i]));
+}
+
+// The bullets that can be on the screen in this frame, with their screen
+// rectangles. They are culled once for both the damage and the drawing, so the
+// bullets far from the view only cost a comparison of their positions.
+struct VisibleBullets
+{
+    int count;
+    Rectangle *rectangles;
+    uint32_t *colors;
+};
+
+static VisibleBullets visibleBullets;
+
+static void cullBullets(const Framebuffer &framebuffer)
+{
+    // The positions are tested against the view, grown by the largest bullet.
+    auto cullRadius = Vector2(snapshot->bulletCullRadius, snapshot->bulletCullRadius);
+    auto halfExtent = pixels2Units(Vector2(framebuffer.width/2, framebuffer.height/2)) * (1.0f / viewport->camera.zoom()) + cullRadius;
+    auto min = viewport->camera.position - halfExtent;
+    auto max = viewport->camera.position + halfExtent;
+
+    auto indices = newTransientArray<int32_t> (snapshot->bulletCount);
+    auto count = pixelKernels.selectPointsInBox(indices, snapshot->bulletPositionsX, snapshot->bulletPositionsY, snapshot->bulletCount,
+        min.x, min.y, max.x, max.y);
+
+    visibleBullets.count = count;
+    visibleBullets.rectangles = newTransientArray<Rectangle> (count);
+    visibleBullets.colors = newTransientArray<uint32_t> (count);
+    for(int i = 0; i < count; ++i)
+    {
+        auto index = indices[i];
+        auto position = Vector2(snapshot->bulletPositionsX[index], snapshot->bulletPositionsY[index]);
+        auto box = snapshot->bulletBoundingBoxes[index].translatedBy(worldToView(position));
+        visibleBullets.rectangles[i] = boxScreenRectangle(framebuffer, box);
+        visibleBullets.colors[i] = snapshot->bulletColors[index];
+    }
+}
+
+// The visible bullets of one color whose rectangles start in the same draw bin,
+// so a bin only goes through the bullets around it.
+struct BulletBatch
+{
+    int count;
+    const Rectangle *rectangles;
+};
+
+static void renderBullets(DrawCommandList &commands, const Framebuffer &framebuffer)
+{
+    auto count = visibleBullets.count;
+    if(count == 0)
+        return;
+
+    // There are only a few bullet colors. They are numbered in the order in
+    // which they first appear.
+    auto colors = newTransientArray<uint32_t> (count);
+    auto colorIndices = newTransientArray<int> (count);
+    int colorCount = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        auto color = visibleBullets.colors[i];
+        int colorIndex = 0;
+        while(colorIndex < colorCount && colors[colorIndex] != color)
+            ++colorIndex;
+        if(colorIndex == colorCount)
+            colors[colorCount++] = color;
+        colorIndices[i] = colorIndex;
+    }
+
+    // Stable counting sort of the bullets by the bin of their top left pixel,
+    // and then by color.
+    auto binColumns = (framebuffer.width + DrawBinWidth - 1) / DrawBinWidth;
+    auto binRows = (framebuffer.height + DrawBinHeight - 1) / DrawBinHeight;
+    auto batchCount = binColumns*binRows*colorCount;
+    auto batchStart = newTransientArray<int> (batchCount + 1);
+    memset(batchStart, 0, (batchCount + 1)*sizeof(int));
+
+    auto batchIndices = newTransientArray<int> (count);
+    for(int i = 0; i < count; ++i)
+    {
+        const auto &rectangle = visibleBullets.rectangles[i];
+        batchIndices[i] = drawBinAt(framebuffer, binColumns, rectangle.x, rectangle.y)*colorCount + colorIndices[i];
+        ++batchStart[batchIndices[i] + 1];
+    }
+
+    for(int i = 0; i < batchCount; ++i)
+        batchStart[i + 1] += batchStart[i];
+
+    auto batchEnd = newTransientArray<int> (batchCount);
+    memcpy(batchEnd, batchStart, batchCount*sizeof(int));
+    auto rectangles = newTransientArray<Rectangle> (count);
+    for(int i = 0; i < count; ++i)
+        rectangles[batchEnd[batchIndices[i]]++] = visibleBullets.rectangles[i];
+
+    for(int i = 0; i < batchCount; ++i)
+    {
+        if(batchStart[i] == batchEnd[i])
+            continue;
+
+        auto batch = newTransient<BulletBatch> ();
+        batch->count = batchEnd[i] - batchStart[i];
+        batch->rectangles = rectangles + batchStart[i];
+
+        auto bounds = batch->rectangles[0];
+        for(int j = 1; j < batch->count; ++j)
+            bounds = bounds.unionWith(batch->rectangles[j]);
+
+        auto &command = commands.addCommand(DrawCommandType::BulletBatch, DrawLayer::Bullets, bounds);
+        command.color = colors[i % colorCount];
+        command.object = batch;
+    }
+}
+
+// A particle is a square of two world pixels, and of at least one screen pixel.
+static constexpr float ParticleSize = 2.0f;
+
+struct ScreenParticle
+{
+    int16_t x;
+    int16_t y;
+    uint32_t color;
+};
+
+// The particles whose top left pixel is in one draw bin.
+struct ParticleBatch
+{
+    Rectangle bounds;
+    int size;
+    int count;
+    const ScreenParticle *particles;
+};
+
+// The particle batches of a frame, which are built before the damage tracking,
+// because they move every frame and are damaged a batch at a time.
+struct VisibleParticles
+{
+    int batchCount;
+    ParticleBatch *batches;
+};
+
+static VisibleParticles visibleParticles;
+
+static void batchParticles(const Framebuffer &framebuffer)
+{
+    visibleParticles.batchCount = 0;
+    auto count = snapshot->particleCount;
+    if(count == 0 || snapshot->worldMap.isOpen)
+        return;
+
+    auto zoom = viewport->camera.zoom();
+    auto size = std::max(1, int(ParticleSize*zoom));
+    auto scale = Units2Pixels*zoom;
+    auto halfSize = 0.5f*size;
+
+    // The top left pixels of the squares, with the same rounding as the boxes.
+    auto screenParticles = newTransientArray<ScreenParticle> (count);
+    int screenCount = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        auto minX = int(floor((snapshot->particlePositionsX[i] - viewport->camera.position.x)*scale + framebuffer.width/2 - halfSize));
+        auto minY = int(floor((snapshot->particlePositionsY[i] - viewport->camera.position.y)*scale + framebuffer.height/2 - halfSize));
+        auto y = framebuffer.height - (minY + size) - 1;
+        if(minX + size <= 0 || minX >= framebuffer.width || y + size <= 0 || y >= framebuffer.height)
+            continue;
+
+        auto &particle = screenParticles[screenCount++];
+        particle.x = int16_t(minX);
+        particle.y = int16_t(y);
+        particle.color = snapshot->particleColors[i];
+    }
+
+    // Stable counting sort of the particles by bin.
+    auto binColumns = (framebuffer.width + DrawBinWidth - 1) / DrawBinWidth;
+    auto binRows = (framebuffer.height + DrawBinHeight - 1) / DrawBinHeight;
+    auto binCount = binColumns*binRows;
+    auto binStart = newTransientArray<int> (binCount + 1);
+    memset(binStart, 0, (binCount + 1)*sizeof(int));
+    for(int i = 0; i < screenCount; ++i)
+        ++binStart[drawBinAt(framebuffer, binColumns, screenParticles[i].x, screenParticles[i].y) + 1];
+    for(int i = 0; i < binCount; ++i)
+        binStart[i + 1] += binStart[i];
+
+    auto binEnd = newTransientArray<int> (binCount);
+    memcpy(binEnd, binStart, binCount*sizeof(int));
+    auto sortedParticles = newTransientArray<ScreenParticle> (screenCount);
+    for(int i = 0; i < screenCount; ++i)
+        sortedParticles[binEnd[drawBinAt(framebuffer, binColumns, screenParticles[i].x, screenParticles[i].y)]++] = screenParticles[i];
+
+    visibleParticles.batches = newTransientArray<ParticleBatch> (binCount);
+    for(int i = 0; i < binCount; ++i)
+    {
+        if(binStart[i] == binEnd[i])
+            continue;
+
+        auto &batch = visibleParticles.batches[visibleParticles.batchCount++];
+        batch.size = size;
+        batch.count = binEnd[i] - binStart[i];
+        batch.particles = sortedParticles + binStart[i];
+
+        int minX = batch.particles[0].x, minY = batch.particles[0].y, maxX = minX, maxY = minY;
+        for(int j = 1; j < batch.count; ++j)
+        {
+            minX = std::min(minX, int(batch.particles[j].x));
+            minY = std::min(minY, int(batch.particles[j].y));
+            maxX = std::max(maxX, int(batch.particles[j].x));
+            maxY = std::max(maxY, int(batch.particles[j].y));
+        }
+        batch.bounds = Rectangle(minX, minY, maxX - minX + size, maxY - minY + size);
+    }
+}
+
+static void renderParticles(DrawCommandList &commands)
+{
+    for(int i = 0; i < visibleParticles.batchCount; ++i)
+    {
+        const auto &batch = visibleParticles.batches[i];
+        auto &command = commands.addCommand(DrawCommandType::ParticleBatch, DrawLayer::Particles, batch.bounds);
+        command.object = &batch;
+    }
+}
+
+inline uint32_t colorForPercentageMeter(int percentage)
+{
+    if(percentage > 75)
+        return 0xFFFF0000;
+    else if(percentage > 50)
+        return 0xFF00FF00;
+    else if(percentage > 25)
+        return 0xFF00FFFF;
+    else
+        return 0xFF0000FF;
+}
+
+// Writes value in decimal, padded with zeros to minimumDigits like "%0*d",
+// without going through printf. Returns the length of the text.
+static int formatInteger(char *buffer, int value, int minimumDigits = 1)
+{
+    char digits[16];
+    int digitCount = 0;
+    auto magnitude = value < 0 ? 0u - uint32_t(value) : uint32_t(value);
+    do
+    {
+        digits[digitCount++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude != 0);
+
+    int length = 0;
+    if(value < 0)
+    {
+        buffer[length++] = '-';
+        --minimumDigits;
+    }
+    for(int i = digitCount; i < minimumDigits; ++i)
+        buffer[length++] = '0';
+    while(digitCount > 0)
+        buffer[length++] = digits[--digitCount];
+    buffer[length] = 0;
+    return length;
+}
+
+// Part of the HUD that is rasterized into its own buffer, with its glyphs
+// already tinted, only when the value that it shows changes. The buffer is
+// premultiplied, and every row keeps its visible spans, so compositing it over
+// the frame is a few straight copies, and blends for the translucent spans.
+class RetainedHudElement
+{
+public:
+    RetainedHudElement()
+        : x(0), y(0), key(~uint64_t(0)), width(0), height(0) {}
+
+    uint64_t getKey() const
+    {
+        return key;
+    }
+
+    Rectangle rectangle() const
+    {
+        return Rectangle(x, y, width, height);
+    }
+
+    // Returns true when the element has to be rasterized again.
+    bool needsUpdate(uint64_t newKey) const
+    {
+        return newKey != key;
+    }
+
+    // Clears the element to transparent, and returns a framebuffer for drawing
+    // its new contents.
+    Framebuffer beginUpdate(uint64_t newKey, int newWidth, int newHeight)
+    {
+        key = newKey;
+        width = newWidth;
+        height = newHeight;
+        pixels.assign(width*height, 0);
+        return Framebuffer(width, height, width*4, reinterpret_cast<uint8_t*> (pixels.data()));
+    }
+
+    void endUpdate()
+    {
+        spans.clear();
+        rowSpanStart.resize(height + 1);
+        for(int row = 0; row < height; ++row)
+        {
+            rowSpanStart[row] = spans.size();
+            auto source = &pixels[row*width];
+            for(int column = 0; column < width; )
+            {
+                if((source[column] & 0xFF000000) == 0)
+                {
+                    ++column;
+                    continue;
+                }
+
+                auto begin = column;
+                auto isOpaque = true;
+                for(; column < width && (source[column] & 0xFF000000) != 0; ++column)
+                    isOpaque = isOpaque && (source[column] & 0xFF000000) == 0xFF000000;
+                spans.push_back(Span{begin, column, isOpaque});
+            }
+        }
+        rowSpanStart[height] = spans.size();
+    }
+
+    void composite(const Framebuffer &framebuffer) const
+    {
+        auto minY = std::max(y, framebuffer.clipMinY);
+        auto maxY = std::min(y + height, framebuffer.clipMaxY);
+        auto minX = framebuffer.clipMinX - x;
+        auto maxX = framebuffer.clipMaxX - x;
+
+        // The element can start left of the framebuffer, so the destination is
+        // only offset by x once the spans are clipped.
+        auto destRow = framebuffer.pixels + minY*framebuffer.pitch;
+        for(int destY = minY; destY < maxY; ++destY, destRow += framebuffer.pitch)
+        {
+            auto row = destY - y;
+            auto source = &pixels[row*width];
+            for(auto span = rowSpanStart[row]; span < rowSpanStart[row + 1]; ++span)
+            {
+                auto begin = std::max(spans[span].begin, minX);
+                auto end = std::min(spans[span].end, maxX);
+                if(begin >= end)
+                    continue;
+
+                auto dest = reinterpret_cast<uint32_t*> (destRow + (x + begin)*4);
+                if(spans[span].isOpaque)
+                    memcpy(dest, source + begin, (end - begin)*4);
+                else
+                    pixelKernels.blendOver(dest, source + begin, end - begin);
+            }
+        }
+    }
+
+    int x;
+    int y;
+
+private:
+    struct Span
+    {
+        int begin;
+        int end;
+        bool isOpaque;
+    };
+
+    uint64_t key;
+    int width;
+    int height;
+    std::vector<uint32_t> pixels;
+    std::vector<Span> spans;
+    std::vector<uint32_t> rowSpanStart;
+};
+
+struct RetainedHud
+{
+    RetainedHudElement health;
+    RetainedHudElement belly;
+    RetainedHudElement ammo;
+    RetainedHudElement gameTime;
+    RetainedHudElement message;
+};
+
+static RetainedHud retainedHuds[MaxPlayers];
+
+// The HUD of the viewport that is being drawn.
+static RetainedHud *retainedHud;
+
+// An icon followed by a number. The value is limited to 24 bits in the key.
+static void updateHudCounter(RetainedHudElement &element, int x, int y, TileOccupant icon, int value, uint32_t color)
+{
+    element.x = x;
+    element.y = y;
+
+    auto key = uint64_t(color) | (uint64_t(icon) << 32) | (uint64_t(value & 0xFFFFFF) << 40);
+    if(!element.needsUpdate(key))
         return;
-    int lineCount = 0;
-    int lineStart = 0;
-    while(message[lineStart])
+
+    char buffer[16];
+    auto length = formatInteger(buffer, value, 3);
+    auto elementFramebuffer = element.beginUpdate(key, FontTileSize*(length + 1), FontTileSize);
+    blitTileRectangle(elementFramebuffer, 0, 0, global.spriteSet, TileOccupantSprites[int(icon)]);
+    drawText(elementFramebuffer, color, FontTileSize, 0, buffer);
+    element.endUpdate();
+}
+
+static void updateHudGameTime(const Framebuffer &framebuffer, RetainedHudElement &element)
+{
+    char buffer[16];
+    int matchTime = snapshot->matchTime;
+    auto length = formatInteger(buffer, matchTime);
+    element.x = (framebuffer.width - FontTileSize*length)/2;
+    element.y = 0;
+
+    if(!element.needsUpdate(uint32_t(matchTime)))
+        return;
+
+    auto elementFramebuffer = element.beginUpdate(uint32_t(matchTime), FontTileSize*length, FontTileSize);
+    drawText(elementFramebuffer, 0xFFFFFFFF, 0, 0, buffer);
+    element.endUpdate();
+}
+
+static constexpr uint32_t PauseCheckerboardMask = 0xFF808080;
+
+// The decay of the world also shows on the sprites.
+static const uint32_t DecayStageTints[] = {
+    0xFFFFFFFF,
+    0xFFCCECFF,
+    0xFFC4C4E8,
+};
+
+static constexpr uint32_t DamageFlashColor = 0xFF2020FF;
+static constexpr int MaxDamageFlashWeight = 72;
+
+// The screen gets darker around the edges below this health.
+static constexpr int LowHealthVignetteThreshold = 25;
+static constexpr float LowHealthVignetteInnerRadius2 = 0.3f;
+static constexpr float MaxLowHealthVignetteStrength = 120.0f;
+
+// The effects of a frame, and a key that changes with their look.
+struct ScreenEffects
+{
+    PostProcessParameters parameters;
+    uint64_t key;
+};
+
+static ScreenEffects screenEffects;
+
+static void computeScreenEffects(const Framebuffer &framebuffer)
+{
+    auto &parameters = screenEffects.parameters;
+    parameters = PostProcessParameters();
+    parameters.effects = PostProcessEffects::None;
+
+    auto decayStage = int(snapshot->decayStage);
+    if(snapshot->decayStage != DecayStage::Normal)
+    {
+        parameters.effects |= PostProcessEffects::Tint;
+        parameters.tintColor = DecayStageTints[decayStage];
+    }
+
+    const auto &player = viewportPlayer();
+    auto flashWeight = int(player.damageFlash*MaxDamageFlashWeight);
+    if(flashWeight > 0)
+    {
+        parameters.effects |= PostProcessEffects::Flash;
+        parameters.flashColor = DamageFlashColor;
+        parameters.flashWeight = flashWeight;
+    }
+
+    auto vignetteHealth = player.isAlive && player.health <= LowHealthVignetteThreshold ? player.health : 0;
+    if(vignetteHealth > 0)
+    {
+        parameters.effects |= PostProcessEffects::Vignette;
+        parameters.vignetteCenterX = framebuffer.width*0.5f;
+        parameters.vignetteCenterY = framebuffer.height*0.5f;
+        parameters.vignetteScaleX = 2.0f / framebuffer.width;
+        parameters.vignetteScaleY = 2.0f / framebuffer.height;
+        parameters.vignetteInnerRadius2 = LowHealthVignetteInnerRadius2;
+        parameters.vignetteStrength = MaxLowHealthVignetteStrength*(LowHealthVignetteThreshold + 1 - vignetteHealth) / LowHealthVignetteThreshold;
+    }
+
+    if(snapshot->isPaused || snapshot->isGameCompleted)
+    {
+        parameters.effects |= PostProcessEffects::Checkerboard;
+        parameters.checkerboardMask = PauseCheckerboardMask;
+    }
+
+    screenEffects.key = parameters.effects | (uint64_t(decayStage) << 8) | (uint64_t(flashWeight) << 16) | (uint64_t(vignetteHealth) << 24);
+}
+
+static void renderPostProcess(DrawCommandList &commands, const Framebuffer &framebuffer)
+{
+    if(screenEffects.parameters.effects != PostProcessEffects::None)
+        commands.addCommand(DrawCommandType::PostProcess, DrawLayer::PostProcess, Rectangle(0, 0, framebuffer.width, framebuffer.height));
+}
+
+// Every effect is applied in the same sweep over the bin, while its rows are in
+// the cache.
+static void executePostProcess(const Framebuffer &framebuffer)
+{
+    auto destRow = framebuffer.pixels + framebuffer.clipMinY*framebuffer.pitch + framebuffer.clipMinX*4;
+    for(int y = framebuffer.clipMinY; y < framebuffer.clipMaxY; ++y, destRow += framebuffer.pitch)
+    {
+        auto dest = reinterpret_cast<uint32_t*> (destRow);
+        pixelKernels.postProcess(dest, framebuffer.clipMaxX - framebuffer.clipMinX, framebuffer.clipMinX, y, screenEffects.parameters);
+    }
+}
+
+static const char *currentMessage(uint32_t &color)
+{
+    const char *message = nullptr;
+    color = -1;
+
+    if(snapshot->isGameCompleted)
+    {
+        message = "Congratulations!\0You have escaped\0the Earth\0 \0Welcome to Hell!!!\0 \0Press R to reset\0";
+        color = 0xff00FFFF;
+    }
+    else if(!viewportPlayer().isAlive)
+    {
+        message = "Game Over\0Press R to reset\0";
+        color = 0xff000080;
+    }
+    else if(snapshot->isPaused)
     {
-        lineStart += strlen(message + lineStart) + 1;
-        ++lineCount;
+        message = "Paused\0";
+        color = 0xffff0000;
     }
 
-    int y = (framebuffer.height - 1 - FontTileSize*lineCount) / 2;
-    lineStart = 0;
-    while(message[lineStart])
+    return message;
+}
+
+// The messages are drawn over a translucent panel, so they can be read over
+// any terrain. The color is premultiplied.
+static constexpr uint32_t HudPanelColor = 0xA0000000;
+static constexpr int HudPanelMargin = FontTileSize/2;
+
+static void updateHudMessage(const Framebuffer &framebuffer, RetainedHudElement &element)
+{
+    uint32_t color;
+    auto message = currentMessage(color);
+
+    int lineCount = 0;
+    int maxLength = 0;
+    for(int lineStart = 0; message && message[lineStart]; ++lineCount)
     {
         int length = strlen(message + lineStart);
-        int width = length* FontTileSize;
+        maxLength = std::max(maxLength, length);
+        lineStart += length + 1;
+    }
 
-        int x = (framebuffer.width - width) / 2;
-        drawText(framebuffer, color, x, y, message + lineStart);
+    // The lines are centered inside the panel, which is centered on the screen.
+    auto width = maxLength*FontTileSize;
+    auto margin = message ? HudPanelMargin : 0;
+    element.x = (framebuffer.width - width) / 2 - margin;
+    element.y = (framebuffer.height - 1 - FontTileSize*lineCount) / 2 - margin;
 
+    auto key = uint64_t(uintptr_t(message));
+    if(!element.needsUpdate(key))
+        return;
+
+    auto elementFramebuffer = element.beginUpdate(key, width + 2*margin, FontTileSize*lineCount + 2*margin);
+    drawRectangle(elementFramebuffer, HudPanelColor, 0, 0, elementFramebuffer.width, elementFramebuffer.height);
+    int y = margin;
+    for(int lineStart = 0; message && message[lineStart]; )
+    {
+        int length = strlen(message + lineStart);
+        drawText(elementFramebuffer, color, margin + (width - length*FontTileSize) / 2, y, message + lineStart);
         lineStart += length + 1;
         y += FontTileSize;
     }
+    element.endUpdate();
+}
+
+static void updateHud(const Framebuffer &framebuffer)
+{
+    const auto &player = viewportPlayer();
+    updateHudCounter(retainedHud->health, 0, 0, TileOccupant::Medkit, player.health, colorForPercentageMeter(player.health));
+    updateHudCounter(retainedHud->belly, 0, FontTileSize, TileOccupant::Meat, player.belly, colorForPercentageMeter(player.belly));
+
+    auto bulletSprite = player.withDemolitionBullets ? TileOccupant::TripleDemolitionBullet : TileOccupant::TripleBullet;
+    updateHudCounter(retainedHud->ammo, 0, FontTileSize*2, bulletSprite, player.ammo, 0xFF00FFFF);
+
+    updateHudGameTime(framebuffer, retainedHud->gameTime);
+    updateHudMessage(framebuffer, retainedHud->message);
+}
+
+static void renderHudElement(DrawCommandList &commands, const RetainedHudElement &element)
+{
+    auto &command = commands.addCommand(DrawCommandType::HudElement, DrawLayer::Hud, element.rectangle());
+    command.object = &element;
+}
+
+static void renderHud(DrawCommandList &commands, const Framebuffer &framebuffer)
+{
+    renderMinimap(commands, framebuffer);
+    renderHudElement(commands, retainedHud->health);
+    renderHudElement(commands, retainedHud->belly);
+    renderHudElement(commands, retainedHud->ammo);
+    renderHudElement(commands, retainedHud->gameTime);
+
+    renderHudElement(commands, retainedHud->message);
+}
+
+template<typename TileSetImageType, typename PixelCopy>
+static void executeBlitWith(const Framebuffer &framebuffer, const DrawCommand &command, const TileSetImageType &tileSet, const PixelCopy &pixels)
+{
+    if(command.type == DrawCommandType::ScaledBlit)
+    {
+        blitScaledTileRectangle(framebuffer, command.clipRectangle, tileSet, command.sourceRectangle,
+            command.flipHorizontal, command.flipVertical, pixels);
+    }
+    else
+    {
+        blitClippedTileRectangle(framebuffer, command.destX, command.destY, tileSet, command.sourceRectangle,
+            command.flipHorizontal, command.flipVertical, pixels);
+    }
+}
+
+static void executeBlit(const Framebuffer &framebuffer, const DrawCommand &command)
+{
+    switch(command.tileSet)
+    {
+    case DrawTileSet::Map:
+        executeBlitWith(framebuffer, command, global.mapTileSet, IndexedPixelCopy<MapTileSet::IndexType>(global.mapTileSet.palette(command.paletteIndex)));
+        break;
+    case DrawTileSet::Character:
+        executeBlitWith(framebuffer, command, global.characterTileSet, IndexedPixelCopy<CharacterTileSet::IndexType>(global.characterTileSet.palette(command.paletteIndex)));
+        break;
+    case DrawTileSet::Sprites:
+        executeBlitWith(framebuffer, command, global.spriteSet, DirectPixelCopy());
+        break;
+    }
+}
+
+// Most bullets have the size of the 6x6 fill at the normal zoom, and are not cut
+// by the clip rectangle.
+static void executeBulletBatch(const Framebuffer &framebuffer, uint32_t color, const BulletBatch &batch)
+{
+    for(int i = 0; i < batch.count; ++i)
+    {
+        const auto &rectangle = batch.rectangles[i];
+        if(rectangle.width == 6 && rectangle.height == 6 &&
+            rectangle.x >= framebuffer.clipMinX && rectangle.x + 6 <= framebuffer.clipMaxX &&
+            rectangle.y >= framebuffer.clipMinY && rectangle.y + 6 <= framebuffer.clipMaxY)
+        {
+            pixelKernels.fill6x6(framebuffer.pixels + rectangle.y*framebuffer.pitch + rectangle.x*4, framebuffer.pitch, color);
+        }
+        else
+        {
+            drawRectangle(framebuffer, color, rectangle.x, rectangle.y, rectangle.width, rectangle.height);
+        }
+    }
+}
+
+// The squares that the clip rectangle does not cut are written directly, with
+// loops of a constant size.
+template<int Size>
+static void executeParticleBatchWith(const Framebuffer &framebuffer, const ParticleBatch &batch)
+{
+    for(int i = 0; i < batch.count; ++i)
+    {
+        const auto &particle = batch.particles[i];
+        if(particle.x >= framebuffer.clipMinX && particle.x + Size <= framebuffer.clipMaxX &&
+            particle.y >= framebuffer.clipMinY && particle.y + Size <= framebuffer.clipMaxY)
+        {
+            auto row = framebuffer.pixels + particle.y*framebuffer.pitch + particle.x*4;
+            for(int y = 0; y < Size; ++y, row += framebuffer.pitch)
+            {
+                for(int x = 0; x < Size; ++x)
+                    reinterpret_cast<uint32_t*> (row)[x] = particle.color;
+            }
+        }
+        else
+        {
+            drawRectangle(framebuffer, particle.color, particle.x, particle.y, Size, Size);
+        }
+    }
+}
+
+static void executeParticleBatch(const Framebuffer &framebuffer, const ParticleBatch &batch)
+{
+    switch(batch.size)
+    {
+    case 1:
+        executeParticleBatchWith<1> (framebuffer, batch);
+        break;
+    case 2:
+        executeParticleBatchWith<2> (framebuffer, batch);
+        break;
+    case 4:
+        executeParticleBatchWith<4> (framebuffer, batch);
+        break;
+    default:
+        for(int i = 0; i < batch.count; ++i)
+        {
+            const auto &particle = batch.particles[i];
+            drawRectangle(framebuffer, particle.color, particle.x, particle.y, batch.size, batch.size);
+        }
+        break;
+    }
+}
+
+static void executeDrawCommand(const Framebuffer &framebuffer, const DrawCommand &command)
+{
+    const auto &rectangle = command.clipRectangle;
+    switch(command.type)
+    {
+    case DrawCommandType::Background:
+        backgroundCache->copyTo(framebuffer, *reinterpret_cast<const BackgroundView*> (command.object));
+        break;
+    case DrawCommandType::Blit:
+    case DrawCommandType::ScaledBlit:
+        executeBlit(framebuffer, command);
+        break;
+    case DrawCommandType::Fill:
+        drawRectangle(framebuffer, command.color, rectangle.x, rectangle.y, rectangle.width, rectangle.height);
+        break;
+    case DrawCommandType::PostProcess:
+        executePostProcess(framebuffer);
+        break;
+    case DrawCommandType::HudElement:
+        reinterpret_cast<const RetainedHudElement*> (command.object)->composite(framebuffer);
+        break;
+    case DrawCommandType::MapView:
+        executeMapView(framebuffer, *reinterpret_cast<const MapView*> (command.object));
+        break;
+    case DrawCommandType::BulletBatch:
+        executeBulletBatch(framebuffer, command.color, *reinterpret_cast<const BulletBatch*> (command.object));
+        break;
+    case DrawCommandType::ParticleBatch:
+        executeParticleBatch(framebuffer, *reinterpret_cast<const ParticleBatch*> (command.object));
+        break;
+    }
+}
+
+enum class DamageItem
+{
+    BackgroundOrigin = 0,
+    PostProcess,
+    Message,
+    WorldMapView,
+    WorldMapContents,
+    WorldMapCursor,
+    LastWorldMapCursor = WorldMapCursor + MaxPlayers - 1,
+    Player,
+    LastPlayer = Player + MaxPlayers - 1,
+    ViewportLayout,
+    Minimap,
+    MinimapCursor,
+    Health,
+    Belly,
+    Ammo,
+    GameTime,
+
+    Count
+};
+
+// Compares what is drawn in this frame with the previous one. Every tracked item
+// has a key that changes with its look and the screen rectangle that it covers.
+// The framebuffer contents are kept between frames, so only the changed
+// rectangles have to be drawn again.
+class DamageTracker
+{
+public:
+    DamageTracker()
+        : damage(nullptr), pixels(nullptr), width(0), height(0), pitch(0)
+    {
+        for(auto &item : items)
+            item.key = ~uint64_t(0);
+    }
+
+    void beginFrame(const Framebuffer &framebuffer, FramebufferDamage &newDamage)
+    {
+        damage = &newDamage;
+        damage->clear();
+        bounds = Rectangle(0, 0, framebuffer.width, framebuffer.height);
+
+        if(framebuffer.pixels != pixels || framebuffer.width != width || framebuffer.height != height || framebuffer.pitch != pitch)
+        {
+            pixels = framebuffer.pixels;
+            width = framebuffer.width;
+            height = framebuffer.height;
+            pitch = framebuffer.pitch;
+            addWholeFramebuffer();
+        }
+
+        std::swap(previousTransientRectangles, transientRectangles);
+        transientRectangles.clear();
+    }
+
+    void addRectangle(const Rectangle &rectangle)
+    {
+        damage->addRectangle(rectangle.intersectionWith(bounds));
+    }
+
+    void addWholeFramebuffer()
+    {
+        damage->addRectangle(bounds);
+    }
+
+    void trackItem(DamageItem item, uint64_t key, const Rectangle &rectangle)
+    {
+        auto &state = items[int(item)];
+        if(state.key == key && state.rectangle == rectangle)
+            return;
+
+        addRectangle(state.rectangle);
+        addRectangle(rectangle);
+        state.key = key;
+        state.rectangle = rectangle;
+    }
+
+    // Something that changes every frame, like a bullet. It is damaged in this
+    // frame and in the next one, where it has to be erased.
+    void trackTransient(const Rectangle &rectangle)
+    {
+        transientRectangles.push_back(rectangle);
+        addRectangle(rectangle);
+    }
+
+    void endFrame()
+    {
+        for(const auto &rectangle : previousTransientRectangles)
+            addRectangle(rectangle);
+        damage = nullptr;
+    }
+
+private:
+    struct ItemState
+    {
+        uint64_t key;
+        Rectangle rectangle;
+    };
+
+    FramebufferDamage *damage;
+    Rectangle bounds;
+
+    uint8_t *pixels;
+    int width;
+    int height;
+    int pitch;
+
+    ItemState items[int(DamageItem::Count)];
+    std::vector<Rectangle> transientRectangles;
+    std::vector<Rectangle> previousTransientRectangles;
+};
+
+// The whole screen, and every viewport, keep their own items.
+static DamageTracker screenDamageTracker;
+static DamageTracker viewportDamageTrackers[MaxPlayers];
+static DamageTracker *damageTracker;
+
+static void trackHudDamage(const Framebuffer &framebuffer)
+{
+    damageTracker->trackItem(DamageItem::Minimap, snapshot->tileColorRevision, minimapRectangle(framebuffer));
+    damageTracker->trackItem(DamageItem::MinimapCursor, 0, minimapCursorRectangle(framebuffer));
+    damageTracker->trackItem(DamageItem::Health, retainedHud->health.getKey(), retainedHud->health.rectangle());
+    damageTracker->trackItem(DamageItem::Belly, retainedHud->belly.getKey(), retainedHud->belly.rectangle());
+    damageTracker->trackItem(DamageItem::Ammo, retainedHud->ammo.getKey(), retainedHud->ammo.rectangle());
+    damageTracker->trackItem(DamageItem::GameTime, retainedHud->gameTime.getKey(), retainedHud->gameTime.rectangle());
+}
+
+// The world map covers the whole screen. It moves with the center and the
+// zoom, and its colors change with the tiles.
+static void trackWorldMapDamage(const Framebuffer &framebuffer)
+{
+    const auto &worldMap = snapshot->worldMap;
+    if(!worldMap.isOpen)
+    {
+        damageTracker->trackItem(DamageItem::WorldMapView, 0, Rectangle());
+        damageTracker->trackItem(DamageItem::WorldMapContents, 0, Rectangle());
+        for(int i = 0; i < MaxPlayers; ++i)
+            damageTracker->trackItem(DamageItem(int(DamageItem::WorldMapCursor) + i), 0, Rectangle());
+        return;
+    }
+
+    uint32_t centerX, centerY;
+    memcpy(&centerX, &worldMap.center.x, 4);
+    memcpy(&centerY, &worldMap.center.y, 4);
+
+    auto wholeScreen = Rectangle(0, 0, framebuffer.width, framebuffer.height);
+    damageTracker->trackItem(DamageItem::WorldMapView, centerX | (uint64_t(centerY) << 32), wholeScreen);
+    damageTracker->trackItem(DamageItem::WorldMapContents, uint32_t(worldMap.zoomLevel) | (uint64_t(snapshot->tileColorRevision) << 32), wholeScreen);
+    for(int i = 0; i < MaxPlayers; ++i)
+    {
+        auto cursorRectangle = i < snapshot->playerCount ? worldMapCursorRectangle(framebuffer, snapshot->players[i]) : Rectangle();
+        damageTracker->trackItem(DamageItem(int(DamageItem::WorldMapCursor) + i), 0, cursorRectangle);
+    }
+}
+
+// What covers the whole screen: the world map, and the layout of the
+// viewports, which changes with the number of players.
+static void trackScreenDamage(const Framebuffer &framebuffer, FramebufferDamage &damage)
+{
+    damageTracker = &screenDamageTracker;
+    damageTracker->beginFrame(framebuffer, damage);
+    damageTracker->trackItem(DamageItem::ViewportLayout, snapshot->playerCount, Rectangle(0, 0, framebuffer.width, framebuffer.height));
+    trackWorldMapDamage(framebuffer);
+    damageTracker->endFrame();
+}
+
+// The players of the other viewports can walk into this one.
+static void trackPlayerDamage(const Framebuffer &framebuffer)
+{
+    for(int i = 0; i < MaxPlayers; ++i)
+    {
+        auto item = DamageItem(int(DamageItem::Player) + i);
+        if(i >= snapshot->playerCount || snapshot->isGameCompleted)
+        {
+            damageTracker->trackItem(item, 0, Rectangle());
+            continue;
+        }
+
+        auto player = viewedPlayer(i);
+        auto playerKey = uint64_t(1) | (uint64_t(player.flipHorizontal) << 1) | (uint64_t(player.flipVertical) << 2) | (uint64_t(player.inBoat) << 3) |
+            (uint64_t(player.spriteType) << 8) | (uint64_t(uint16_t(player.spriteRow)) << 16) | (uint64_t(uint16_t(player.spriteColumn)) << 32);
+        damageTracker->trackItem(item, playerKey, playerScreenRectangle(framebuffer, player));
+    }
+}
+
+static void trackDamage(const Framebuffer &framebuffer, const BackgroundView &view, FramebufferDamage &damage)
+{
+    damageTracker->beginFrame(framebuffer, damage);
+
+    // Scrolling moves everything, and the post process and the message cover the
+    // whole screen.
+    damageTracker->trackItem(DamageItem::BackgroundOrigin, uint32_t(view.originX) | (uint64_t(uint32_t(view.originY)) << 32), Rectangle(0, 0, framebuffer.width, framebuffer.height));
+    damageTracker->trackItem(DamageItem::PostProcess, screenEffects.key, Rectangle(0, 0, framebuffer.width, framebuffer.height));
+
+    damageTracker->trackItem(DamageItem::Message, retainedHud->message.getKey(), Rectangle(0, 0, framebuffer.width, framebuffer.height));
+
+    backgroundCache->addDirtyTilesTo(damage);
+    trackPlayerDamage(framebuffer);
+
+    for(int i = 0; i < visibleBullets.count; ++i)
+        damageTracker->trackTransient(visibleBullets.rectangles[i]);
+    for(int i = 0; i < visibleParticles.batchCount; ++i)
+        damageTracker->trackTransient(visibleParticles.batches[i].bounds);
+
+    trackHudDamage(framebuffer);
+    damageTracker->endFrame();
+}
+
+// The draw commands of everything but the sprites, the bullets and the
+// particles. They have at most one command for every sprite, visible bullet
+// and particle batch. A list that needs more commands grows.
+static constexpr int MaxFixedDrawCommands = 32;
+
+// Draws a viewport into its part of the framebuffer, which it sees as a whole
+// framebuffer, and reports its damage in the coordinates of the viewport. The
+// damage of the screen is drawn again in every viewport that it touches.
+static void renderViewport(const Framebuffer &framebuffer, int index, const FramebufferDamage &screenDamage, FramebufferDamage &damage)
+{
+    viewportIndex = index;
+    viewport = &snapshot->viewports[index];
+    backgroundCache = &backgroundCaches[index];
+    retainedHud = &retainedHuds[index];
+    damageTracker = &viewportDamageTrackers[index];
+
+    auto rectangle = splitScreenViewport(framebuffer.width, framebuffer.height, snapshot->playerCount, index);
+    auto viewportFramebuffer = Framebuffer(rectangle.width, rectangle.height, framebuffer.pitch,
+        framebuffer.pixels + rectangle.y*framebuffer.pitch + rectangle.x*4);
+
+    auto view = computeBackgroundView(viewportFramebuffer);
+    updateBackground(viewportFramebuffer, view);
+    updateHud(viewportFramebuffer);
+    computeScreenEffects(viewportFramebuffer);
+    cullBullets(viewportFramebuffer);
+    batchParticles(viewportFramebuffer);
+    trackDamage(viewportFramebuffer, view, damage);
+
+    auto bounds = Rectangle(0, 0, rectangle.width, rectangle.height);
+    for(int i = 0; i < screenDamage.rectangleCount; ++i)
+    {
+        const auto &screenRectangle = screenDamage.rectangles[i];
+        damage.addRectangle(Rectangle(screenRectangle.x - rectangle.x, screenRectangle.y - rectangle.y, screenRectangle.width, screenRectangle.height).intersectionWith(bounds));
+    }
+
+    if(damage.isEmpty())
+        return;
+
+    DrawCommandList commands(maxSpriteCount(view) + visibleBullets.count + visibleParticles.batchCount + MaxFixedDrawCommands);
+    renderBackground(commands, viewportFramebuffer, view);
+    renderSprites(commands, viewportFramebuffer, view);
+    renderParticles(commands);
+    renderBullets(commands, viewportFramebuffer);
+    renderPostProcess(commands, viewportFramebuffer);
+    renderHud(commands, viewportFramebuffer);
+    commands.execute(viewportFramebuffer, damage);
+}
+
+void render(const Framebuffer &framebuffer, FramebufferDamage &damage)
+{
+    clearTransientMemory();
+    snapshot = getRenderSnapshot();
+    if(!snapshot)
+    {
+        damage.clear();
+        return;
+    }
+
+    trackScreenDamage(framebuffer, damage);
+    if(snapshot->worldMap.isOpen)
+    {
+        if(damage.isEmpty())
+            return;
+
+        DrawCommandList commands(MaxFixedDrawCommands);
+        renderWorldMap(commands, framebuffer);
+        commands.execute(framebuffer, damage);
+        return;
+    }
+
+    // The separators between the viewports are black.
+    for(int i = 0; i < damage.rectangleCount; ++i)
+    {
+        const auto &rectangle = damage.rectangles[i];
+        drawRectangle(framebuffer, 0xFF000000, rectangle.x, rectangle.y, rectangle.width, rectangle.height);
+    }
+
+    // The cells that a viewport composites are copied by the next ones.
+    tileCellCache.beginFrame();
+    auto screenDamage = damage;
+    for(int i = 0; i < snapshot->playerCount; ++i)
+    {
+        FramebufferDamage viewportDamage;
+        renderViewport(framebuffer, i, screenDamage, viewportDamage);
+
+        auto rectangle = splitScreenViewport(framebuffer.width, framebuffer.height, snapshot->playerCount, i);
+        for(int j = 0; j < viewportDamage.rectangleCount; ++j)
+        {
+            const auto &viewportRectangle = viewportDamage.rectangles[j];
+            damage.addRectangle(Rectangle(viewportRectangle.x + rectangle.x, viewportRectangle.y + rectangle.y, viewportRectangle.width, viewportRectangle.height));
+        }
+    }
+}
+
+static int screenWidth = ScreenWidth;
+static int screenHeight = ScreenHeight;
+
+void setScreenSize(int width, int height)
+{
+    screenWidth = width;
+    screenHeight = height;
 }
 
-static void renderHud(const Framebuffer &framebuffer)
+Rectangle splitScreenViewport(int width, int height, int viewportCount, int index)
 {
-    renderMinimap(framebuffer);
-    renderHealth(framebuffer);
-    renderBelly(framebuffer);
-    renderAmmo(framebuffer);
-    renderGameTime(framebuffer);
+    if(viewportCount <= 1)
+        return Rectangle(0, 0, width, height);
 
-    renderMessage(framebuffer);
+    auto rows = viewportCount == 2 ? 1 : 2;
+    auto viewportWidth = (width - SplitScreenSeparatorSize) / 2;
+    auto viewportHeight = (height - SplitScreenSeparatorSize*(rows - 1)) / rows;
+    return Rectangle((index % 2)*(width - viewportWidth), (index / 2)*(height - viewportHeight), viewportWidth, viewportHeight);
 }
 
-void render(const Framebuffer &framebuffer)
+int getScreenCount()
 {
-    renderBackground(framebuffer);
-    renderEntities(framebuffer);
-    renderBullets(framebuffer);
-    renderPostProcess(framebuffer);
-    renderHud(framebuffer);
+    return global.playerCount;
 }
 
-Box2 getScreenBoundingBox()
+Box2 getScreenBoundingBox(int screen)
 {
-    Vector2 halfExtent = pixels2Units(Vector2(ScreenWidth/2, ScreenHeight/2));
+    auto rectangle = splitScreenViewport(screenWidth, screenHeight, global.playerCount, screen);
+    Vector2 halfExtent = pixels2Units(Vector2(rectangle.width/2, rectangle.height/2)) * (1.0f / global.cameras[screen].zoom());
 
     return Box2(-halfExtent, halfExtent);
 }
 
-Box2 getScreenWorldBoundingBox()
+Box2 getScreenWorldBoundingBox(int screen)
 {
-    return getScreenBoundingBox().translatedBy(global.camera.position);
+    return getScreenBoundingBox(screen).translatedBy(global.cameras[screen].position);
 }
@@ -5,6 +5,7 @@
 #include "Framebuffer.hpp"
 #include "Box2.hpp"
 
+// The screen size until a different one is set.
 static constexpr int ScreenWidth = 640;
 static constexpr int ScreenHeight = 480;
 
@@ -28,9 +29,34 @@ inline uint32_t convertRGBAHex(uint32_t color)
     return encodeColor(b, g, r, a);
 }
 
-void render(const Framebuffer &framebuffer);
+// Draws the regions of the framebuffer that changed since the previous call,
+// and reports them in damage. The framebuffer contents must be preserved
+// between calls; a different framebuffer is drawn whole. Every player has a
+// viewport of the framebuffer.
+void render(const Framebuffer &framebuffer, FramebufferDamage &damage);
 
-Box2 getScreenBoundingBox();
-Box2 getScreenWorldBoundingBox();
+// The game logic considers on screen what the viewports of a screen of this
+// size around the cameras show.
+void setScreenSize(int width, int height);
+
+// The part of a screen of the given size that shows the view of one of
+// viewportCount players. Two players split it in halves side by side and more
+// in quadrants, apart by a black separator.
+static constexpr int SplitScreenSeparatorSize = 2;
+Rectangle splitScreenViewport(int width, int height, int viewportCount, int index);
+
+struct TileCellCacheCounters
+{
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Lookups in the cache of composited background tiles since the start.
+TileCellCacheCounters getTileCellCacheCounters();
+
+// Every player has a screen, which is its viewport.
+int getScreenCount();
+Box2 getScreenBoundingBox(int screen);
+Box2 getScreenWorldBoundingBox(int screen);
 
 #endif //SMALL_ECO_DESTROYED_RENDERER_HPP
@@ -34,6 +34,23 @@ static struct TileColors
     }
 } tileColorsClass;
 
+// The terrain with the higher precedence spills over the edges of its
+// neighbours. The solid tiles have none, and keep their hard edges.
+static const uint8_t TileTransitionPrecedences[(int)TileType::Count] = {
+    /* None */ 0,
+    /* DeepWater */ 1,
+    /* Water */ 2,
+    /* ShallowWater */ 3,
+    /* Ice */ 4,
+    /* Sand */ 5,
+    /* Grass */ 7,
+    /* Forest */ 8,
+    /* Earth */ 6,
+    /* Rock */ 0,
+    /* DevilStone */ 0,
+    /* HolyBarrier */ 0,
+};
+
 static float TileOccupantProbabilities[(int)TileOccupant::Count] = {
     /* None */ 40000,
 
@@ -155,6 +172,7 @@ void TileMap::loadFromFile(const char *fileName)
     image.destroy();
 
     postProcess();
+    computeTransitions();
 }
 
 void TileMap::postProcess()
@@ -183,3 +201,61 @@ void TileMap::postProcess()
         }
     }
 }
+
+// The overlay is the neighbour with the highest precedence over the tile, and
+// it covers every edge that it is on.
+static uint8_t computeTileTransition(const TileType *tiles, int x, int y)
+{
+    auto center = tiles[y*TileMap::Width + x];
+    auto centerPrecedence = TileTransitionPrecedences[int(center)];
+    if(centerPrecedence == 0)
+        return 0;
+
+    TileType neighbours[4];
+    neighbours[0] = tiles[floorModule(y + 1, TileMap::Height)*TileMap::Width + x];
+    neighbours[1] = tiles[y*TileMap::Width + floorModule(x + 1, TileMap::Width)];
+    neighbours[2] = tiles[floorModule(y - 1, TileMap::Height)*TileMap::Width + x];
+    neighbours[3] = tiles[y*TileMap::Width + floorModule(x - 1, TileMap::Width)];
+
+    auto overlay = center;
+    auto overlayPrecedence = centerPrecedence;
+    for(auto neighbour : neighbours)
+    {
+        auto precedence = TileTransitionPrecedences[int(neighbour)];
+        if(precedence > overlayPrecedence)
+        {
+            overlay = neighbour;
+            overlayPrecedence = precedence;
+        }
+    }
+
+    uint32_t edges = 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        if(overlay != center && neighbours[i] == overlay)
+            edges |= 1<<i;
+    }
+    return makeTileTransition(overlay, edges);
+}
+
+void TileMap::computeTransitions()
+{
+    for(int y = 0; y < Height; ++y)
+    {
+        for(int x = 0; x < Width; ++x)
+            transitions[y*Width + x] = computeTileTransition(tiles, x, y);
+    }
+}
+
+void TileMap::updateTransitionsAround(size_t tileIndex)
+{
+    int x = tileIndex % Width;
+    int y = tileIndex / Width;
+    static const int Offsets[][2] = {{0, 0}, {0, 1}, {1, 0}, {0, -1}, {-1, 0}};
+    for(const auto &offset : Offsets)
+    {
+        auto neighbourX = floorModule(x + offset[0], Width);
+        auto neighbourY = floorModule(y + offset[1], Height);
+        transitions[neighbourY*Width + neighbourX] = computeTileTransition(tiles, neighbourX, neighbourY);
+    }
+}
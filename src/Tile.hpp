@@ -7,9 +7,15 @@
 #include "Rectangle.hpp"
 #include "Image.hpp"
 #include "Box2.hpp"
+#include "GameInterface.hpp"
 #include <assert.h>
+#include <stdio.h>
+#include <algorithm>
+#include <array>
+#include <map>
 
-Box2 getScreenWorldBoundingBox();
+int getScreenCount();
+Box2 getScreenWorldBoundingBox(int screen);
 
 enum class TileType: uint8_t
 {
@@ -74,6 +80,11 @@ inline bool isTileOccupantAStructure(TileOccupant occupant)
     return TileOccupant::StructureBegin <= occupant && occupant <= TileOccupant::StructureEnd;
 }
 
+inline bool isTileOccupantALightSource(TileOccupant occupant)
+{
+    return occupant == TileOccupant::Torch || occupant == TileOccupant::HellGate;
+}
+
 namespace TileTypeMask
 {
 enum Bits
@@ -98,6 +109,41 @@ enum Bits
 };
 };
 
+// The edges of a tile, where the north one is the top of its image.
+namespace TileEdge
+{
+enum Flag
+{
+    None = 0,
+    North = 1<<0,
+    East = 1<<1,
+    South = 1<<2,
+    West = 1<<3,
+
+    All = North | East | South | West,
+};
+};
+
+static_assert(int(TileType::Count) <= 16, "The tile transitions keep the type in four bits");
+
+// How the terrain of a neighbour spills over a tile: the type of that terrain in
+// the high four bits, and the edges of the tile that it covers in the low ones.
+// Zero is no transition.
+inline uint8_t makeTileTransition(TileType overlay, uint32_t edges)
+{
+    return edges != TileEdge::None ? uint8_t((int(overlay) << 4) | edges) : 0;
+}
+
+inline TileType tileTransitionOverlay(uint8_t transition)
+{
+    return TileType(transition >> 4);
+}
+
+inline uint32_t tileTransitionEdges(uint8_t transition)
+{
+    return transition & TileEdge::All;
+}
+
 inline bool isPassableOccupant(TileOccupant occupant)
 {
     return !isTileOccupantAStructure(occupant);
@@ -208,6 +254,11 @@ struct TileMap
     void loadFromFile(const char *fileName);
     void postProcess();
 
+    // The transitions only depend on the tile and its four neighbours, so a
+    // changed tile updates itself and them.
+    void computeTransitions();
+    void updateTransitionsAround(size_t tileIndex);
+
     size_t tileIndexAtRowColumn(size_t row, size_t column)
     {
         return row*Width + column;
@@ -224,65 +275,433 @@ struct TileMap
     uint32_t tileRandom[Width*Height];
     TileOccupant occupants[Width*Height];
     TileOccupantState occupantStates[Width*Height];
+    uint8_t transitions[Width*Height];
 
+    // The tiles on several screens are only visited once, for the first one.
     template<typename FT>
     void screenTilesDo(const FT &f)
     {
-        auto screenBox = getScreenWorldBoundingBox();
-        auto minPosition = screenBox.min.floor();
-        auto maxPosition = screenBox.max.floor();
+        int minXs[MaxPlayers], minYs[MaxPlayers], maxXs[MaxPlayers], maxYs[MaxPlayers];
+        auto screenCount = getScreenCount();
+        for(int screen = 0; screen < screenCount; ++screen)
+        {
+            auto screenBox = getScreenWorldBoundingBox(screen);
+            auto minPosition = screenBox.min.floor();
+            auto maxPosition = screenBox.max.floor();
 
-        int minX = minPosition.x;
-        int minY = minPosition.y;
-        int maxX = maxPosition.x;
-        int maxY = maxPosition.y;
+            int minX = minXs[screen] = minPosition.x;
+            int minY = minYs[screen] = minPosition.y;
+            int maxX = maxXs[screen] = maxPosition.x;
+            int maxY = maxYs[screen] = maxPosition.y;
 
-        for(int y = minY; y <= maxY; ++y)
-        {
-            auto tileRow = floorModule(y, Height);
-            for(int x = minX; x <= maxX; ++x)
+            for(int y = minY; y <= maxY; ++y)
             {
-                auto tx = floorModule(x, Width);
-                f(tileRow, tx);
+                auto tileRow = floorModule(y, Height);
+                for(int x = minX; x <= maxX; ++x)
+                {
+                    auto tx = floorModule(x, Width);
+                    auto isOnPreviousScreen = false;
+                    for(int previous = 0; previous < screen && !isOnPreviousScreen; ++previous)
+                    {
+                        isOnPreviousScreen = floorModule(tx - minXs[previous], Width) <= maxXs[previous] - minXs[previous] &&
+                            floorModule(tileRow - minYs[previous], Height) <= maxYs[previous] - minYs[previous];
+                    }
+
+                    if(!isOnPreviousScreen)
+                        f(tileRow, tx);
+                }
             }
         }
     }
 };
 
-template<int W, int H>
-struct TileSetImage
+enum class TileCellOpacity : uint8_t
+{
+    Transparent = 0,
+    Opaque,
+    Mixed,
+
+    // A mixed cell whose spans did not fit in the span pool.
+    AlphaTested,
+
+    // A cell of a premultiplied tile set with pixels that are neither
+    // transparent nor opaque, whose spans are blended over the destination.
+    Translucent,
+
+    // A translucent cell whose spans did not fit in the span pool.
+    Blended,
+};
+
+// How the alpha of a tile set is read. A straight alpha is only tested, so any
+// alpha but zero is opaque. A premultiplied set has its colors scaled by their
+// alpha when it is loaded, and is blended over the destination.
+enum class TileSetAlpha : uint8_t
+{
+    Straight = 0,
+    Premultiplied,
+};
+
+// Every color channel is scaled by the alpha, rounded to the nearest.
+inline uint32_t premultipliedColor(uint32_t color)
+{
+    auto alpha = color >> 24;
+    auto result = color & 0xFF000000;
+    for(int shift = 0; shift < 24; shift += 8)
+        result |= ((((color >> shift) & 0xFF)*alpha + 127) / 255) << shift;
+    return result;
+}
+
+// Run of visible pixels in a cell row, in cell local columns [begin, end).
+struct TileSpan
+{
+    uint8_t begin;
+    uint8_t end;
+};
+
+// Order of the pixels of a tile set in memory.
+enum class TileSetLayout : uint8_t
+{
+    // Whole image rows, as they are in the file.
+    RowMajor = 0,
+
+    // Every cell is stored contiguously, row after row, so a cell blit walks a
+    // single block of memory instead of striding through the whole image. A
+    // 32x32 cell of the map tile set reads the same 32 cache lines in both
+    // layouts, but they sit in one 4 KB page instead of eight, and they do not
+    // all fall in the same few cache sets.
+    SwizzledCells,
+};
+
+#ifdef USE_SWIZZLED_TILE_SETS
+static constexpr TileSetLayout DefaultTileSetLayout = TileSetLayout::SwizzledCells;
+#else
+static constexpr TileSetLayout DefaultTileSetLayout = TileSetLayout::RowMajor;
+#endif
+
+// Cell geometry, memory layout and per cell opacity of a tile set image. The
+// pixel storage is left to the image formats below.
+template<int W, int H, int CW, int CH, TileSetLayout L>
+struct TileSetCells
 {
     static constexpr int Width = W;
     static constexpr int Height = H;
+    static constexpr int CellWidth = CW;
+    static constexpr int CellHeight = CH;
+    static constexpr int CellColumns = W / CW;
+    static constexpr int CellRows = H / CH;
+    static constexpr int CellCount = CellColumns*CellRows;
+    static constexpr int MaxSpanCount = W*H/16;
+    static constexpr TileSetLayout Layout = L;
+
+    // Distance in data between two pixels in the same column of a cell.
+    static constexpr int RowPitch = Layout == TileSetLayout::SwizzledCells ? CellWidth : Width;
+
+    static_assert(CW <= 255, "Cell spans are stored in bytes");
+    static_assert(MaxSpanCount <= 0xFFFF, "Cell span indices are stored in 16 bits");
+    static_assert(W % CW == 0, "The cells must cover the whole image rows");
+
+    // Index in data of the pixel (x, y) of the image. When swizzled, each band of
+    // cell rows is stored cell after cell; the rows below the last whole cell row
+    // form a band of shorter cells.
+    static int pixelIndex(int x, int y)
+    {
+        if(Layout == TileSetLayout::SwizzledCells)
+        {
+            auto bandTop = y - y % CellHeight;
+            auto bandHeight = std::min(CellHeight, Height - bandTop);
+            return bandTop*Width + (x / CellWidth)*CellWidth*bandHeight + (y - bandTop)*CellWidth + x % CellWidth;
+        }
+
+        return y*Width + x;
+    }
+
+    Rectangle getTileRectangle(int row, int column, int tileWidth = Units2Pixels, int tileHeight = Units2Pixels)
+    {
+        return Rectangle(column*tileWidth, row * tileHeight, tileWidth, tileHeight);
+    }
+
+    Rectangle wholeRectangle() const
+    {
+        return Rectangle(0, 0, Width, Height);
+    }
+
+    bool isRectangleInsideOneCell(const Rectangle &rectangle) const
+    {
+        return rectangle.x / CellWidth == (rectangle.x + rectangle.width - 1) / CellWidth &&
+            rectangle.y / CellHeight == (rectangle.y + rectangle.height - 1) / CellHeight;
+    }
+
+    // Index of the cell covered exactly by the rectangle, or -1 if there is none.
+    int cellIndexOfRectangle(const Rectangle &rectangle) const
+    {
+        if(rectangle.width != CellWidth || rectangle.height != CellHeight ||
+            rectangle.x % CellWidth != 0 || rectangle.y % CellHeight != 0)
+            return -1;
+
+        auto column = rectangle.x / CellWidth;
+        auto row = rectangle.y / CellHeight;
+        if(column < 0 || column >= CellColumns || row < 0 || row >= CellRows)
+            return -1;
+        return row*CellColumns + column;
+    }
+
+    const TileSpan *rowSpansBegin(int cellIndex, int row) const
+    {
+        return spans + rowSpanStart[cellIndex*CellHeight + row];
+    }
+
+    const TileSpan *rowSpansEnd(int cellIndex, int row) const
+    {
+        return spans + rowSpanStart[cellIndex*CellHeight + row + 1];
+    }
+
+    // alphaOf receives the index in data of a pixel. A straight alpha is seen as
+    // zero or opaque.
+    template<typename AlphaFunction>
+    void analyzeCells(TileSetAlpha newAlpha, const AlphaFunction &alphaOf)
+    {
+        alpha = newAlpha;
+        auto cellAlpha = [&](int index) {
+            auto value = alphaOf(index);
+            return alpha == TileSetAlpha::Straight && value != 0 ? 255u : value;
+        };
+
+        int spanCount = 0;
+        for(int cell = 0; cell < CellCount; ++cell)
+        {
+            auto cellStart = pixelIndex((cell % CellColumns)*CellWidth, (cell / CellColumns)*CellHeight);
+            auto firstSpan = spanCount;
+            auto visibleCount = 0;
+            auto translucentCount = 0;
+            bool overflow = false;
+
+            for(int y = 0; y < CellHeight; ++y)
+            {
+                rowSpanStart[cell*CellHeight + y] = spanCount;
+                auto row = cellStart + y*RowPitch;
+                for(int x = 0; x < CellWidth; )
+                {
+                    if(cellAlpha(row + x) == 0)
+                    {
+                        ++x;
+                        continue;
+                    }
+
+                    auto begin = x;
+                    for(; x < CellWidth && cellAlpha(row + x) != 0; ++x)
+                        translucentCount += cellAlpha(row + x) != 255;
+
+                    visibleCount += x - begin;
+                    if(spanCount < MaxSpanCount)
+                        spans[spanCount++] = TileSpan{uint8_t(begin), uint8_t(x)};
+                    else
+                        overflow = true;
+                }
+            }
+
+            auto &opacity = cellOpacity[cell];
+            if(visibleCount == 0)
+                opacity = TileCellOpacity::Transparent;
+            else if(visibleCount == CellWidth*CellHeight && translucentCount == 0)
+                opacity = TileCellOpacity::Opaque;
+            else if(translucentCount > 0)
+                opacity = overflow ? TileCellOpacity::Blended : TileCellOpacity::Translucent;
+            else if(overflow)
+                opacity = TileCellOpacity::AlphaTested;
+            else
+                opacity = TileCellOpacity::Mixed;
+
+            // Only the mixed and the translucent cells need their spans.
+            if(opacity != TileCellOpacity::Mixed && opacity != TileCellOpacity::Translucent)
+            {
+                spanCount = firstSpan;
+                for(int y = 0; y < CellHeight; ++y)
+                    rowSpanStart[cell*CellHeight + y] = spanCount;
+            }
+        }
+
+        rowSpanStart[CellCount*CellHeight] = spanCount;
+    }
+
+    // How the rectangles that are not a whole cell are drawn.
+    TileCellOpacity partialOpacity() const
+    {
+        return alpha == TileSetAlpha::Premultiplied ? TileCellOpacity::Blended : TileCellOpacity::AlphaTested;
+    }
+
+    TileSetAlpha alpha;
+    TileCellOpacity cellOpacity[CellCount];
+    uint16_t rowSpanStart[CellCount*CellHeight + 1];
+    TileSpan spans[MaxSpanCount];
+};
+
+template<int W, int H, int CW = 32, int CH = 32, TileSetLayout L = DefaultTileSetLayout>
+struct TileSetImage : TileSetCells<W, H, CW, CH, L>
+{
+    typedef TileSetCells<W, H, CW, CH, L> Cells;
 
-    void loadFromFile(const char *fileName)
+    void loadFromFile(const char *fileName, TileSetAlpha alpha = TileSetAlpha::Straight)
     {
         Image image;
         image.load(fileName);
-        assert(image.width == Width);
-        assert(image.height == Height);
+        assert(image.width == W);
+        assert(image.height == H);
         assert(image.bpp == 32);
-        assert(image.pitch == Width*4);
+        assert(image.pitch == W*4);
 
-        memcpy(data, image.data, sizeof(data));
+        auto source = reinterpret_cast<const uint32_t*> (image.data);
+        if(L == TileSetLayout::SwizzledCells)
+        {
+            for(int y = 0; y < H; ++y)
+            {
+                for(int x = 0; x < W; x += CW)
+                    memcpy(data + Cells::pixelIndex(x, y), source + y*W + x, CW*4);
+            }
+        }
+        else
+        {
+            memcpy(data, source, sizeof(data));
+        }
         image.destroy();
+
+        if(alpha == TileSetAlpha::Premultiplied)
+        {
+            for(auto &color : data)
+                color = premultipliedColor(color);
+        }
+
+        this->analyzeCells(alpha, [&](int index) {
+            return data[index] >> 24;
+        });
     }
 
-    Rectangle getTileRectangle(int row, int column, int tileWidth = Units2Pixels, int tileHeight = Units2Pixels)
+    uint32_t data[W*H];
+};
+
+// Tile set whose pixels are indices into a palette of up to PC colors. The
+// image can be drawn with any of its PN palettes, which recolor the whole set.
+template<typename IT, int PC, int PN, int W, int H, int CW = 32, int CH = 32, TileSetLayout L = DefaultTileSetLayout>
+struct IndexedTileSetImage : TileSetCells<W, H, CW, CH, L>
+{
+    typedef TileSetCells<W, H, CW, CH, L> Cells;
+    typedef IT IndexType;
+
+    static constexpr int PaletteCapacity = PC;
+    static constexpr int PaletteCount = PN;
+
+    static_assert(PC <= (1 << (8*sizeof(IT))), "The palette does not fit the index type");
+
+    // The palette p takes its colors from the cells that are p*paletteCellStride
+    // cell columns to the right of the first paletteCellStride cell columns. Every
+    // other pixel looks the same with all the palettes. The opacity of the cells
+    // comes from the first palette. Returns false when the image has more colors
+    // than the palettes hold, and the colors that do not fit were drawn with the
+    // nearest ones.
+    bool loadFromFile(const char *fileName, int paletteCellStride = 0, TileSetAlpha alpha = TileSetAlpha::Straight)
     {
-        return Rectangle(column*tileWidth, row * tileHeight, tileWidth, tileHeight);
+        Image image;
+        image.load(fileName);
+        assert(image.width == W);
+        assert(image.height == H);
+        assert(image.bpp == 32);
+        assert(image.pitch == W*4);
+
+        typedef std::array<uint32_t, PN> PaletteColors;
+        std::map<PaletteColors, int> colorIndices;
+
+        auto source = reinterpret_cast<const uint32_t*> (image.data);
+        paletteSize = 0;
+        int droppedColorCount = 0;
+        for(int y = 0; y < H; ++y)
+        {
+            auto sourceRow = source + y*W;
+            for(int x = 0; x < W; ++x)
+            {
+                PaletteColors colors;
+                auto hasVariants = x / CW < paletteCellStride;
+                for(int p = 0; p < PN; ++p)
+                {
+                    auto variantX = x + p*paletteCellStride*CW;
+                    colors[p] = hasVariants && variantX < W ? sourceRow[variantX] : sourceRow[x];
+                }
+
+                auto it = colorIndices.find(colors);
+                if(it == colorIndices.end() && paletteSize == PC)
+                {
+                    ++droppedColorCount;
+                    it = colorIndices.insert(std::make_pair(colors, nearestPaletteIndex(colors))).first;
+                }
+                else if(it == colorIndices.end())
+                {
+                    for(int p = 0; p < PN; ++p)
+                        palettes[p][paletteSize] = colors[p];
+                    it = colorIndices.insert(std::make_pair(colors, paletteSize++)).first;
+                }
+
+                data[Cells::pixelIndex(x, y)] = IT(it->second);
+            }
+        }
+        image.destroy();
+
+        if(droppedColorCount > 0)
+            fprintf(stderr, "Tile set %s has %d colors more than the %d of its palettes\n", fileName, droppedColorCount, PC);
+
+        if(alpha == TileSetAlpha::Premultiplied)
+        {
+            for(int p = 0; p < PN; ++p)
+            {
+                for(int i = 0; i < paletteSize; ++i)
+                    palettes[p][i] = premultipliedColor(palettes[p][i]);
+            }
+        }
+
+        this->analyzeCells(alpha, [&](int index) {
+            return palettes[0][data[index]] >> 24;
+        });
+        return droppedColorCount == 0;
     }
 
-    Rectangle wholeRectangle() const
+    const uint32_t *palette(int index) const
     {
-        return Rectangle(0, 0, Width, Height);
+        return palettes[index];
     }
 
-    uint32_t data[Width*Height];
+    IT data[W*H];
+    int paletteSize;
+    uint32_t palettes[PN][PC];
+
+private:
+    // The palette entry whose colors have the smallest sum of squared channel
+    // differences with the colors of every palette.
+    template<typename PaletteColors>
+    int nearestPaletteIndex(const PaletteColors &colors) const
+    {
+        int nearest = 0;
+        auto nearestDistance = ~uint64_t(0);
+        for(int i = 0; i < paletteSize; ++i)
+        {
+            uint64_t distance = 0;
+            for(int p = 0; p < PN; ++p)
+            {
+                for(int shift = 0; shift < 32; shift += 8)
+                {
+                    int difference = int((colors[p] >> shift) & 0xFF) - int((palettes[p][i] >> shift) & 0xFF);
+                    distance += difference*difference;
+                }
+            }
+
+            if(distance < nearestDistance)
+            {
+                nearest = i;
+                nearestDistance = distance;
+            }
+        }
+        return nearest;
+    }
 };
 
 using TileSet = TileSetImage<512,512>;
-using MiniMapImage = TileSetImage<128, 64>;
+using CharacterTileSet = IndexedTileSetImage<uint8_t, 256, 1, 512, 512, 32, 48>;
 
 
 #endif //SMALL_ECO_DESTROYED_TILE_HPP
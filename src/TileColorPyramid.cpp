@@ -0,0 +1,40 @@
+#include "TileColorPyramid.hpp"
+
+// Rounded per channel, the sums of four channels fit in the gaps of the masks.
+inline uint32_t averageColor(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    auto redBlue = (((a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) + (d & 0x00FF00FF) + 0x00020002) >> 2) & 0x00FF00FF;
+    auto greenAlpha = ((((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) + ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF) + 0x00020002) >> 2) & 0x00FF00FF;
+    return redBlue | (greenAlpha << 8);
+}
+
+void TileColorPyramid::build(const TileType *tiles)
+{
+    for(int i = 0; i < TileMap::Width*TileMap::Height; ++i)
+        texels[i] = tileColorPalette[int(tiles[i])];
+
+    for(int level = 1; level < LevelCount; ++level)
+    {
+        for(int y = 0; y < levelHeight(level); ++y)
+        {
+            for(int x = 0; x < levelWidth(level); ++x)
+                updateTexel(level, x, y);
+        }
+    }
+}
+
+void TileColorPyramid::updateTile(const TileType *tiles, int tileIndex)
+{
+    auto x = tileIndex % TileMap::Width;
+    auto y = tileIndex / TileMap::Width;
+    texels[tileIndex] = tileColorPalette[int(tiles[tileIndex])];
+    for(int level = 1; level < LevelCount; ++level)
+        updateTexel(level, x >>= 1, y >>= 1);
+}
+
+void TileColorPyramid::updateTexel(int level, int x, int y)
+{
+    auto source = levelTexels(level - 1) + 2*y*levelWidth(level - 1) + 2*x;
+    auto sourceAbove = source + levelWidth(level - 1);
+    texels[levelOffset(level) + y*levelWidth(level) + x] = averageColor(source[0], source[1], sourceAbove[0], sourceAbove[1]);
+}
@@ -0,0 +1,54 @@
+#ifndef SMALL_ECO_DESTROYED_TILE_COLOR_PYRAMID_HPP
+#define SMALL_ECO_DESTROYED_TILE_COLOR_PYRAMID_HPP
+
+#include "Tile.hpp"
+
+static constexpr int TileColorPyramidLevelCount = 9;
+
+// The texels of the levels from the given one down.
+static constexpr int tileColorPyramidTexelCount(int level)
+{
+    return level >= TileColorPyramidLevelCount ? 0 :
+        (TileMap::Width >> level)*(TileMap::Height >> level) + tileColorPyramidTexelCount(level + 1);
+}
+
+// The colors of the tiles of the map, and their averages over squares of 2, 4,
+// 8... tiles. A map drawn at any size samples the level that has about one
+// texel per pixel, instead of every tile under a pixel. The rows go up like
+// the world, and changing a tile only updates one texel of every level.
+class TileColorPyramid
+{
+public:
+    // From the whole map down to 2x1 texels.
+    static constexpr int LevelCount = TileColorPyramidLevelCount;
+
+    void build(const TileType *tiles);
+    void updateTile(const TileType *tiles, int tileIndex);
+
+    static int levelWidth(int level)
+    {
+        return TileMap::Width >> level;
+    }
+
+    static int levelHeight(int level)
+    {
+        return TileMap::Height >> level;
+    }
+
+    const uint32_t *levelTexels(int level) const
+    {
+        return texels + levelOffset(level);
+    }
+
+private:
+    static int levelOffset(int level)
+    {
+        return tileColorPyramidTexelCount(0) - tileColorPyramidTexelCount(level);
+    }
+
+    void updateTexel(int level, int x, int y);
+
+    uint32_t texels[tileColorPyramidTexelCount(0)];
+};
+
+#endif //SMALL_ECO_DESTROYED_TILE_COLOR_PYRAMID_HPP
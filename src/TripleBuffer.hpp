@@ -0,0 +1,57 @@
+#ifndef SMALL_ECO_DESTROYED_TRIPLE_BUFFER_HPP
+#define SMALL_ECO_DESTROYED_TRIPLE_BUFFER_HPP
+
+#include <stdint.h>
+#include <atomic>
+
+// Hands values from one producer thread to one consumer thread without locks.
+// The producer writes into its back buffer and publishes it, the consumer takes
+// the most recently published buffer. Neither side ever waits for the other,
+// and a published value that is not consumed in time is just skipped.
+template<typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer()
+        : backIndex(0), middle(1), frontIndex(2) {}
+
+    // Producer side.
+    T &back()
+    {
+        return buffers[backIndex];
+    }
+
+    void publish()
+    {
+        auto oldMiddle = middle.exchange(backIndex | FreshBit, std::memory_order_acq_rel);
+        backIndex = oldMiddle & IndexMask;
+    }
+
+    // Consumer side. Returns false when nothing was published since the last
+    // call, leaving the front buffer untouched.
+    bool consume()
+    {
+        if((middle.load(std::memory_order_relaxed) & FreshBit) == 0)
+            return false;
+
+        auto oldMiddle = middle.exchange(frontIndex, std::memory_order_acq_rel);
+        frontIndex = oldMiddle & IndexMask;
+        return true;
+    }
+
+    const T &front() const
+    {
+        return buffers[frontIndex];
+    }
+
+private:
+    static constexpr uint32_t IndexMask = 3;
+    static constexpr uint32_t FreshBit = 4;
+
+    T buffers[3];
+    uint32_t backIndex;
+    std::atomic<uint32_t> middle;
+    uint32_t frontIndex;
+};
+
+#endif //SMALL_ECO_DESTROYED_TRIPLE_BUFFER_HPP
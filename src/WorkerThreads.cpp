@@ -0,0 +1,187 @@
+#include "WorkerThreads.hpp"
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#ifndef __EMSCRIPTEN__
+#define HAS_WORKER_THREADS 1
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+#ifdef HAS_WORKER_THREADS
+static constexpr int MaxWorkerThreadCount = 32;
+
+static int defaultWorkerThreadCount()
+{
+    auto overridenCount = getenv("SMALCODED_RENDER_THREADS");
+    if(overridenCount)
+        return atoi(overridenCount);
+    return std::thread::hardware_concurrency();
+}
+
+// The threads are kept alive between jobs. They are joined when the game logic
+// is unloaded, so a live coding reload never leaves them running old code.
+class WorkerThreadPool
+{
+public:
+    WorkerThreadPool()
+        : threadCount(1), generation(0), quitting(false),
+          function(nullptr), context(nullptr), jobCount(0), pendingWorkers(0)
+    {
+        setThreadCount(defaultWorkerThreadCount());
+    }
+
+    ~WorkerThreadPool()
+    {
+        stopThreads();
+    }
+
+    int getThreadCount() const
+    {
+        return threadCount;
+    }
+
+    void setThreadCount(int count)
+    {
+        stopThreads();
+        threadCount = std::max(1, std::min(count, MaxWorkerThreadCount));
+    }
+
+    void run(int newJobCount, ParallelJobFunction newFunction, void *newContext)
+    {
+        if(threadCount <= 1 || newJobCount <= 1)
+        {
+            for(int i = 0; i < newJobCount; ++i)
+                newFunction(newContext, i);
+            return;
+        }
+
+        startThreads();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            function = newFunction;
+            context = newContext;
+            jobCount = newJobCount;
+            nextJob = 0;
+            pendingWorkers = int(threads.size());
+            ++generation;
+        }
+        workAvailable.notify_all();
+
+        executeJobs();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        workDone.wait(lock, [&]{ return pendingWorkers == 0; });
+    }
+
+private:
+    void startThreads()
+    {
+        if(!threads.empty())
+            return;
+
+        quitting = false;
+        for(int i = 1; i < threadCount; ++i)
+            threads.push_back(std::thread(&WorkerThreadPool::workerMain, this, generation));
+    }
+
+    void stopThreads()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+        }
+        workAvailable.notify_all();
+
+        for(auto &thread : threads)
+            thread.join();
+        threads.clear();
+    }
+
+    void executeJobs()
+    {
+        for(;;)
+        {
+            auto index = nextJob.fetch_add(1);
+            if(index >= jobCount)
+                break;
+            function(context, index);
+        }
+    }
+
+    void workerMain(uint64_t seenGeneration)
+    {
+        for(;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workAvailable.wait(lock, [&]{ return quitting || generation != seenGeneration; });
+                if(quitting)
+                    return;
+                seenGeneration = generation;
+            }
+
+            executeJobs();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(--pendingWorkers == 0)
+                    workDone.notify_one();
+            }
+        }
+    }
+
+    int threadCount;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable workDone;
+    uint64_t generation;
+    bool quitting;
+
+    ParallelJobFunction function;
+    void *context;
+    int jobCount;
+    std::atomic<int> nextJob;
+    int pendingWorkers;
+};
+
+static WorkerThreadPool workerThreadPool;
+
+int getWorkerThreadCount()
+{
+    return workerThreadPool.getThreadCount();
+}
+
+void setWorkerThreadCount(int count)
+{
+    workerThreadPool.setThreadCount(count);
+}
+
+void runParallelJob(int jobCount, ParallelJobFunction function, void *context)
+{
+    workerThreadPool.run(jobCount, function, context);
+}
+
+#else
+
+int getWorkerThreadCount()
+{
+    return 1;
+}
+
+void setWorkerThreadCount(int)
+{
+}
+
+void runParallelJob(int jobCount, ParallelJobFunction function, void *context)
+{
+    for(int i = 0; i < jobCount; ++i)
+        function(context, i);
+}
+
+#endif
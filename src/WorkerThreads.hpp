@@ -0,0 +1,25 @@
+#ifndef SMALL_ECO_DESTROYED_WORKER_THREADS_HPP
+#define SMALL_ECO_DESTROYED_WORKER_THREADS_HPP
+
+typedef void (*ParallelJobFunction)(void *context, int index);
+
+// Number of threads that take part in a parallel job, including the caller.
+// It defaults to the hardware concurrency, and it can be overriden with the
+// SMALCODED_RENDER_THREADS environment variable.
+int getWorkerThreadCount();
+void setWorkerThreadCount(int count);
+
+// Calls function(context, i) for every i in [0, jobCount), spreading the calls
+// between the persistent worker threads and the caller. Returns when all of
+// them are done.
+void runParallelJob(int jobCount, ParallelJobFunction function, void *context);
+
+template<typename FT>
+void parallelFor(int jobCount, const FT &f)
+{
+    runParallelJob(jobCount, [](void *context, int index) {
+        (*reinterpret_cast<const FT*> (context))(index);
+    }, const_cast<FT*> (&f));
+}
+
+#endif //SMALL_ECO_DESTROYED_WORKER_THREADS_HPP